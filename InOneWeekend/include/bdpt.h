@@ -0,0 +1,395 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "sky.h"
+#include "splat_buffer.h"
+
+#include <algorithm>
+#include <vector>
+
+
+struct path_vertex {
+    enum kind { camera_vertex, light_vertex, surface_vertex, sky_vertex };
+
+    kind   type = surface_vertex;
+    point3 p;
+    vec3   normal;    // Faces the side the subpath arrived from (outward for light vertices).
+    color  beta;
+    color  emission;  // Radiance the vertex emits back along the subpath.
+    const material* mat = nullptr;
+    bool   delta = false;
+    double pdf_fwd = 0;
+    double pdf_rev = 0;
+
+    bool on_surface() const { return type == surface_vertex || type == light_vertex; }
+
+    bool connectible() const {
+        return type == camera_vertex || type == light_vertex
+            || (type == surface_vertex && mat->is_diffuse());
+    }
+};
+
+
+// Bidirectional path tracer. Every camera sample pairs a camera subpath with a subpath
+// started on an emissive object and evaluates all connection strategies between them,
+// weighted by multiple importance sampling (balance heuristic). Strategies that connect a
+// light subpath straight to the camera (t = 1) land on some other pixel, so they are
+// splatted into the calling thread's splat_buffer instead of being returned.
+//
+// Only lambertian vertices are connectible; metal and dielectric bounces are treated as
+// specular. The sky has no light subpaths and is only reached by camera subpaths, so its
+// contribution is the plain path traced one.
+class bdpt_integrator {
+  public:
+    int max_depth = 10;   // Maximum ray segments per path, as in ray_color.
+
+    bdpt_integrator(const hittable& world, const hittable_list& lights, const camera& cam)
+      : world(world), cam(cam)
+    {
+        for (const auto& object : lights.objects) {
+            hit_record rec;
+            double area;
+            if (!object->sample_surface(rec, area))
+                continue;
+            emitters.push_back(object.get());
+            total_area += area;
+            emitter_cdf.push_back(total_area);
+        }
+    }
+
+    color sample(int i, int j, splat_buffer& splats, int thread) const {
+        thread_local std::vector<path_vertex> camera_path, light_path;
+
+        generate_camera_path(i, j, camera_path);
+        generate_light_path(light_path);
+
+        color L(0,0,0);
+        int camera_vertices = int(camera_path.size());
+        int light_vertices  = int(light_path.size());
+
+        for (int t = 1; t <= camera_vertices; t++) {
+            for (int s = 0; s <= light_vertices; s++) {
+                int segments = s + t - 1;
+                if ((s == 1 && t == 1) || segments < 1 || segments > max_depth)
+                    continue;
+
+                if (t == 1) {
+                    double x, y;
+                    auto c = connect_to_camera(light_path, camera_path, s, x, y);
+                    if (c.x() > 0 || c.y() > 0 || c.z() > 0)
+                        splats.add(thread, x, y, c);
+                } else {
+                    L += connect(light_path, camera_path, s, t);
+                }
+            }
+        }
+
+        return L;
+    }
+
+  private:
+    const hittable& world;
+    const camera&   cam;
+
+    std::vector<const hittable*> emitters;
+    std::vector<double> emitter_cdf;
+    double total_area = 0;
+
+    // Emitters are chosen proportionally to their area, so the density of any point on any
+    // light is simply 1 / total_area.
+    double pdf_light_origin() const {
+        return total_area > 0 ? 1 / total_area : 0;
+    }
+
+    void generate_camera_path(int i, int j, std::vector<path_vertex>& path) const {
+        path.clear();
+
+        // Box filtered only: light subpaths reach the film through the camera's importance,
+        // which has no reconstruction filter in it.
+        ray r = cam.get_ray(i, j);
+        path_vertex v;
+        v.type = path_vertex::camera_vertex;
+        v.p = r.origin();
+        v.normal = unit_vector(r.direction());
+        v.beta = color(1,1,1);
+        path.push_back(v);
+
+        random_walk(r, color(1,1,1), cam.direction_pdf(r.direction()), path, max_depth + 1, true);
+    }
+
+    void generate_light_path(std::vector<path_vertex>& path) const {
+        path.clear();
+        if (emitters.empty())
+            return;
+
+        auto u = random_double() * total_area;
+        auto k = std::upper_bound(emitter_cdf.begin(), emitter_cdf.end(), u) - emitter_cdf.begin();
+        const auto* emitter = emitters[std::min<size_t>(k, emitters.size() - 1)];
+
+        hit_record rec;
+        double area;
+        emitter->sample_surface(rec, area);
+
+        auto pdf_pos = pdf_light_origin();
+        path_vertex v;
+        v.type = path_vertex::light_vertex;
+        v.p = rec.p;
+        v.normal = rec.normal;
+        v.mat = rec.mat.get();
+        v.emission = rec.mat->emitted(rec);
+        v.beta = v.emission / pdf_pos;
+        v.pdf_fwd = pdf_pos;
+        path.push_back(v);
+
+        auto direction = rec.normal + random_unit_vector();
+        if (direction.near_zero())
+            direction = rec.normal;
+
+        auto pdf_dir = dot(unit_vector(direction), rec.normal) / pi;
+        auto beta = v.emission * pi / pdf_pos;
+        random_walk(ray(rec.p, direction), beta, pdf_dir, path, max_depth, false);
+    }
+
+    void random_walk(ray r, color beta, double pdf_dir, std::vector<path_vertex>& path,
+                     int max_vertices, bool camera_path) const
+    {
+        double pdf_fwd = pdf_dir;
+
+        while (int(path.size()) < max_vertices) {
+            hit_record rec;
+            if (!world.hit(r, interval(0.001, infinity), rec)) {
+                if (camera_path) {
+                    path_vertex v;
+                    v.type = path_vertex::sky_vertex;
+                    v.normal = unit_vector(r.direction());
+                    v.beta = beta;
+                    v.emission = sky_radiance(r.direction());
+                    path.push_back(v);
+                }
+                break;
+            }
+
+            path_vertex v;
+            v.p = rec.p;
+            v.normal = rec.normal;
+            v.beta = beta;
+            v.mat = rec.mat.get();
+            v.emission = rec.mat->emitted(rec);
+            v.pdf_fwd = convert_density(pdf_fwd, path.back(), v);
+            path.push_back(v);
+
+            if (int(path.size()) >= max_vertices)
+                break;
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                break;
+
+            double pdf_rev = 0;
+            auto& current = path.back();
+            if (rec.mat->is_diffuse()) {
+                pdf_fwd = std::fmax(0, dot(unit_vector(scattered.direction()), rec.normal)) / pi;
+                pdf_rev = std::fmax(0, dot(unit_vector(-r.direction()), rec.normal)) / pi;
+            } else {
+                current.delta = true;
+                pdf_fwd = 0;
+            }
+
+            auto& previous = path[path.size() - 2];
+            previous.pdf_rev = convert_density(pdf_rev, current, previous);
+
+            beta = beta * attenuation;
+            r = scattered;
+        }
+    }
+
+    static double convert_density(double pdf, const path_vertex& from, const path_vertex& to) {
+        auto w = to.p - from.p;
+        auto distance_squared = w.length_squared();
+        if (distance_squared == 0)
+            return 0;
+        if (to.on_surface())
+            pdf *= std::fabs(dot(to.normal, w)) / std::sqrt(distance_squared);
+        return pdf / distance_squared;
+    }
+
+    // Area density of sampling next from v. Every connectible scattering is lambertian, whose
+    // density does not depend on the incoming direction.
+    double pdf(const path_vertex& v, const path_vertex& next) const {
+        if (v.type == path_vertex::light_vertex)
+            return pdf_light(v, next);
+
+        auto w = next.p - v.p;
+        if (w.length_squared() == 0)
+            return 0;
+
+        double pdf_dir;
+        if (v.type == path_vertex::camera_vertex)
+            pdf_dir = cam.direction_pdf(w);
+        else if (v.mat && v.mat->is_diffuse())
+            pdf_dir = std::fmax(0, dot(unit_vector(w), v.normal)) / pi;
+        else
+            return 0;
+
+        return convert_density(pdf_dir, v, next);
+    }
+
+    // Area density of an emitter at v sending its cosine-distributed light towards next.
+    static double pdf_light(const path_vertex& v, const path_vertex& next) {
+        auto w = next.p - v.p;
+        if (w.length_squared() == 0)
+            return 0;
+        auto cos_theta = dot(unit_vector(w), v.normal);
+        return cos_theta > 0 ? convert_density(cos_theta / pi, v, next) : 0;
+    }
+
+    static color f(const path_vertex& v, const vec3& direction) {
+        if (v.type == path_vertex::light_vertex)
+            return dot(direction, v.normal) > 0 ? color(1,1,1) : color(0,0,0);
+        if (dot(direction, v.normal) <= 0)
+            return color(0,0,0);
+        return v.mat->diffuse_albedo() / pi;
+    }
+
+    bool visible(const point3& a, const point3& b) const {
+        hit_record rec;
+        return !world.hit(ray(a, b - a), interval(0.001, 0.999), rec);
+    }
+
+    static bool is_black(const color& c) {
+        return c.x() <= 0 && c.y() <= 0 && c.z() <= 0;
+    }
+
+    color connect(std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path,
+                  int s, int t) const
+    {
+        const auto& pt = camera_path[t-1];
+
+        if (s == 0) {
+            if (pt.type == path_vertex::sky_vertex)
+                return pt.beta * pt.emission;
+            if (is_black(pt.emission))
+                return color(0,0,0);
+            return pt.beta * pt.emission * mis_weight(light_path, camera_path, s, t, nullptr);
+        }
+
+        const auto& qs = light_path[s-1];
+        if (pt.type == path_vertex::sky_vertex || !pt.connectible() || !qs.connectible())
+            return color(0,0,0);
+
+        auto w = pt.p - qs.p;
+        auto distance_squared = w.length_squared();
+        if (distance_squared == 0)
+            return color(0,0,0);
+        auto d = w / std::sqrt(distance_squared);
+
+        auto L = qs.beta * f(qs, d) * f(pt, -d) * pt.beta;
+        if (is_black(L))
+            return color(0,0,0);
+
+        auto g = std::fabs(dot(qs.normal, d)) * std::fabs(dot(pt.normal, d)) / distance_squared;
+        if (g == 0 || !visible(qs.p, pt.p))
+            return color(0,0,0);
+
+        return g * L * mis_weight(light_path, camera_path, s, t, nullptr);
+    }
+
+    color connect_to_camera(std::vector<path_vertex>& light_path,
+                            std::vector<path_vertex>& camera_path, int s,
+                            double& x, double& y) const
+    {
+        const auto& qs = light_path[s-1];
+        if (!cam.is_pinhole() || !qs.connectible() || qs.type != path_vertex::surface_vertex)
+            return color(0,0,0);
+
+        if (!cam.raster_position(qs.p, x, y))
+            return color(0,0,0);
+
+        auto w = cam.position() - qs.p;
+        auto distance_squared = w.length_squared();
+        auto d = w / std::sqrt(distance_squared);
+
+        // Importance arriving at qs, W_e / pdf, where sampling the pinhole from qs has solid
+        // angle density distance^2 / cos(theta) at the camera.
+        auto we = cam.importance(-w);
+        if (we == 0)
+            return color(0,0,0);
+
+        path_vertex sampled;
+        sampled.type = path_vertex::camera_vertex;
+        sampled.p = cam.position();
+        sampled.normal = cam.forward();
+        sampled.beta = color(1,1,1) * (we * dot(-d, cam.forward()) / distance_squared);
+
+        auto L = qs.beta * f(qs, d) * sampled.beta * std::fabs(dot(d, qs.normal));
+        if (is_black(L) || !visible(qs.p, cam.position()))
+            return color(0,0,0);
+
+        return L * mis_weight(light_path, camera_path, s, 1, &sampled);
+    }
+
+    double mis_weight(std::vector<path_vertex>& light_path, std::vector<path_vertex>& camera_path,
+                      int s, int t, const path_vertex* sampled) const
+    {
+        if (s + t == 2)
+            return 1;
+        if (s == 0 && emitters.empty())
+            return 1;
+
+        path_vertex* qs      = s > 0 ? &light_path[s-1]  : nullptr;
+        path_vertex* pt      = t > 0 ? &camera_path[t-1] : nullptr;
+        path_vertex* qs_prev = s > 1 ? &light_path[s-2]  : nullptr;
+        path_vertex* pt_prev = t > 1 ? &camera_path[t-2] : nullptr;
+
+        // Rewrite the densities around the connection as if this strategy had sampled the
+        // whole path, evaluate the ratios, then put the subpaths back as they were.
+        path_vertex saved[4];
+        path_vertex* touched[4] = { qs, pt, qs_prev, pt_prev };
+        for (int k = 0; k < 4; k++)
+            if (touched[k]) saved[k] = *touched[k];
+
+        if (t == 1 && sampled)
+            *pt = *sampled;
+        if (pt) pt->delta = false;
+        if (qs) qs->delta = false;
+
+        if (pt)
+            pt->pdf_rev = s > 0 ? pdf(*qs, *pt) : pdf_light_origin();
+        if (pt_prev)
+            pt_prev->pdf_rev = s > 0 ? pdf(*pt, *pt_prev) : pdf_light(*pt, *pt_prev);
+        if (qs)
+            qs->pdf_rev = pdf(*pt, *qs);
+        if (qs_prev)
+            qs_prev->pdf_rev = pdf(*qs, *qs_prev);
+
+        auto remap0 = [](double x) { return x != 0 ? x : 1.0; };
+        double sum_ri = 0;
+
+        double ri = 1;
+        for (int i = t - 1; i > 0; i--) {
+            ri *= remap0(camera_path[i].pdf_rev) / remap0(camera_path[i].pdf_fwd);
+            // i == 1 is the light-to-camera strategy, which a lens camera cannot use.
+            if (!camera_path[i].delta && !camera_path[i-1].delta && (i > 1 || cam.is_pinhole()))
+                sum_ri += ri;
+        }
+
+        ri = 1;
+        for (int i = s - 1; i >= 0; i--) {
+            ri *= remap0(light_path[i].pdf_rev) / remap0(light_path[i].pdf_fwd);
+            bool delta_previous = i > 0 ? light_path[i-1].delta : false;
+            if (!light_path[i].delta && !delta_previous)
+                sum_ri += ri;
+        }
+
+        for (int k = 0; k < 4; k++)
+            if (touched[k]) *touched[k] = saved[k];
+
+        return 1 / (1 + sum_ri);
+    }
+};
+
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "camera.h"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+
+// Times closest-hit queries of different acceleration structures over one fixed ray set:
+// camera rays through random pixels, plus a diffuse bounce from each of their hits so the
+// incoherent secondary rays a path tracer mostly spends its time on are covered too. Every
+// structure's answers are checked against a reference so a faster result is also a correct one.
+class accelerator_bench {
+  public:
+    accelerator_bench(const hittable& reference, const camera& cam, int image_width,
+                      int image_height, int primary_rays)
+    {
+        for (int k = 0; k < primary_rays; k++) {
+            int i = int(random_double() * image_width);
+            int j = int(random_double() * image_height);
+            ray r = cam.get_ray(i, j);
+            add_ray(reference, r);
+
+            hit_record rec;
+            if (reference.hit(r, interval(0.001, infinity), rec))
+                add_ray(reference, ray(rec.p, rec.normal + random_unit_vector()));
+        }
+    }
+
+    size_t ray_count() const { return rays.size(); }
+
+    // Traces the ray set repeatedly for at least min_seconds on one thread and prints a row
+    // of the report. Returns the measured rays per second.
+    double run(const char* name, const hittable& accel, size_t bytes, size_t primitives,
+               double min_seconds = 1.0) const
+    {
+        int mismatches = 0;
+        for (size_t k = 0; k < rays.size(); k++) {
+            hit_record rec;
+            bool hit = accel.hit(rays[k], interval(0.001, infinity), rec);
+            if (hit != (expected[k] < infinity) ||
+                (hit && std::fabs(rec.t - expected[k]) > 1e-6 * std::fmax(1.0, expected[k])))
+                mismatches++;
+        }
+
+        size_t traced = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        do {
+            for (const auto& r : rays) {
+                hit_record rec;
+                accel.hit(r, interval(0.001, infinity), rec);
+            }
+            traced += rays.size();
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < min_seconds);
+
+        double rays_per_second = traced / elapsed;
+        std::printf("%-24s %10.1f bytes/prim %10.2f Mrays/s %8d mismatches\n", name,
+                    double(bytes) / std::max<size_t>(primitives, 1), rays_per_second * 1e-6,
+                    mismatches);
+        return rays_per_second;
+    }
+
+  private:
+    std::vector<ray>    rays;
+    std::vector<double> expected;   // Reference hit distance, infinity for a miss.
+
+    void add_ray(const hittable& reference, const ray& r) {
+        hit_record rec;
+        rays.push_back(r);
+        expected.push_back(reference.hit(r, interval(0.001, infinity), rec) ? rec.t : infinity);
+    }
+};
+
+
+#endif
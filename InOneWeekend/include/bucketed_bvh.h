@@ -0,0 +1,196 @@
+#ifndef BUCKETED_BVH_H
+#define BUCKETED_BVH_H
+
+#include "bvh.h"
+#include "sphere.h"
+
+#include <cassert>
+#include <vector>
+
+
+// A run of primitives of one type inside a leaf: entries [first, first + count) of that
+// type's own storage.
+struct primitive_run {
+    int type;
+    int first;
+    int count;
+};
+
+
+// A bvh whose leaves hold runs of a single primitive type instead of a list of hittables.
+// Each run is intersected by a loop written for that type over its primitives packed
+// contiguously, so a leaf costs one dispatch per type it contains rather than one virtual
+// call per primitive, and mixed scenes traverse like homogeneous ones. Spheres are copied
+// into structure-of-arrays storage in leaf order; every other type goes to the generic
+// bucket, which falls back to hittable::hit until it gets a batched intersector of its own.
+class bucketed_bvh : public hittable {
+  public:
+    enum primitive_type { sphere_type, generic_type, type_count };
+
+    explicit bucketed_bvh(const bvh& source)
+      : nodes(source.node_array())
+    {
+        const auto& order = source.primitive_order();
+        const auto& objects = source.primitives();
+
+        for (auto& node : nodes) {
+            if (node.count == 0)
+                continue;
+
+            // Group the leaf's primitives by type, keeping each group contiguous in its bucket.
+            int first_run = int(runs.size());
+            for (int type = 0; type < type_count; type++) {
+                primitive_run run = { type, bucket_size(type), 0 };
+                for (int k = node.offset; k < node.offset + node.count; k++) {
+                    const auto& object = objects[order[k]];
+                    auto ball = dynamic_cast<const sphere*>(object.get());
+                    if ((ball ? sphere_type : generic_type) != type)
+                        continue;
+                    if (ball)
+                        add_sphere(*ball);
+                    else
+                        generic.push_back(object);
+                    run.count++;
+                }
+                if (run.count > 0)
+                    runs.push_back(run);
+            }
+            node.offset = first_run;
+            node.count = int(runs.size()) - first_run;
+        }
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+        const bool dir_negative[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+        int stack[bvh::max_depth];
+        int stack_size = 0;
+        int current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = nodes[current];
+            if (bvh::slab_hit(node.bbox, r.origin(), inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    for (int k = node.offset; k < node.offset + node.count; k++) {
+                        const auto& run = runs[k];
+                        bool found = (run.type == sphere_type) ? hit_spheres(run, r, ray_t, rec)
+                                                               : hit_generic(run, r, ray_t, rec);
+                        hit_anything |= found;
+                    }
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_negative[node.axis]) {
+                    assert(stack_size < bvh::max_depth);
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    assert(stack_size < bvh::max_depth);
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override {
+        return nodes.empty() ? aabb() : nodes[0].bbox;
+    }
+
+    // Nodes and runs, plus the sphere copies, which replace the hittables in the leaves.
+    size_t memory_bytes() const {
+        return nodes.size() * sizeof(bvh_node) + runs.size() * sizeof(primitive_run)
+             + center_x.size() * 5 * sizeof(double)
+             + sphere_materials.size() * sizeof(shared_ptr<material>)
+             + generic.size() * sizeof(shared_ptr<hittable>);
+    }
+
+  private:
+    std::vector<bvh_node>      nodes;   // As in the source bvh, but leaves index runs.
+    std::vector<primitive_run> runs;
+
+    std::vector<double>               center_x, center_y, center_z, radius, radius_squared;
+    std::vector<shared_ptr<material>> sphere_materials;
+
+    std::vector<shared_ptr<hittable>> generic;
+
+    int bucket_size(int type) const {
+        return type == sphere_type ? int(center_x.size()) : int(generic.size());
+    }
+
+    void add_sphere(const sphere& s) {
+        const auto& c = s.sphere_center();
+        center_x.push_back(c.x());
+        center_y.push_back(c.y());
+        center_z.push_back(c.z());
+        radius.push_back(s.sphere_radius());
+        radius_squared.push_back(s.sphere_radius() * s.sphere_radius());
+        sphere_materials.push_back(s.sphere_material());
+    }
+
+    // The closest of a run of spheres, found without branching on each sphere's result;
+    // only the winner's hit record is filled in. Same roots as sphere::hit.
+    bool hit_spheres(const primitive_run& run, const ray& r, interval& ray_t,
+                     hit_record& rec) const
+    {
+        const auto& o = r.origin();
+        const auto& d = r.direction();
+        auto a = d.length_squared();
+        auto inv_a = 1 / a;
+
+        int best = -1;
+        auto best_t = ray_t.max;
+        for (int k = run.first; k < run.first + run.count; k++) {
+            auto ox = center_x[k] - o.x();
+            auto oy = center_y[k] - o.y();
+            auto oz = center_z[k] - o.z();
+            auto h = d.x()*ox + d.y()*oy + d.z()*oz;
+            auto c = ox*ox + oy*oy + oz*oz - radius_squared[k];
+            auto discriminant = h*h - a*c;
+            auto sqrtd = std::sqrt(std::fmax(discriminant, 0.0));
+            auto t_near = (h - sqrtd) * inv_a;
+            auto t_far  = (h + sqrtd) * inv_a;
+            auto t = (t_near > ray_t.min) ? t_near : t_far;
+            bool closer = discriminant >= 0 && t > ray_t.min && t < best_t;
+            best_t = closer ? t : best_t;
+            best = closer ? k : best;
+        }
+
+        if (best < 0)
+            return false;
+
+        ray_t.max = best_t;
+        rec.t = best_t;
+        rec.p = r.at(best_t);
+        vec3 outward_normal = (rec.p - point3(center_x[best], center_y[best], center_z[best]))
+                            / radius[best];
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = sphere_materials[best];
+        return true;
+    }
+
+    bool hit_generic(const primitive_run& run, const ray& r, interval& ray_t,
+                     hit_record& rec) const
+    {
+        bool hit_anything = false;
+        for (int k = run.first; k < run.first + run.count; k++) {
+            if (generic[k]->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+};
+
+
+#endif
@@ -0,0 +1,438 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+
+struct bvh_node {
+    aabb bbox;
+    int  offset;   // Leaf: first entry in primitive_indices. Interior: index of the right child.
+    int  count;    // Primitives in a leaf, 0 for an interior node.
+    int  axis;     // Split axis of an interior node, used to visit the nearer child first.
+};
+
+
+struct bvh_options {
+    int    max_leaf_size      = 4;
+    bool   spatial_splits     = false;
+    double duplication_budget = 0.5;    // Extra references allowed, as a fraction of primitives.
+    double overlap_threshold  = 1e-5;   // Child overlap, relative to the root area, worth a spatial split.
+};
+
+
+// A primitive reference seen by the builder: which primitive and the part of space it covers.
+struct bvh_reference {
+    aabb bbox;
+    int  primitive;
+};
+
+
+// Bounding volume hierarchy over the objects of a hittable_list. Nodes live in one flat
+// array in depth-first order, so the left child always directly follows its parent, and the
+// tree is built top-down with a binned surface area heuristic over all three axes.
+//
+// With spatial_splits on, the build follows the SBVH: wherever the best object split leaves
+// the two children overlapping, it also tries splitting space itself, cutting references
+// that straddle the plane into clipped pieces on both sides. A large object such as the
+// ground sphere then ends up as several tight pieces instead of one box around everything.
+class bvh : public hittable {
+  public:
+    // No leaf is deeper than this, whatever the input, so traversal stacks of this many
+    // entries never overflow.
+    static const int max_depth = 96;
+
+    bvh(const hittable_list& list, const bvh_options& options = bvh_options())
+      : objects(list.objects), options(options)
+    {
+        std::vector<bvh_reference> refs;
+        refs.reserve(objects.size());
+        for (int i = 0; i < int(objects.size()); i++)
+            refs.push_back({objects[i]->bounding_box(), i});
+
+        if (!refs.empty())
+            build(std::move(refs));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+        const bool dir_negative[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+        int stack[max_depth];
+        int stack_size = 0;
+        int current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = nodes[current];
+            if (slab_hit(node.bbox, r.origin(), inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    for (int k = node.offset; k < node.offset + node.count; k++) {
+                        if (objects[primitive_indices[k]]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_negative[node.axis]) {
+                    assert(stack_size < max_depth);
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    assert(stack_size < max_depth);
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override {
+        return nodes.empty() ? aabb() : nodes[0].bbox;
+    }
+
+    const std::vector<bvh_node>&               node_array() const { return nodes; }
+    const std::vector<int>&                    primitive_order() const { return primitive_indices; }
+    const std::vector<shared_ptr<hittable>>&   primitives() const { return objects; }
+
+    // Expected cost of a random ray under the SAH: the area-weighted node visits and
+    // primitive tests, relative to the root box.
+    double sah_cost() const {
+        if (nodes.empty())
+            return 0;
+        auto root_area = nodes[0].bbox.surface_area();
+        double cost = 0;
+        for (const auto& node : nodes)
+            cost += node.bbox.surface_area() / root_area * (node.count > 0 ? node.count : 1);
+        return cost;
+    }
+
+    size_t reference_count() const { return primitive_indices.size(); }
+
+    // Bytes of acceleration data: the nodes plus the leaf index list, not the primitives.
+    size_t memory_bytes() const {
+        return nodes.size() * sizeof(bvh_node) + primitive_indices.size() * sizeof(int);
+    }
+
+    static bool slab_hit(const aabb& box, const point3& origin, const vec3& inv_dir,
+                         interval ray_t)
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = box.axis_interval(axis);
+            auto t0 = (ax.min - origin[axis]) * inv_dir[axis];
+            auto t1 = (ax.max - origin[axis]) * inv_dir[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max < ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+  private:
+    static const int bin_count = 16;
+    static const int max_spatial_depth = 48;
+
+    // Past this depth the builder splits at the median centroid, halving the references at
+    // every level, so even 2^31 of them fit within max_depth.
+    static const int median_depth = 48;
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<bvh_node>             nodes;
+    std::vector<int>                  primitive_indices;
+    bvh_options                       options;
+
+    // Build state.
+    double root_area = 0;
+    int    duplicates_left = 0;
+
+    struct split {
+        double cost = infinity;   // Unnormalized: A_left N_left + A_right N_right.
+        int    axis = -1;
+        int    bin = 0;
+        aabb   left, right;
+    };
+
+    void build(std::vector<bvh_reference> refs) {
+        nodes.reserve(2 * refs.size());
+        primitive_indices.reserve(refs.size());
+        duplicates_left = options.spatial_splits
+                        ? int(options.duplication_budget * refs.size()) : 0;
+        aabb root;
+        for (const auto& ref : refs)
+            root = aabb(root, ref.bbox);
+        root_area = root.surface_area();
+        build_recursive(refs, 0);
+    }
+
+    int make_leaf(const std::vector<bvh_reference>& refs, const aabb& bounds) {
+        int index = int(nodes.size());
+        nodes.push_back({bounds, int(primitive_indices.size()), int(refs.size()), 0});
+        for (const auto& ref : refs)
+            primitive_indices.push_back(ref.primitive);
+        return index;
+    }
+
+    int build_recursive(std::vector<bvh_reference>& refs, int depth) {
+        aabb bounds, centroids;
+        for (const auto& ref : refs) {
+            bounds = aabb(bounds, ref.bbox);
+            auto c = ref.bbox.centroid();
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        int n = int(refs.size());
+        if (n <= options.max_leaf_size || depth >= max_depth - 1)
+            return make_leaf(refs, bounds);
+        if (depth >= median_depth)
+            return median_split(refs, bounds, centroids, depth);
+
+        auto best = object_split(refs, centroids);
+
+        bool spatial = false;
+        if (duplicates_left > 0 && depth < max_spatial_depth && best.axis >= 0) {
+            auto overlap = best.left.intersect(best.right).surface_area();
+            if (overlap > options.overlap_threshold * root_area) {
+                auto candidate = spatial_split(refs, bounds);
+                if (candidate.cost < best.cost) {
+                    best = candidate;
+                    spatial = true;
+                }
+            }
+        }
+
+        // Cost = 1 + (A_left N_left + A_right N_right) / A_parent, counting one unit per
+        // primitive test and one per node visit.
+        auto parent_area = bounds.surface_area();
+        if (best.axis < 0 || (parent_area > 0 && 1 + best.cost / parent_area >= n && n <= 16))
+            return make_leaf(refs, bounds);
+
+        std::vector<bvh_reference> left, right;
+        if (spatial)
+            partition_spatial(refs, bounds, best, left, right);
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+            if (spatial)
+                best = object_split(refs, centroids);
+            const interval& extent = centroids.axis_interval(best.axis);
+            for (const auto& ref : refs)
+                (bin_of(ref, best.axis, extent) <= best.bin ? left : right).push_back(ref);
+        }
+        refs.clear();
+        refs.shrink_to_fit();
+        return make_interior(bounds, best.axis, left, right, depth);
+    }
+
+    int make_interior(const aabb& bounds, int axis, std::vector<bvh_reference>& left,
+                      std::vector<bvh_reference>& right, int depth)
+    {
+        int index = int(nodes.size());
+        nodes.push_back({bounds, 0, 0, axis});
+        build_recursive(left, depth + 1);
+        nodes[index].offset = build_recursive(right, depth + 1);
+        return index;
+    }
+
+    // Halves the references at the median centroid along the widest axis. Degenerate input,
+    // such as primitives spaced ever more closely, can make SAH splits peel off one primitive
+    // at a time; this bounds how deep that goes.
+    int median_split(std::vector<bvh_reference>& refs, const aabb& bounds, const aabb& centroids,
+                     int depth)
+    {
+        int axis = centroids.longest_axis();
+        auto middle = refs.begin() + refs.size() / 2;
+        std::nth_element(refs.begin(), middle, refs.end(),
+                         [axis](const bvh_reference& a, const bvh_reference& b) {
+                             return a.bbox.centroid()[axis] < b.bbox.centroid()[axis];
+                         });
+        std::vector<bvh_reference> left(refs.begin(), middle), right(middle, refs.end());
+        refs.clear();
+        refs.shrink_to_fit();
+        return make_interior(bounds, axis, left, right, depth);
+    }
+
+    // Best partition of the references by binned centroid.
+    split object_split(const std::vector<bvh_reference>& refs, const aabb& centroids) const {
+        split best;
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& extent = centroids.axis_interval(axis);
+            if (extent.size() <= 0)
+                continue;
+
+            aabb bin_bounds[bin_count];
+            int  bin_counts[bin_count] = {};
+            for (const auto& ref : refs) {
+                int b = bin_of(ref, axis, extent);
+                bin_counts[b]++;
+                bin_bounds[b] = aabb(bin_bounds[b], ref.bbox);
+            }
+
+            sweep(bin_bounds, bin_counts, bin_counts, axis, best);
+        }
+
+        return best;
+    }
+
+    // Best split of space into equal-width bins, where a reference counts in every bin its
+    // box spans and contributes only the part of the object inside each bin.
+    split spatial_split(const std::vector<bvh_reference>& refs, const aabb& bounds) const {
+        split best;
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& extent = bounds.axis_interval(axis);
+            if (extent.size() <= 0)
+                continue;
+
+            aabb bin_bounds[bin_count];
+            int  entries[bin_count] = {};
+            int  exits[bin_count] = {};
+            for (const auto& ref : refs) {
+                const interval& span = ref.bbox.axis_interval(axis);
+                int first = spatial_bin(span.min, extent);
+                int last  = spatial_bin(span.max, extent);
+                entries[first]++;
+                exits[last]++;
+                for (int b = first; b <= last; b++) {
+                    auto piece = clipped(ref, axis, bin_slab(b, extent));
+                    bin_bounds[b] = aabb(bin_bounds[b], piece);
+                }
+            }
+
+            sweep(bin_bounds, entries, exits, axis, best);
+        }
+
+        return best;
+    }
+
+    // Evaluates every plane between bins. A reference is counted on the left from its first
+    // bin (left_counts) and on the right up to its last bin (right_counts); for object splits
+    // the two are the same.
+    void sweep(const aabb* bin_bounds, const int* left_counts, const int* right_counts,
+               int axis, split& best) const
+    {
+        aabb right_boxes[bin_count];
+        int  right_total[bin_count];
+        aabb right_box;
+        int  count = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            right_box = aabb(right_box, bin_bounds[b]);
+            count += right_counts[b];
+            right_boxes[b] = right_box;
+            right_total[b] = count;
+        }
+
+        aabb left_box;
+        int  left_count = 0;
+        for (int b = 0; b < bin_count - 1; b++) {
+            left_box = aabb(left_box, bin_bounds[b]);
+            left_count += left_counts[b];
+            if (left_count == 0 || right_total[b+1] == 0)
+                continue;
+            double cost = left_box.surface_area() * left_count
+                        + right_boxes[b+1].surface_area() * right_total[b+1];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.left = left_box;
+                best.right = right_boxes[b+1];
+            }
+        }
+    }
+
+    void partition_spatial(const std::vector<bvh_reference>& refs, const aabb& bounds,
+                           const split& s, std::vector<bvh_reference>& left,
+                           std::vector<bvh_reference>& right)
+    {
+        const interval& extent = bounds.axis_interval(s.axis);
+        auto plane = bin_slab(s.bin, extent).max;
+        auto left_box = s.left, right_box = s.right;
+        auto left_area = left_box.surface_area(), right_area = right_box.surface_area();
+
+        int left_count = 0, right_count = 0;
+        for (const auto& ref : refs) {
+            const interval& span = ref.bbox.axis_interval(s.axis);
+            if (span.max <= plane) left_count++;
+            else if (span.min >= plane) right_count++;
+            else { left_count++; right_count++; }
+        }
+
+        for (const auto& ref : refs) {
+            const interval& span = ref.bbox.axis_interval(s.axis);
+            if (span.max <= plane) {
+                left.push_back(ref);
+                continue;
+            }
+            if (span.min >= plane) {
+                right.push_back(ref);
+                continue;
+            }
+
+            // Reference unsplitting: keep a straddling reference whole on one side when that
+            // is cheaper than duplicating it, or when the budget has run out.
+            auto whole_left  = aabb(left_box, ref.bbox).surface_area() * left_count
+                             + right_area * (right_count - 1);
+            auto whole_right = left_area * (left_count - 1)
+                             + aabb(right_box, ref.bbox).surface_area() * right_count;
+            auto duplicated  = left_area * left_count + right_area * right_count;
+
+            if (duplicates_left > 0 && duplicated < std::fmin(whole_left, whole_right)) {
+                auto l = clipped(ref, s.axis, interval(span.min, plane));
+                auto r = clipped(ref, s.axis, interval(plane, span.max));
+                if (!l.is_empty()) left.push_back({l, ref.primitive});
+                if (!r.is_empty()) right.push_back({r, ref.primitive});
+                if (!l.is_empty() && !r.is_empty())
+                    duplicates_left--;
+            } else if (whole_left <= whole_right) {
+                left.push_back(ref);
+                left_box = aabb(left_box, ref.bbox);
+                left_area = left_box.surface_area();
+                right_count--;
+            } else {
+                right.push_back(ref);
+                right_box = aabb(right_box, ref.bbox);
+                right_area = right_box.surface_area();
+                left_count--;
+            }
+        }
+    }
+
+    aabb clipped(const bvh_reference& ref, int axis, const interval& slab) const {
+        return objects[ref.primitive]->clipped_bounding_box(axis, slab).intersect(ref.bbox);
+    }
+
+    static interval bin_slab(int b, const interval& extent) {
+        auto width = extent.size() / bin_count;
+        return interval(extent.min + b * width,
+                        b == bin_count - 1 ? extent.max : extent.min + (b + 1) * width);
+    }
+
+    static int spatial_bin(double x, const interval& extent) {
+        int b = int(bin_count * (x - extent.min) / extent.size());
+        return std::clamp(b, 0, bin_count - 1);
+    }
+
+    static int bin_of(const bvh_reference& ref, int axis, const interval& extent) {
+        auto c = ref.bbox.centroid()[axis];
+        int b = int(bin_count * (c - extent.min) / extent.size());
+        return std::clamp(b, 0, bin_count - 1);
+    }
+};
+
+
+#endif
@@ -3,7 +3,9 @@
 
 
 
+#include "frustum.h"
 #include "material.h"
+#include "pixel_filter.h"
 
 
 class camera {
@@ -21,6 +23,10 @@ class camera {
     double defocus_angle = 0;
     double focus_dist = 10;    
 
+    // Reconstruction filter for rays from get_ray(i, j, weight). Wider filters reach into
+    // neighbouring pixels; get_ray(i, j) always samples the pixel's own square.
+    filter_type filter = filter_type::box;
+
     void render(const hittable& world) {
         initialize();
 
@@ -41,17 +47,6 @@ class camera {
         std::clog << "\rDone.                 \n";
     }
 
-  private:
-    int    image_height;         
-    double pixel_samples_scale;  
-    point3 center;              
-    point3 pixel00_loc;          
-    vec3   pixel_delta_u;        
-    vec3   pixel_delta_v;       
-    vec3   u, v, w;              
-    vec3   defocus_disk_u;       
-    vec3   defocus_disk_v;       
-
     void initialize() {
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
@@ -77,12 +72,14 @@ class camera {
         auto viewport_upper_left = center - (focus_dist * w) - viewport_u/2 - viewport_v/2;
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
 
+        film_area = viewport_width * viewport_height / (focus_dist * focus_dist);
+
         auto defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
     }
 
-ray get_ray(int i, int j) const {
+    ray get_ray(int i, int j) const {
 
         auto offset = sample_square();
         auto pixel_sample = pixel00_loc
@@ -95,6 +92,119 @@ ray get_ray(int i, int j) const {
         return ray(ray_origin, ray_direction);
     }
 
+    // A ray for pixel (i, j) drawn through the reconstruction filter. Averaging weight times
+    // the radiance along such rays gives the filtered pixel value.
+    ray get_ray(int i, int j, double& weight) const {
+        auto offset = pixel_filter::get(filter).sample(random_double(), random_double(), weight);
+        auto pixel_sample = pixel00_loc
+                          + ((i + offset.x()) * pixel_delta_u)
+                          + ((j + offset.y()) * pixel_delta_v);
+
+        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        return ray(ray_origin, pixel_sample - ray_origin);
+    }
+
+    bool is_pinhole() const { return defocus_angle <= 0; }
+
+    // Whether other, once initialized, generates exactly the rays this camera does.
+    bool same_view(const camera& other) const {
+        auto same = [](const vec3& a, const vec3& b) {
+            return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+        };
+        return image_width == other.image_width && image_height == other.image_height
+            && defocus_angle == other.defocus_angle && same(center, other.center)
+            && same(pixel00_loc, other.pixel00_loc)
+            && same(pixel_delta_u, other.pixel_delta_u) && same(pixel_delta_v, other.pixel_delta_v)
+            && same(defocus_disk_u, other.defocus_disk_u) && same(defocus_disk_v, other.defocus_disk_v)
+            && filter == other.filter;
+    }
+
+    const point3& position() const { return center; }
+
+    vec3 forward() const { return -w; }
+
+    // Projects p onto the image plane. Returns false if p is behind the camera or outside the
+    // frame; otherwise (x, y) is its continuous raster position in pixels.
+    bool raster_position(const point3& p, double& x, double& y) const {
+        auto d = p - center;
+        auto depth = dot(d, -w);
+        if (depth <= 0)
+            return false;
+
+        auto offset = center + d * (focus_dist / depth) - pixel00_loc;
+        x = dot(offset, pixel_delta_u) / pixel_delta_u.length_squared() + 0.5;
+        y = dot(offset, pixel_delta_v) / pixel_delta_v.length_squared() + 0.5;
+        return 0 <= x && x < image_width && 0 <= y && y < image_height;
+    }
+
+    // Planes around every primary ray through the pixels [i0, i1) x [j0, j1), jitter within
+    // the pixels, as far out as the reconstruction filter reaches, and the defocus disk
+    // included. In camera coordinates (x along u, y along v,
+    // depth s in front of the camera) a ray from disk point o through focus-plane point q
+    // passes x = (1 - s/f) o_x + (s/f) q_x, which is at most R + (s/f)(q_max + R) for a disk
+    // of radius R: a plane, and likewise for the other three sides.
+    frustum pixel_frustum(int i0, int j0, int i1, int j1) const {
+        double x_min = infinity, x_max = -infinity, y_min = infinity, y_max = -infinity;
+        auto reach = std::fmax(0.5, pixel_filter::get(filter).radius());
+        for (auto px : {i0 - reach, i1 - 1 + reach}) {
+            for (auto py : {j0 - reach, j1 - 1 + reach}) {
+                auto corner = pixel00_loc + px * pixel_delta_u + py * pixel_delta_v - center;
+                x_min = std::fmin(x_min, dot(corner, u));
+                x_max = std::fmax(x_max, dot(corner, u));
+                y_min = std::fmin(y_min, dot(corner, v));
+                y_max = std::fmax(y_max, dot(corner, v));
+            }
+        }
+
+        auto radius = (defocus_angle <= 0) ? 0.0 : defocus_disk_u.length();
+        auto f = focus_dist;
+
+        frustum region;
+        auto side = [&](const vec3& axis, double bound, double sign) {
+            // sign * coordinate <= R + s * (sign * bound + R) / f, with s = dot(p - center, -w).
+            auto n = sign * axis + ((sign * bound + radius) / f) * w;
+            region.add_plane(n, radius + dot(n, center));
+        };
+        side(u, x_max, 1);
+        side(u, x_min, -1);
+        side(v, y_max, 1);
+        side(v, y_min, -1);
+        region.add_plane(w, dot(w, center));   // In front of the lens.
+        return region;
+    }
+
+    // Pinhole importance W_e = 1 / (A cos^4) for a ray leaving the camera along direction,
+    // where A is the film area at unit distance, and the solid-angle density of sampling
+    // that direction over the whole film. Both are zero outside the frame.
+    double importance(const vec3& direction) const {
+        auto cos_theta = visible_cosine(direction);
+        return cos_theta > 0 ? 1 / (film_area * cos_theta*cos_theta*cos_theta*cos_theta) : 0;
+    }
+
+    double direction_pdf(const vec3& direction) const {
+        auto cos_theta = visible_cosine(direction);
+        return cos_theta > 0 ? 1 / (film_area * cos_theta*cos_theta*cos_theta) : 0;
+    }
+
+  private:
+    int    image_height;         
+    double pixel_samples_scale;  
+    point3 center;              
+    point3 pixel00_loc;          
+    vec3   pixel_delta_u;        
+    vec3   pixel_delta_v;       
+    vec3   u, v, w;              
+    vec3   defocus_disk_u;       
+    vec3   defocus_disk_v;       
+    double film_area;
+
+    double visible_cosine(const vec3& direction) const {
+        double x, y;
+        if (!raster_position(center + direction, x, y))
+            return 0;
+        return dot(unit_vector(direction), -w);
+    }
+
     vec3 sample_square() const {
         return vec3(random_double() - 0.5, random_double() - 0.5, 0);
     }
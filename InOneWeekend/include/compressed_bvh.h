@@ -0,0 +1,374 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include "bvh.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+// A four-wide node whose child boxes are stored as 8-bit offsets on a per-axis power-of-two
+// grid anchored at the node's own minimum corner. Children are packed in slots 0..3; unused
+// slots hold an inverted box that no ray can hit. Interior children are stored consecutively
+// from child_base and leaf primitives consecutively from primitive_base, so a single byte per
+// child is enough to find either.
+struct compressed_bvh_node {
+    float    origin[3];
+    int8_t   exponent[3];      // Grid step along each axis is 2^exponent.
+    uint8_t  child_count;
+    uint32_t child_base;
+    uint32_t primitive_base;
+    uint8_t  meta[4];          // Leaf: leaf_bit | primitive count. Interior: offset from child_base.
+    uint8_t  lo[3][4];         // Quantized child minima, per axis then per child.
+    uint8_t  hi[3][4];         // Quantized child maxima.
+};
+
+static_assert(sizeof(compressed_bvh_node) == 52, "compressed_bvh_node should stay packed");
+
+
+// Wide BVH collapsed from a binary bvh: every node absorbs its largest interior descendants
+// until it has four children, then the children's bounds are quantized conservatively so
+// they only ever grow. Traversal dequantizes and tests all four boxes at once with SSE and
+// visits the hit children nearest first.
+class compressed_bvh : public hittable {
+  public:
+    static const uint8_t leaf_bit = 0x80;
+    static const int     max_leaf_primitives = 0x7f;
+
+    explicit compressed_bvh(const bvh& source)
+      : objects(source.primitives()), bbox(source.bounding_box())
+    {
+        const auto& binary = source.node_array();
+        if (binary.empty())
+            return;
+
+        for (int index : source.primitive_order())
+            binary_order.push_back(index);
+
+        nodes.emplace_back();
+        item root = { 0, 0, 0, binary[0].bbox };
+        if (binary[0].count > 0)
+            root = { -1, binary[0].offset, binary[0].count, binary[0].bbox };
+        build_node(source, 0, { root });
+        binary_order.clear();
+        binary_order.shrink_to_fit();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        ray_data rd(r);
+
+        // Each wide node lies on a path of binary nodes at least as long, and visiting one
+        // replaces it with at most four children, so three entries per level bound the stack.
+        struct entry { uint32_t index; uint32_t count; float t; };
+        entry stack[3 * bvh::max_depth + 1];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, 0, float(ray_t.min) };
+        bool hit_anything = false;
+
+        while (stack_size > 0) {
+            auto e = stack[--stack_size];
+            if (e.t > ray_t.max)
+                continue;
+
+            if (e.count > 0) {
+                for (uint32_t k = e.index; k < e.index + e.count; k++) {
+                    if (objects[primitive_indices[k]]->hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                }
+                continue;
+            }
+
+            const auto& node = nodes[e.index];
+            float t_near[4];
+            int mask = intersect_children(node, rd, float(ray_t.min), float(ray_t.max), t_near);
+
+            // Sort the hit children far to near so the nearest is popped first.
+            entry hits[4];
+            int hit_count = 0;
+            uint32_t primitive = node.primitive_base;
+            for (int k = 0; k < node.child_count; k++) {
+                auto meta = node.meta[k];
+                entry child = (meta & leaf_bit)
+                            ? entry{ primitive, uint32_t(meta & max_leaf_primitives), t_near[k] }
+                            : entry{ node.child_base + meta, 0, t_near[k] };
+                if (meta & leaf_bit)
+                    primitive += meta & max_leaf_primitives;
+                if (!(mask & (1 << k)))
+                    continue;
+
+                int slot = hit_count++;
+                while (slot > 0 && hits[slot-1].t < child.t) {
+                    hits[slot] = hits[slot-1];
+                    slot--;
+                }
+                hits[slot] = child;
+            }
+
+            assert(stack_size + hit_count <= 3 * bvh::max_depth + 1);
+            for (int k = 0; k < hit_count; k++)
+                stack[stack_size++] = hits[k];
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Bytes of acceleration data: the nodes plus the leaf index list, not the primitives.
+    size_t memory_bytes() const {
+        return nodes.size() * sizeof(compressed_bvh_node)
+             + primitive_indices.size() * sizeof(uint32_t);
+    }
+
+  private:
+    // A child being placed under a wide node: a binary interior node, or a range of the
+    // binary tree's leaf primitives (binary_node < 0).
+    struct item {
+        int  binary_node;
+        int  first;
+        int  count;
+        aabb box;
+    };
+
+    struct ray_data {
+        float origin[3];
+        float inv_dir[3];
+        bool  negative[3];
+
+        explicit ray_data(const ray& r) {
+            for (int axis = 0; axis < 3; axis++) {
+                origin[axis] = float(r.origin()[axis]);
+                inv_dir[axis] = float(1 / r.direction()[axis]);
+                negative[axis] = inv_dir[axis] < 0;
+            }
+        }
+    };
+
+    std::vector<shared_ptr<hittable>>   objects;
+    std::vector<compressed_bvh_node>    nodes;
+    std::vector<uint32_t>               primitive_indices;
+    std::vector<int>                    binary_order;   // Build only.
+    aabb                                bbox;
+
+    // Float rounding of the ray setup and of the box test is covered by widening the far end.
+    static constexpr float far_slack = 1.0f + 1.0f / (1 << 20);
+
+    static float grid_step(int8_t exponent) {
+        uint32_t bits = uint32_t(exponent + 127) << 23;
+        float step;
+        std::memcpy(&step, &bits, sizeof(step));
+        return step;
+    }
+
+#if defined(__SSE2__)
+    static __m128 dequantize(const uint8_t q[4], float origin, float step) {
+        int32_t packed;
+        std::memcpy(&packed, q, sizeof(packed));
+        __m128i zero = _mm_setzero_si128();
+        __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(step)));
+    }
+
+    static int intersect_children(const compressed_bvh_node& node, const ray_data& rd,
+                                  float t_min, float t_max, float t_near[4])
+    {
+        __m128 near_t = _mm_set1_ps(t_min);
+        __m128 far_t  = _mm_set1_ps(t_max);
+
+        for (int axis = 0; axis < 3; axis++) {
+            auto step = grid_step(node.exponent[axis]);
+            __m128 lo = dequantize(node.lo[axis], node.origin[axis], step);
+            __m128 hi = dequantize(node.hi[axis], node.origin[axis], step);
+            if (rd.negative[axis])
+                std::swap(lo, hi);
+
+            __m128 o   = _mm_set1_ps(rd.origin[axis]);
+            __m128 inv = _mm_set1_ps(rd.inv_dir[axis]);
+            // An axis-parallel ray starting on a plane gives 0 * inf = NaN, and max/min
+            // return their second operand when either is NaN, so the running bound goes
+            // second and survives, as it does in bvh::slab_hit.
+            near_t = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(lo, o), inv), near_t);
+            far_t  = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(hi, o), inv), far_t);
+        }
+
+        far_t = _mm_mul_ps(far_t, _mm_set1_ps(far_slack));
+        _mm_storeu_ps(t_near, near_t);
+        return _mm_movemask_ps(_mm_cmple_ps(near_t, far_t));
+    }
+#else
+    static int intersect_children(const compressed_bvh_node& node, const ray_data& rd,
+                                  float t_min, float t_max, float t_near[4])
+    {
+        int mask = 0;
+        for (int k = 0; k < 4; k++) {
+            float near_t = t_min, far_t = t_max;
+            for (int axis = 0; axis < 3; axis++) {
+                auto step = grid_step(node.exponent[axis]);
+                float lo = node.origin[axis] + float(node.lo[axis][k]) * step;
+                float hi = node.origin[axis] + float(node.hi[axis][k]) * step;
+                if (rd.negative[axis])
+                    std::swap(lo, hi);
+                near_t = std::fmax(near_t, (lo - rd.origin[axis]) * rd.inv_dir[axis]);
+                far_t  = std::fmin(far_t,  (hi - rd.origin[axis]) * rd.inv_dir[axis]);
+            }
+            t_near[k] = near_t;
+            if (near_t <= far_t * far_slack)
+                mask |= 1 << k;
+        }
+        return mask;
+    }
+#endif
+
+    bool is_interior(const item& it) const {
+        return it.binary_node >= 0 || it.count > max_leaf_primitives;
+    }
+
+    // Splits an interior item into its two children.
+    void expand(const bvh& source, const item& it, item& a, item& b) const {
+        if (it.binary_node >= 0) {
+            const auto& binary = source.node_array();
+            int children[2] = { it.binary_node + 1, binary[it.binary_node].offset };
+            item* out[2] = { &a, &b };
+            for (int c = 0; c < 2; c++) {
+                const auto& child = binary[children[c]];
+                *out[c] = (child.count > 0)
+                        ? item{ -1, child.offset, child.count, child.bbox }
+                        : item{ children[c], 0, 0, child.bbox };
+            }
+            return;
+        }
+
+        // An oversized leaf is cut into two halves of its primitive range.
+        int half = it.count / 2;
+        a = { -1, it.first, half, range_box(it.first, half) };
+        b = { -1, it.first + half, it.count - half, range_box(it.first + half, it.count - half) };
+    }
+
+    aabb range_box(int first, int count) const {
+        aabb box;
+        for (int k = first; k < first + count; k++)
+            box = aabb(box, objects[binary_order[k]]->bounding_box());
+        return box;
+    }
+
+    void build_node(const bvh& source, uint32_t index, std::vector<item> children) {
+        // Open up the interior child with the largest surface area until four are present.
+        while (children.size() < 4) {
+            int best = -1;
+            for (int c = 0; c < int(children.size()); c++) {
+                if (is_interior(children[c]) &&
+                    (best < 0 || children[c].box.surface_area() > children[best].box.surface_area()))
+                    best = c;
+            }
+            if (best < 0)
+                break;
+
+            item a, b;
+            expand(source, children[best], a, b);
+            children[best] = a;
+            children.push_back(b);
+        }
+
+        aabb box;
+        for (const auto& child : children)
+            box = aabb(box, child.box);
+
+        compressed_bvh_node node = {};
+        node.child_count = uint8_t(children.size());
+        set_frame(node, box);
+        for (int k = 0; k < 4; k++) {
+            if (k < int(children.size())) {
+                quantize(node, k, children[k].box);
+            } else {
+                for (int axis = 0; axis < 3; axis++) {
+                    node.lo[axis][k] = 255;
+                    node.hi[axis][k] = 0;
+                }
+            }
+        }
+
+        node.child_base = uint32_t(nodes.size());
+        std::vector<std::pair<uint32_t, item>> interior;
+        for (int k = 0; k < int(children.size()); k++) {
+            if (is_interior(children[k])) {
+                node.meta[k] = uint8_t(interior.size());
+                interior.push_back({ uint32_t(nodes.size()), children[k] });
+                nodes.emplace_back();
+            }
+        }
+
+        node.primitive_base = uint32_t(primitive_indices.size());
+        for (int k = 0; k < int(children.size()); k++) {
+            const auto& child = children[k];
+            if (is_interior(child))
+                continue;
+            node.meta[k] = uint8_t(leaf_bit | child.count);
+            for (int p = child.first; p < child.first + child.count; p++)
+                primitive_indices.push_back(uint32_t(binary_order[p]));
+        }
+
+        nodes[index] = node;
+
+        for (const auto& [child_index, child] : interior) {
+            item a, b;
+            expand(source, child, a, b);
+            build_node(source, child_index, { a, b });
+        }
+    }
+
+    static void set_frame(compressed_bvh_node& node, const aabb& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = box.axis_interval(axis);
+            float origin = float(ax.min);
+            if (double(origin) > ax.min)
+                origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+            int exponent = -100;
+            auto extent = ax.max - origin;
+            if (extent > 0)
+                exponent = std::max(exponent, int(std::ceil(std::log2(extent / 255))));
+            while (exponent < 100 && double(origin + 255.0f * grid_step(int8_t(exponent))) < ax.max)
+                exponent++;
+
+            node.origin[axis] = origin;
+            node.exponent[axis] = int8_t(exponent);
+        }
+    }
+
+    // Rounds the child box outward onto the node's grid, checking the result with the same
+    // float arithmetic the traversal uses.
+    static void quantize(compressed_bvh_node& node, int k, const aabb& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = box.axis_interval(axis);
+            auto origin = node.origin[axis];
+            auto step = grid_step(node.exponent[axis]);
+            auto dequantized = [&](int q) { return double(origin + float(q) * step); };
+
+            int lo = std::clamp(int(std::floor((ax.min - origin) / step)), 0, 255);
+            while (lo > 0 && dequantized(lo) > ax.min)
+                lo--;
+            int hi = std::clamp(int(std::ceil((ax.max - origin) / step)), 0, 255);
+            while (hi < 255 && dequantized(hi) < ax.max)
+                hi++;
+
+            node.lo[axis][k] = uint8_t(lo);
+            node.hi[axis][k] = uint8_t(hi);
+        }
+    }
+};
+
+
+#endif
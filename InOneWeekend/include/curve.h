@@ -0,0 +1,232 @@
+#ifndef CURVE_H
+#define CURVE_H
+
+#include "hittable_list.h"
+
+#include <algorithm>
+
+
+// What the segments of one curve share: its cubic Bezier control points, its width at either
+// end (varying linearly along the curve) and its material.
+struct curve_common {
+    point3               control[4];
+    double               width[2];
+    shared_ptr<material> mat;
+};
+
+
+// A piece [u_min, u_max] of a thin cubic Bezier curve, such as a hair or a blade of grass.
+// The curve is intersected as a flat ribbon that always faces the ray, but shaded with the
+// normal a round tube would have there, so strands look cylindrical at the cost of a ribbon.
+//
+// A long, bent curve is bounded badly by one axis-aligned box, so add_curve() cuts every
+// curve into a few segments with boxes of their own before they go into the BVH. Each
+// segment is intersected in ray space (the ray along +z from the origin) by splitting it in
+// half recursively, discarding halves whose control points' bounds, widened by the curve's
+// width, miss the ray, down to pieces flat enough to treat as line segments.
+class curve : public hittable {
+  public:
+    curve(shared_ptr<const curve_common> common, double u_min, double u_max)
+      : common(std::move(common)), u_min(u_min), u_max(u_max) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Ray space: the ray origin at 0, its direction along z, z measured in world units.
+        auto length = r.direction().length();
+        vec3 axis_z = r.direction() / length;
+        vec3 helper = std::fabs(axis_z.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0);
+        vec3 axis_x = unit_vector(cross(helper, axis_z));
+        vec3 axis_y = cross(axis_z, axis_x);
+
+        point3 world[4];
+        segment_control_points(world);
+        vec3 cp[4];
+        for (int i = 0; i < 4; i++) {
+            auto q = world[i] - r.origin();
+            cp[i] = vec3(dot(q, axis_x), dot(q, axis_y), dot(q, axis_z));
+        }
+
+        auto z_min = ray_t.min * length;
+        curve_hit found;
+        found.z = ray_t.max * length;
+        if (!overlaps(cp, std::fmax(width_at(u_min), width_at(u_max)), z_min, found.z))
+            return false;
+
+        // The flatter the segment, the fewer halvings before it is a line segment.
+        double l0 = 0;
+        for (int i = 0; i < 2; i++)
+            for (int a = 0; a < 3; a++)
+                l0 = std::fmax(l0, std::fabs(cp[i][a] - 2 * cp[i+1][a] + cp[i+2][a]));
+        auto eps = std::fmax(common->width[0], common->width[1]) * 0.05;
+        int max_depth = 0;
+        if (l0 > 0 && eps > 0)
+            max_depth = std::clamp(int(std::log2(1.41421356237 * 6 * l0 / (8 * eps)) / 2), 0, 10);
+
+        if (!recursive_hit(cp, u_min, u_max, max_depth, z_min, found))
+            return false;
+
+        rec.t = found.z / length;
+        rec.p = r.at(rec.t);
+
+        // Tube normal: toward the viewer across the middle of the ribbon, turning sideways
+        // toward its edges.
+        vec3 tangent = found.tangent.x() * axis_x + found.tangent.y() * axis_y
+                     + found.tangent.z() * axis_z;
+        vec3 offset = -(found.offset_x * axis_x + found.offset_y * axis_y);
+        vec3 facing = -axis_z;
+        if (tangent.length_squared() > 0) {
+            auto t_hat = unit_vector(tangent);
+            facing = facing - dot(facing, t_hat) * t_hat;
+            facing = facing.length_squared() > 0 ? unit_vector(facing) : -axis_z;
+        }
+        auto s = std::fmin(offset.length() / (0.5 * found.width), 1.0);
+        vec3 outward_normal = facing;
+        if (offset.length_squared() > 0)
+            outward_normal = unit_vector(std::sqrt(1 - s*s) * facing + s * unit_vector(offset));
+
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = common->mat;
+        return true;
+    }
+
+    aabb bounding_box() const override {
+        point3 cp[4];
+        segment_control_points(cp);
+        auto half = 0.5 * std::fmax(width_at(u_min), width_at(u_max));
+        aabb box;
+        for (const auto& p : cp)
+            box = aabb(box, aabb(p - vec3(half, half, half), p + vec3(half, half, half)));
+        return box;
+    }
+
+  private:
+    shared_ptr<const curve_common> common;
+    double u_min, u_max;
+
+    struct curve_hit {
+        double z;                     // Depth along the ray; starts as the farthest allowed.
+        double width;
+        double offset_x, offset_y;    // Where the curve passes the ray, in ray space.
+        vec3   tangent;
+    };
+
+    double width_at(double u) const {
+        return (1 - u) * common->width[0] + u * common->width[1];
+    }
+
+    static vec3 lerp(double t, const vec3& a, const vec3& b) { return (1 - t) * a + t * b; }
+
+    // The blossom of the curve: with u0 = u1 = u2 = u it is the point at u, and mixing two
+    // parameters gives the control points of any piece of the curve.
+    static point3 blossom(const point3 p[4], double u0, double u1, double u2) {
+        point3 a[3] = { lerp(u0, p[0], p[1]), lerp(u0, p[1], p[2]), lerp(u0, p[2], p[3]) };
+        point3 b[2] = { lerp(u1, a[0], a[1]), lerp(u1, a[1], a[2]) };
+        return lerp(u2, b[0], b[1]);
+    }
+
+    void segment_control_points(point3 out[4]) const {
+        const auto* p = common->control;
+        out[0] = blossom(p, u_min, u_min, u_min);
+        out[1] = blossom(p, u_min, u_min, u_max);
+        out[2] = blossom(p, u_min, u_max, u_max);
+        out[3] = blossom(p, u_max, u_max, u_max);
+    }
+
+    // De Casteljau at u = 1/2: the control points of both halves, sharing out[3].
+    static void split_half(const vec3 cp[4], vec3 out[7]) {
+        out[0] = cp[0];
+        out[1] = (cp[0] + cp[1]) / 2;
+        out[2] = (cp[0] + 2 * cp[1] + cp[2]) / 4;
+        out[3] = (cp[0] + 3 * cp[1] + 3 * cp[2] + cp[3]) / 8;
+        out[4] = (cp[1] + 2 * cp[2] + cp[3]) / 4;
+        out[5] = (cp[2] + cp[3]) / 2;
+        out[6] = cp[3];
+    }
+
+    static vec3 evaluate(const vec3 cp[4], double u, vec3& derivative) {
+        vec3 a[3] = { lerp(u, cp[0], cp[1]), lerp(u, cp[1], cp[2]), lerp(u, cp[2], cp[3]) };
+        vec3 b[2] = { lerp(u, a[0], a[1]), lerp(u, a[1], a[2]) };
+        derivative = 3 * (b[1] - b[0]);
+        return lerp(u, b[0], b[1]);
+    }
+
+    // Whether the ray, which passes through the ray-space origin, can touch the piece with
+    // control points cp and the given maximum width between depths z_min and z_max.
+    static bool overlaps(const vec3 cp[4], double width, double z_min, double z_max) {
+        auto half = 0.5 * width;
+        double lo[3] = {  infinity,  infinity,  infinity };
+        double hi[3] = { -infinity, -infinity, -infinity };
+        for (int i = 0; i < 4; i++) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::fmin(lo[a], cp[i][a]);
+                hi[a] = std::fmax(hi[a], cp[i][a]);
+            }
+        }
+        return lo[0] - half <= 0 && 0 <= hi[0] + half && lo[1] - half <= 0 && 0 <= hi[1] + half
+            && hi[2] + half >= z_min && lo[2] - half <= z_max;
+    }
+
+    bool recursive_hit(const vec3 cp[4], double u0, double u1, int depth, double z_min,
+                       curve_hit& found) const
+    {
+        if (depth > 0) {
+            vec3 halves[7];
+            split_half(cp, halves);
+            double u[3] = { u0, (u0 + u1) / 2, u1 };
+            bool hit_anything = false;
+            for (int h = 0; h < 2; h++) {
+                const vec3* piece = halves + 3 * h;
+                auto width = std::fmax(width_at(u[h]), width_at(u[h+1]));
+                if (overlaps(piece, width, z_min, found.z)
+                    && recursive_hit(piece, u[h], u[h+1], depth - 1, z_min, found))
+                    hit_anything = true;
+            }
+            return hit_anything;
+        }
+
+        // Flat enough: the ray must pass between the planes through the end points that are
+        // perpendicular to the piece there, so neighbouring pieces don't both claim a hit.
+        auto edge = (cp[1].y() - cp[0].y()) * -cp[0].y() + cp[0].x() * (cp[0].x() - cp[1].x());
+        if (edge < 0)
+            return false;
+        edge = (cp[2].y() - cp[3].y()) * -cp[3].y() + cp[3].x() * (cp[3].x() - cp[2].x());
+        if (edge < 0)
+            return false;
+
+        // Closest point to the ray on the chord, and whether it is within half a width.
+        auto dx = cp[3].x() - cp[0].x(), dy = cp[3].y() - cp[0].y();
+        auto denominator = dx*dx + dy*dy;
+        if (denominator == 0)
+            return false;
+        auto w = std::clamp((-cp[0].x() * dx - cp[0].y() * dy) / denominator, 0.0, 1.0);
+        auto width = width_at(u0 + w * (u1 - u0));
+
+        vec3 tangent;
+        auto pc = evaluate(cp, w, tangent);
+        if (pc.x()*pc.x() + pc.y()*pc.y() > 0.25 * width * width)
+            return false;
+        if (pc.z() <= z_min || pc.z() >= found.z)
+            return false;
+
+        found = { pc.z(), width, pc.x(), pc.y(), tangent };
+        return true;
+    }
+};
+
+
+// Adds a curve to list, cut into segments of equal parameter range so the BVH gets several
+// tight boxes along it instead of one loose one.
+inline void add_curve(hittable_list& list, const point3 (&control)[4], double width0,
+                      double width1, shared_ptr<material> mat, int segments = 8)
+{
+    auto common = make_shared<curve_common>();
+    std::copy(control, control + 4, common->control);
+    common->width[0] = width0;
+    common->width[1] = width1;
+    common->mat = std::move(mat);
+
+    for (int s = 0; s < segments; s++)
+        list.add(make_shared<curve>(common, double(s) / segments, double(s + 1) / segments));
+}
+
+
+#endif
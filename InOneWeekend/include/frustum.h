@@ -0,0 +1,39 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include "aabb.h"
+
+
+// A convex region bounded by planes, each keeping the points with dot(normal, p) <= offset.
+class frustum {
+  public:
+    static const int max_planes = 5;
+
+    vec3   normal[max_planes];
+    double offset[max_planes];
+    int    plane_count = 0;
+
+    void add_plane(const vec3& n, double d) {
+        normal[plane_count] = n;
+        offset[plane_count] = d;
+        plane_count++;
+    }
+
+    // Conservative: false only when the box lies entirely outside one of the planes.
+    bool overlaps(const aabb& box) const {
+        for (int k = 0; k < plane_count; k++) {
+            const auto& n = normal[k];
+            double nearest = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = box.axis_interval(axis);
+                nearest += n[axis] * (n[axis] > 0 ? ax.min : ax.max);
+            }
+            if (nearest > offset[k])
+                return false;
+        }
+        return true;
+    }
+};
+
+
+#endif
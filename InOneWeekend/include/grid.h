@@ -0,0 +1,334 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "hittable_list.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+
+struct grid_options {
+    double density             = 2;       // Cells per primitive.
+    bool   two_level           = false;
+    double top_density         = 0.125;   // Cells per primitive of the top level of a two-level grid.
+    int    subdivide_threshold = 16;      // Primitives in a cell that earn it a sub-grid.
+    double oversized_fraction  = 0.125;   // Box volume, relative to the scene, kept out of the grid.
+};
+
+
+// Uniform grid over the objects of a hittable_list, traversed cell by cell along the ray
+// with a 3D-DDA. Each cell lists every object whose bounding box overlaps it, packed into one
+// index array (cell_start gives each cell's range). With two_level on, the top level is
+// coarse and only its crowded cells get a fine grid of their own, so empty space between
+// clusters of objects costs a few large steps instead of many small ones.
+//
+// An object whose box takes up a large part of the scene, like the ground sphere, would
+// stretch the grid over empty space and land in every cell, so such objects are kept in a
+// short list that every ray tests first.
+class grid : public hittable {
+  public:
+    grid(const hittable_list& list, const grid_options& options = grid_options())
+      : objects(list.objects), options(options)
+    {
+        aabb all;
+        for (const auto& object : objects)
+            all = aabb(all, object->bounding_box());
+
+        auto scene_volume = volume(all);
+        std::vector<uint32_t> inside;
+        aabb bounds;
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            auto box = objects[i]->bounding_box();
+            if (objects.size() > 1 && volume(box) > options.oversized_fraction * scene_volume) {
+                oversized.push_back(i);
+            } else {
+                inside.push_back(i);
+                bounds = aabb(bounds, box);
+            }
+        }
+
+        if (inside.empty())
+            return;
+
+        build_level(top, inside, bounds,
+                    options.two_level ? options.top_density : options.density, true);
+
+        if (options.two_level)
+            build_sub_grids();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+        for (auto i : oversized) {
+            if (objects[i]->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+
+        if (!top.cell_start.empty() && walk(top, r, ray_t, ray_t, rec))
+            hit_anything = true;
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override {
+        aabb box = top.bounds;
+        for (auto i : oversized)
+            box = aabb(box, objects[i]->bounding_box());
+        return box;
+    }
+
+    size_t cell_count() const {
+        size_t cells = top.cell_count();
+        for (const auto& sub : sub_grids)
+            cells += sub.cell_count();
+        return cells;
+    }
+
+    size_t sub_grid_count() const { return sub_grids.size(); }
+
+    size_t memory_bytes() const {
+        size_t bytes = top.memory_bytes() + sub_grid_of.size() * sizeof(int32_t)
+                     + oversized.size() * sizeof(uint32_t);
+        for (const auto& sub : sub_grids)
+            bytes += sub.memory_bytes();
+        return bytes;
+    }
+
+  private:
+    struct grid_level {
+        aabb                  bounds;
+        int                   res[3] = {0, 0, 0};
+        double                cell_size[3];
+        std::vector<uint32_t> cell_start;
+        std::vector<uint32_t> items;
+
+        size_t cell_count() const { return size_t(res[0]) * res[1] * res[2]; }
+
+        size_t memory_bytes() const {
+            return sizeof(grid_level) + (cell_start.size() + items.size()) * sizeof(uint32_t);
+        }
+
+        int coord(double x, int axis) const {
+            const interval& ax = bounds.axis_interval(axis);
+            int c = int((x - ax.min) / cell_size[axis]);
+            return std::clamp(c, 0, res[axis] - 1);
+        }
+
+        int index(int x, int y, int z) const { return (z * res[1] + y) * res[0] + x; }
+    };
+
+    static const int max_resolution = 512;
+
+    std::vector<shared_ptr<hittable>> objects;
+    grid_options                      options;
+    std::vector<uint32_t>             oversized;
+    grid_level                        top;
+    std::vector<int32_t>              sub_grid_of;   // Per top-level cell, -1 for none.
+    std::vector<grid_level>           sub_grids;
+
+    static double volume(const aabb& box) {
+        return box.is_empty() ? 0 : box.x.size() * box.y.size() * box.z.size();
+    }
+
+    // Fills a grid level with the given objects. Overlaps are counted and scattered by all
+    // threads at once through per-cell atomic counters; the prefix sum between the two
+    // passes is a single sweep over the cells.
+    void build_level(grid_level& g, const std::vector<uint32_t>& prims, const aabb& bounds,
+                     double density, bool parallel) const
+    {
+        auto run = [&](int count, auto&& body) {
+            if (parallel)
+                parallel_for(count, body);
+            else
+                body(0, 0, count);
+        };
+
+        // Resolution: cubic-ish cells, density * n of them. Flat axes still get a sliver of
+        // thickness so every cell has a volume.
+        g.bounds = bounds;
+        double extent[3], largest = 0;
+        for (int axis = 0; axis < 3; axis++)
+            largest = std::fmax(largest, bounds.axis_interval(axis).size());
+        for (int axis = 0; axis < 3; axis++)
+            extent[axis] = std::fmax(bounds.axis_interval(axis).size(), 1e-3 * largest + 1e-9);
+        g.bounds = aabb(interval(bounds.x.min, bounds.x.min + extent[0]),
+                        interval(bounds.y.min, bounds.y.min + extent[1]),
+                        interval(bounds.z.min, bounds.z.min + extent[2]));
+
+        auto k = std::cbrt(density * prims.size() / (extent[0] * extent[1] * extent[2]));
+        for (int axis = 0; axis < 3; axis++) {
+            g.res[axis] = std::clamp(int(std::ceil(extent[axis] * k)), 1, max_resolution);
+            g.cell_size[axis] = extent[axis] / g.res[axis];
+        }
+
+        size_t cells = g.cell_count();
+        std::vector<std::atomic<uint32_t>> counts(cells);
+        run(int(cells), [&](int, int begin, int end) {
+            for (int c = begin; c < end; c++)
+                counts[c].store(0, std::memory_order_relaxed);
+        });
+
+        auto for_each_cell = [&](uint32_t prim, auto&& visit) {
+            auto box = objects[prim]->bounding_box();
+            int lo[3], hi[3];
+            for (int axis = 0; axis < 3; axis++) {
+                lo[axis] = g.coord(box.axis_interval(axis).min, axis);
+                hi[axis] = g.coord(box.axis_interval(axis).max, axis);
+            }
+            for (int z = lo[2]; z <= hi[2]; z++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+            for (int x = lo[0]; x <= hi[0]; x++)
+                visit(g.index(x, y, z));
+        };
+
+        run(int(prims.size()), [&](int, int begin, int end) {
+            for (int i = begin; i < end; i++)
+                for_each_cell(prims[i], [&](int c) {
+                    counts[c].fetch_add(1, std::memory_order_relaxed);
+                });
+        });
+
+        g.cell_start.assign(cells + 1, 0);
+        for (size_t c = 0; c < cells; c++) {
+            g.cell_start[c+1] = g.cell_start[c] + counts[c].load(std::memory_order_relaxed);
+            counts[c].store(g.cell_start[c], std::memory_order_relaxed);
+        }
+
+        g.items.resize(g.cell_start[cells]);
+        run(int(prims.size()), [&](int, int begin, int end) {
+            for (int i = begin; i < end; i++)
+                for_each_cell(prims[i], [&](int c) {
+                    g.items[counts[c].fetch_add(1, std::memory_order_relaxed)] = prims[i];
+                });
+        });
+    }
+
+    void build_sub_grids() {
+        std::vector<int> crowded;
+        for (int c = 0; c < int(top.cell_count()); c++) {
+            if (int(top.cell_start[c+1] - top.cell_start[c]) > options.subdivide_threshold)
+                crowded.push_back(c);
+        }
+        if (crowded.empty())
+            return;
+
+        sub_grid_of.assign(top.cell_count(), -1);
+        sub_grids.resize(crowded.size());
+
+        // Each crowded cell is built by one thread; there are usually far more of them than
+        // threads.
+        parallel_for(int(crowded.size()), [&](int, int begin, int end) {
+            for (int s = begin; s < end; s++) {
+                int c = crowded[s];
+                std::vector<uint32_t> prims(top.items.begin() + top.cell_start[c],
+                                            top.items.begin() + top.cell_start[c+1]);
+                aabb bounds;
+                for (auto p : prims)
+                    bounds = aabb(bounds, objects[p]->bounding_box());
+                build_level(sub_grids[s], prims, bounds.intersect(cell_box(top, c)),
+                            options.density, false);
+                sub_grid_of[c] = s;
+            }
+        });
+    }
+
+    static aabb cell_box(const grid_level& g, int c) {
+        int x = c % g.res[0];
+        int y = (c / g.res[0]) % g.res[1];
+        int z = c / (g.res[0] * g.res[1]);
+        int cell[3] = {x, y, z};
+        interval ax[3];
+        for (int axis = 0; axis < 3; axis++) {
+            auto lo = g.bounds.axis_interval(axis).min + cell[axis] * g.cell_size[axis];
+            ax[axis] = interval(lo, lo + g.cell_size[axis]);
+        }
+        return aabb(ax[0], ax[1], ax[2]);
+    }
+
+    // Walks the cells of g that the ray crosses within span, nearest first, testing objects
+    // over ray_t and tightening ray_t.max on each hit. Stops as soon as the closest hit so far
+    // lies inside the cell being visited, since no later cell can hold anything closer.
+    bool walk(const grid_level& g, const ray& r, interval span, interval& ray_t,
+              hit_record& rec) const
+    {
+        const auto& o = r.origin();
+        const auto& d = r.direction();
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = g.bounds.axis_interval(axis);
+            auto inv = 1 / d[axis];
+            auto t0 = (ax.min - o[axis]) * inv;
+            auto t1 = (ax.max - o[axis]) * inv;
+            if (t0 > t1) std::swap(t0, t1);
+            span.min = std::fmax(span.min, t0);
+            span.max = std::fmin(span.max, t1);
+        }
+        if (span.max < span.min)
+            return false;
+
+        auto start = r.at(span.min);
+        int cell[3], step[3], out[3];
+        double t_next[3], t_delta[3];
+        for (int axis = 0; axis < 3; axis++) {
+            cell[axis] = g.coord(start[axis], axis);
+            auto lo = g.bounds.axis_interval(axis).min + cell[axis] * g.cell_size[axis];
+            if (d[axis] > 0) {
+                step[axis] = 1;
+                out[axis] = g.res[axis];
+                t_next[axis] = (lo + g.cell_size[axis] - o[axis]) / d[axis];
+                t_delta[axis] = g.cell_size[axis] / d[axis];
+            } else if (d[axis] < 0) {
+                step[axis] = -1;
+                out[axis] = -1;
+                t_next[axis] = (lo - o[axis]) / d[axis];
+                t_delta[axis] = -g.cell_size[axis] / d[axis];
+            } else {
+                step[axis] = 0;
+                out[axis] = -1;
+                t_next[axis] = infinity;
+                t_delta[axis] = infinity;
+            }
+        }
+
+        bool hit_anything = false;
+        auto cell_enter = span.min;
+        bool top_level = (&g == &top);
+
+        while (true) {
+            int axis = (t_next[0] < t_next[1])
+                     ? (t_next[0] < t_next[2] ? 0 : 2)
+                     : (t_next[1] < t_next[2] ? 1 : 2);
+            auto cell_exit = std::fmin(t_next[axis], span.max);
+            int c = g.index(cell[0], cell[1], cell[2]);
+
+            if (top_level && !sub_grid_of.empty() && sub_grid_of[c] >= 0) {
+                if (walk(sub_grids[sub_grid_of[c]], r, interval(cell_enter, cell_exit), ray_t, rec))
+                    hit_anything = true;
+            } else {
+                for (auto k = g.cell_start[c]; k < g.cell_start[c+1]; k++) {
+                    if (objects[g.items[k]]->hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                }
+            }
+
+            if (ray_t.max <= cell_exit || t_next[axis] >= span.max)
+                return hit_anything;
+
+            cell[axis] += step[axis];
+            if (cell[axis] == out[axis])
+                return hit_anything;
+            cell_enter = t_next[axis];
+            t_next[axis] += t_delta[axis];
+        }
+    }
+};
+
+
+#endif
@@ -0,0 +1,349 @@
+#ifndef HDR_BUFFER_H
+#define HDR_BUFFER_H
+
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+
+// IEEE binary16. Values are clamped to the largest finite half, 65504, first, so nothing
+// turns into infinity; NaN is clamped along with them.
+inline uint16_t float_to_half(float value) {
+    const float largest = 65504.0f;
+    value = (value < largest) ? value : largest;
+    value = (value > -largest) ? value : -largest;
+
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    auto sign = uint16_t((x >> 16) & 0x8000);
+    x &= 0x7fffffff;
+
+    if (x < 0x38800000) {
+        // Below 2^-14 the half is subnormal, in steps of 2^-24. Adding 0.5 lines the value up
+        // so its lowest mantissa bits count those steps, rounded to nearest even by the FPU.
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        f += 0.5f;
+        std::memcpy(&x, &f, sizeof(x));
+        return uint16_t(sign | (x - 0x3f000000));
+    }
+
+    // Rebias the exponent from 127 to 15 and round the mantissa to 10 bits, ties to even.
+    x += 0xc8000fff + ((x >> 13) & 1);
+    return uint16_t(sign | (x >> 13));
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t x = uint32_t(h & 0x7fff) << 13;
+    uint32_t exponent = x & 0x0f800000;
+    x += (127 - 15) << 23;
+
+    float f;
+    if (exponent == 0x0f800000) {
+        x += (128 - 16) << 23;   // Infinity or NaN.
+        std::memcpy(&f, &x, sizeof(f));
+    } else if (exponent == 0) {
+        // Subnormal: let the FPU normalize it.
+        x += 1 << 23;
+        const uint32_t magic_bits = 113 << 23;
+        float magic;
+        std::memcpy(&f, &x, sizeof(f));
+        std::memcpy(&magic, &magic_bits, sizeof(magic));
+        f -= magic;
+    } else {
+        std::memcpy(&f, &x, sizeof(f));
+    }
+    return (h & 0x8000) ? -f : f;
+}
+
+
+// Shared exponent RGB in 32 bits, as in EXT_texture_shared_exponent: three 9-bit mantissas
+// and one 5-bit exponent for all of them. Negative values and NaN are stored as 0, and the
+// largest value is 65408.
+inline uint32_t color_to_rgb9e5(const color& c) {
+    const int mantissa_bits = 9, bias = 15, max_exponent = 31;
+    const double largest = double((1 << mantissa_bits) - 1) / (1 << mantissa_bits)
+                         * std::ldexp(1.0, max_exponent - bias);
+
+    double rgb[3];
+    for (int k = 0; k < 3; k++) {
+        auto v = (c[k] > 0) ? c[k] : 0.0;
+        rgb[k] = (v < largest) ? v : largest;
+    }
+    auto brightest = std::fmax(rgb[0], std::fmax(rgb[1], rgb[2]));
+    if (brightest <= 0)
+        return 0;
+
+    int e;
+    std::frexp(brightest, &e);   // brightest = m 2^e with m in [0.5, 1).
+    int shared = std::max(-bias - 1, e - 1) + 1 + bias;
+    auto step = std::ldexp(1.0, shared - bias - mantissa_bits);
+    if (std::floor(brightest / step + 0.5) == (1 << mantissa_bits)) {
+        step *= 2;
+        shared++;
+    }
+
+    uint32_t packed = uint32_t(shared) << 27;
+    for (int k = 0; k < 3; k++)
+        packed |= uint32_t(std::floor(rgb[k] / step + 0.5)) << (9 * k);
+    return packed;
+}
+
+inline color rgb9e5_to_color(uint32_t packed) {
+    auto step = std::ldexp(1.0, int(packed >> 27) - 15 - 9);
+    return color(double(packed & 0x1ff), double((packed >> 9) & 0x1ff),
+                 double((packed >> 18) & 0x1ff)) * step;
+}
+
+
+enum class pixel_format { float32, half, rgb9e5 };
+
+inline const char* pixel_format_name(pixel_format format) {
+    switch (format) {
+        case pixel_format::half:   return "half";
+        case pixel_format::rgb9e5: return "rgb9e5";
+        default:                   return "float32";
+    }
+}
+
+
+// A width by height image of linear RGB radiance, in one of three storage formats: 12 bytes
+// a pixel as float32, 6 as half floats, or 4 as RGB9E5.
+//
+// set() stores a finished value, rounding it once. add() is for accumulating, such as one
+// frame after another into a running sum, which a compact format would otherwise round on
+// every frame until small additions stop registering at all. In the compact formats, add()
+// collects into float32 tiles of 32x32 pixels instead, each folded into the compact pixels
+// and freed once flush_interval values per pixel have gone into it, so the error is only
+// that of one rounding per flush_interval additions. Reads include anything not yet folded.
+//
+// At most max_staged_tiles tiles collect at once; staging another folds the least recently
+// added to first. That bounds the float32 staging to a fixed few hundred KB whatever the
+// image size, so the compact formats stay compact. Accumulating a region at a time, as a
+// bucket renderer does, keeps the full benefit; sweeping the whole frame per addition
+// cycles through more tiles than that and gets one rounding per frame again for most of them.
+// Even fully staged, a compact running sum loses to the shrinking noise after some hundreds
+// of additions per pixel, so progressive sums over many frames belong in float32.
+//
+// set() may be called from several threads as long as they write different pixels. add() and
+// flush() are for one thread at a time.
+class hdr_buffer {
+  public:
+    static const int tile_size = 32;
+    int flush_interval = 16;
+    int max_staged_tiles = 64;
+
+    hdr_buffer(int width, int height, pixel_format format = pixel_format::float32)
+      : image_width(width), image_height(height), format(format),
+        tiles_x((width + tile_size - 1) / tile_size),
+        staging(size_t(tiles_x) * ((height + tile_size - 1) / tile_size))
+    {
+        size_t pixels = size_t(width) * height;
+        switch (format) {
+            case pixel_format::float32: floats.assign(3 * pixels, 0.0f); break;
+            case pixel_format::half:    halves.assign(3 * pixels, 0); break;
+            case pixel_format::rgb9e5:  shared.assign(pixels, 0); break;
+        }
+    }
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+    pixel_format storage() const { return format; }
+
+    color get(int i, int j) const {
+        auto c = load(pixel(i, j));
+        if (const auto* tile = staging[tile_of(i, j)].get()) {
+            const float* s = &tile->rgb[3 * in_tile(i, j)];
+            c += color(s[0], s[1], s[2]);
+        }
+        return c;
+    }
+
+    void set(int i, int j, const color& c) {
+        store(pixel(i, j), c);
+        if (auto* tile = staging[tile_of(i, j)].get())
+            std::fill_n(&tile->rgb[3 * in_tile(i, j)], 3, 0.0f);
+    }
+
+    void add(int i, int j, const color& c) {
+        if (format == pixel_format::float32) {
+            float* p = &floats[3 * pixel(i, j)];
+            p[0] += float(c.x());
+            p[1] += float(c.y());
+            p[2] += float(c.z());
+            return;
+        }
+
+        auto& tile = staging[tile_of(i, j)];
+        if (!tile) {
+            while (!staged.empty() && int(staged.size()) >= max_staged_tiles)
+                fold(least_recently_added());
+            tile = std::make_unique<staged_tile>();
+            tile->rgb.assign(3 * tile_size * tile_size, 0.0f);
+            staged.push_back(tile_of(i, j));
+            peak_bytes = std::max(peak_bytes, memory_bytes());
+        }
+        tile->last_added = ++add_count;
+        float* s = &tile->rgb[3 * in_tile(i, j)];
+        s[0] += float(c.x());
+        s[1] += float(c.y());
+        s[2] += float(c.z());
+        if (++tile->additions >= flush_interval * tile_pixels(i, j))
+            fold(tile_of(i, j));
+    }
+
+    // Folds every tile still collecting additions into the stored pixels.
+    void flush() {
+        while (!staged.empty())
+            fold(staged.back());
+    }
+
+    void clear() {
+        std::fill(floats.begin(), floats.end(), 0.0f);
+        std::fill(halves.begin(), halves.end(), uint16_t(0));
+        std::fill(shared.begin(), shared.end(), 0u);
+        for (auto& tile : staging)
+            tile.reset();
+        staged.clear();
+    }
+
+    // Row j as three planar float channels, each value multiplied by gain.
+    void load_row(int j, float gain, float* r, float* g, float* b) const {
+        size_t first = size_t(j) * image_width;
+        switch (format) {
+            case pixel_format::float32:
+                for (int i = 0; i < image_width; i++) {
+                    const float* p = &floats[3 * (first + i)];
+                    r[i] = p[0] * gain;
+                    g[i] = p[1] * gain;
+                    b[i] = p[2] * gain;
+                }
+                break;
+            case pixel_format::half:
+                for (int i = 0; i < image_width; i++) {
+                    const uint16_t* p = &halves[3 * (first + i)];
+                    r[i] = half_to_float(p[0]) * gain;
+                    g[i] = half_to_float(p[1]) * gain;
+                    b[i] = half_to_float(p[2]) * gain;
+                }
+                break;
+            case pixel_format::rgb9e5:
+                for (int i = 0; i < image_width; i++) {
+                    auto c = rgb9e5_to_color(shared[first + i]);
+                    r[i] = float(c.x()) * gain;
+                    g[i] = float(c.y()) * gain;
+                    b[i] = float(c.z()) * gain;
+                }
+                break;
+        }
+
+        for (int tx = 0; tx < tiles_x; tx++) {
+            const auto* tile = staging[size_t(j / tile_size) * tiles_x + tx].get();
+            if (!tile)
+                continue;
+            int i0 = tx * tile_size, i1 = std::min(i0 + tile_size, image_width);
+            for (int i = i0; i < i1; i++) {
+                const float* s = &tile->rgb[3 * in_tile(i, j)];
+                r[i] += s[0] * gain;
+                g[i] += s[1] * gain;
+                b[i] += s[2] * gain;
+            }
+        }
+    }
+
+    // Bytes of pixel storage, plus any float32 tiles collecting additions right now.
+    size_t memory_bytes() const {
+        return floats.size() * sizeof(float) + halves.size() * sizeof(uint16_t)
+             + shared.size() * sizeof(uint32_t)
+             + staged.size() * 3 * tile_size * tile_size * sizeof(float);
+    }
+
+    // The most memory_bytes() has been since construction, staging at its fullest included.
+    size_t peak_memory_bytes() const { return std::max(peak_bytes, memory_bytes()); }
+
+  private:
+    struct staged_tile {
+        std::vector<float> rgb;
+        int additions = 0;
+        unsigned long long last_added = 0;
+    };
+
+    int                   image_width, image_height;
+    pixel_format          format;
+    int                   tiles_x;
+    std::vector<float>    floats;
+    std::vector<uint16_t> halves;
+    std::vector<uint32_t> shared;
+    std::vector<std::unique_ptr<staged_tile>> staging;
+    std::vector<size_t>   staged;           // The tiles in staging that are allocated.
+    unsigned long long    add_count = 0;    // Counts add() calls, to order them.
+    size_t                peak_bytes = 0;
+
+    size_t pixel(int i, int j) const { return size_t(j) * image_width + i; }
+    size_t tile_of(int i, int j) const {
+        return size_t(j / tile_size) * tiles_x + i / tile_size;
+    }
+    static int in_tile(int i, int j) { return (j % tile_size) * tile_size + i % tile_size; }
+
+    // Pixels in the tile holding (i, j), fewer along the right and bottom edges.
+    int tile_pixels(int i, int j) const {
+        int i0 = i - i % tile_size, j0 = j - j % tile_size;
+        return (std::min(i0 + tile_size, image_width) - i0)
+             * (std::min(j0 + tile_size, image_height) - j0);
+    }
+
+    color load(size_t p) const {
+        switch (format) {
+            case pixel_format::half:
+                return color(half_to_float(halves[3 * p]), half_to_float(halves[3 * p + 1]),
+                             half_to_float(halves[3 * p + 2]));
+            case pixel_format::rgb9e5:
+                return rgb9e5_to_color(shared[p]);
+            default:
+                return color(floats[3 * p], floats[3 * p + 1], floats[3 * p + 2]);
+        }
+    }
+
+    void store(size_t p, const color& c) {
+        switch (format) {
+            case pixel_format::half:
+                for (int k = 0; k < 3; k++)
+                    halves[3 * p + k] = float_to_half(float(c[k]));
+                break;
+            case pixel_format::rgb9e5:
+                shared[p] = color_to_rgb9e5(c);
+                break;
+            default:
+                for (int k = 0; k < 3; k++)
+                    floats[3 * p + k] = float(c[k]);
+                break;
+        }
+    }
+
+    void fold(size_t t) {
+        const auto& tile = *staging[t];
+        int i0 = int(t % tiles_x) * tile_size, j0 = int(t / tiles_x) * tile_size;
+        for (int j = j0; j < std::min(j0 + tile_size, image_height); j++) {
+            for (int i = i0; i < std::min(i0 + tile_size, image_width); i++) {
+                const float* s = &tile.rgb[3 * in_tile(i, j)];
+                store(pixel(i, j), load(pixel(i, j)) + color(s[0], s[1], s[2]));
+            }
+        }
+        staging[t].reset();
+        staged.erase(std::find(staged.begin(), staged.end(), t));
+    }
+
+    size_t least_recently_added() const {
+        return *std::min_element(staged.begin(), staged.end(), [&](size_t a, size_t b) {
+            return staging[a]->last_added < staging[b]->last_added;
+        });
+    }
+};
+
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include "hittable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+
+// Terrain given by a regular grid of heights: nx by nz samples spaced evenly over the xz plane
+// from origin, each cell between four samples split into two triangles along its diagonal.
+//
+// Nothing is triangulated up front. A min-max mipmap over the cells is built instead: level 0
+// holds the lowest and highest height of every cell, and each level above holds the range of
+// the 2x2 block below it, up to a single range for the whole terrain. The levels form a
+// quadtree of boxes that is walked front to back, descending only into blocks whose height
+// range the ray passes through, and the two triangles of a cell are only built once the walk
+// reaches it. That costs two floats per cell, plus a third more for the coarser levels.
+class heightfield : public hittable {
+  public:
+    heightfield(int nx, int nz, std::vector<float> heights, double spacing, const point3& origin,
+                shared_ptr<material> mat)
+      : nx(nx), nz(nz), heights(std::move(heights)), spacing(spacing), origin(origin),
+        mat(std::move(mat))
+    {
+        if (nx < 2 || nz < 2 || this->heights.size() != size_t(nx) * nz)
+            throw std::invalid_argument("heightfield needs at least 2x2 samples");
+        build_levels();
+
+        const auto& top = levels.back().ranges[0];
+        bbox = aabb(origin + vec3(0, top.lo, 0),
+                    origin + vec3((nx - 1) * spacing, top.hi, (nz - 1) * spacing));
+    }
+
+    // Reads a raw height image of nx by nz unsigned 16-bit samples, row by row, as written by
+    // most terrain tools, and maps 0..65535 to heights 0..height_scale above origin.
+    static shared_ptr<heightfield> load_raw(std::istream& in, int nx, int nz, double spacing,
+                                            double height_scale, const point3& origin,
+                                            shared_ptr<material> mat)
+    {
+        std::vector<float> heights(size_t(nx) * nz);
+        std::vector<uint16_t> row(nx);
+        for (int z = 0; z < nz; z++) {
+            in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(uint16_t));
+            if (!in)
+                throw std::runtime_error("height image ends early");
+            for (int x = 0; x < nx; x++)
+                heights[size_t(z) * nx + x] = float(row[x] * (height_scale / 65535));
+        }
+        return make_shared<heightfield>(nx, nz, std::move(heights), spacing, origin,
+                                        std::move(mat));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Block boxes are tested relative to the terrain's origin.
+        const vec3 o = r.origin() - origin;
+        const vec3 d = r.direction();
+        const vec3 inv_dir(1 / d.x(), 1 / d.y(), 1 / d.z());
+
+        // Children are visited in the order the ray direction passes them, nearest first.
+        const int first_x = d.x() < 0 ? 1 : 0;
+        const int first_z = d.z() < 0 ? 1 : 0;
+
+        struct node { int level, i, j; };
+        node stack[4 * 32];
+        int stack_size = 0;
+        stack[stack_size++] = { int(levels.size()) - 1, 0, 0 };
+
+        bool hit_anything = false;
+        while (stack_size > 0) {
+            auto [level, i, j] = stack[--stack_size];
+            const auto& grid = levels[level];
+            const auto& range = grid.ranges[size_t(j) * grid.width + i];
+
+            // Box of the block: the cells it covers across xz, its height range in y.
+            double x0 = double(i << level) * spacing;
+            double x1 = double(std::min((i + 1) << level, nx - 1)) * spacing;
+            double z0 = double(j << level) * spacing;
+            double z1 = double(std::min((j + 1) << level, nz - 1)) * spacing;
+            if (!box_hit(o, inv_dir, x0, x1, range.lo - 1e-6, range.hi + 1e-6, z0, z1, ray_t))
+                continue;
+
+            if (level == 0) {
+                if (hit_cell(r, i, j, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+                continue;
+            }
+
+            // Push the far children first so the near ones come off the stack first.
+            const auto& below = levels[level - 1];
+            for (int k = 3; k >= 0; k--) {
+                int ci = 2 * i + ((k & 1) ^ first_x);
+                int cj = 2 * j + ((k >> 1) ^ first_z);
+                if (ci < below.width && cj < below.depth)
+                    stack[stack_size++] = { level - 1, ci, cj };
+            }
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t memory_bytes() const {
+        size_t bytes = heights.size() * sizeof(float);
+        for (const auto& grid : levels)
+            bytes += grid.ranges.size() * sizeof(height_range);
+        return bytes;
+    }
+
+  private:
+    struct height_range { float lo, hi; };
+
+    struct level_grid {
+        int width, depth;
+        std::vector<height_range> ranges;
+    };
+
+    int                     nx, nz;
+    std::vector<float>      heights;
+    double                  spacing;
+    point3                  origin;
+    shared_ptr<material>    mat;
+    std::vector<level_grid> levels;   // Finest first; the last is a single range.
+    aabb                    bbox;
+
+    double height(int x, int z) const { return heights[size_t(z) * nx + x]; }
+
+    void build_levels() {
+        level_grid cells{ nx - 1, nz - 1, {} };
+        cells.ranges.resize(size_t(cells.width) * cells.depth);
+        for (int j = 0; j < cells.depth; j++) {
+            for (int i = 0; i < cells.width; i++) {
+                auto a = height(i, j), b = height(i + 1, j);
+                auto c = height(i, j + 1), e = height(i + 1, j + 1);
+                cells.ranges[size_t(j) * cells.width + i] = {
+                    float(std::min({a, b, c, e})), float(std::max({a, b, c, e})) };
+            }
+        }
+        levels.push_back(std::move(cells));
+
+        while (levels.back().width > 1 || levels.back().depth > 1) {
+            const auto& fine = levels.back();
+            level_grid coarse{ (fine.width + 1) / 2, (fine.depth + 1) / 2, {} };
+            coarse.ranges.resize(size_t(coarse.width) * coarse.depth);
+            for (int j = 0; j < coarse.depth; j++) {
+                for (int i = 0; i < coarse.width; i++) {
+                    height_range merged{ std::numeric_limits<float>::max(),
+                                         std::numeric_limits<float>::lowest() };
+                    for (int cj = 2 * j; cj < std::min(2 * j + 2, fine.depth); cj++) {
+                        for (int ci = 2 * i; ci < std::min(2 * i + 2, fine.width); ci++) {
+                            const auto& child = fine.ranges[size_t(cj) * fine.width + ci];
+                            merged.lo = std::min(merged.lo, child.lo);
+                            merged.hi = std::max(merged.hi, child.hi);
+                        }
+                    }
+                    coarse.ranges[size_t(j) * coarse.width + i] = merged;
+                }
+            }
+            levels.push_back(std::move(coarse));
+        }
+    }
+
+    static bool box_hit(const vec3& o, const vec3& inv_dir, double x0, double x1, double y0,
+                        double y1, double z0, double z1, interval ray_t)
+    {
+        const double lo[3] = { x0, y0, z0 };
+        const double hi[3] = { x1, y1, z1 };
+        for (int axis = 0; axis < 3; axis++) {
+            auto t0 = (lo[axis] - o[axis]) * inv_dir[axis];
+            auto t1 = (hi[axis] - o[axis]) * inv_dir[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max < ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    point3 sample_point(int x, int z) const {
+        return origin + vec3(x * spacing, height(x, z), z * spacing);
+    }
+
+    // Smooth shading normal at a sample, from central differences of the heights around it.
+    vec3 sample_normal(int x, int z) const {
+        int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, nx - 1);
+        int z0 = std::max(z - 1, 0), z1 = std::min(z + 1, nz - 1);
+        auto dhdx = (height(x1, z) - height(x0, z)) / ((x1 - x0) * spacing);
+        auto dhdz = (height(x, z1) - height(x, z0)) / ((z1 - z0) * spacing);
+        return unit_vector(vec3(-dhdx, 1, -dhdz));
+    }
+
+    // The two triangles of cell (i, j), split along the diagonal from (i, j) to (i+1, j+1).
+    bool hit_cell(const ray& r, int i, int j, const interval& ray_t, hit_record& rec) const {
+        const int corners[2][3][2] = {
+            { {i, j}, {i + 1, j}, {i + 1, j + 1} },
+            { {i, j}, {i + 1, j + 1}, {i, j + 1} },
+        };
+
+        bool hit_anything = false;
+        auto closest = ray_t.max;
+        for (const auto& tri : corners) {
+            // Moller-Trumbore.
+            auto p0 = sample_point(tri[0][0], tri[0][1]);
+            auto e1 = sample_point(tri[1][0], tri[1][1]) - p0;
+            auto e2 = sample_point(tri[2][0], tri[2][1]) - p0;
+            auto pv = cross(r.direction(), e2);
+            auto det = dot(e1, pv);
+            if (std::fabs(det) < 1e-12)
+                continue;
+            auto inv_det = 1 / det;
+            auto tv = r.origin() - p0;
+            auto u = dot(tv, pv) * inv_det;
+            if (u < 0 || u > 1)
+                continue;
+            auto qv = cross(tv, e1);
+            auto v = dot(r.direction(), qv) * inv_det;
+            if (v < 0 || u + v > 1)
+                continue;
+            auto t = dot(e2, qv) * inv_det;
+            if (t <= ray_t.min || t >= closest)
+                continue;
+
+            closest = t;
+            hit_anything = true;
+            rec.t = t;
+            rec.p = r.at(t);
+            // The side is the triangle's; the shading normal is interpolated from the samples,
+            // unless along a silhouette it would face away from the ray.
+            rec.set_face_normal(r, unit_vector(cross(e2, e1)));
+            auto smooth = unit_vector((1 - u - v) * sample_normal(tri[0][0], tri[0][1])
+                                      + u * sample_normal(tri[1][0], tri[1][1])
+                                      + v * sample_normal(tri[2][0], tri[2][1]));
+            if (!rec.front_face)
+                smooth = -smooth;
+            if (dot(smooth, r.direction()) < 0)
+                rec.normal = smooth;
+            rec.mat = mat;
+        }
+        return hit_anything;
+    }
+};
+
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "aabb.h"
+
 
 class material;
 
@@ -25,6 +27,19 @@ class hittable {
     virtual ~hittable() = default;
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+    virtual aabb bounding_box() const = 0;
+
+    // Bounds of just the part of the object inside a slab across one axis. Spatial-split BVH
+    // builds use it to cut a large object into pieces; shapes that can do better than
+    // clipping their bounding box should.
+    virtual aabb clipped_bounding_box(int axis, const interval& slab) const {
+        return bounding_box().clip(axis, slab);
+    }
+
+    // Samples a point uniformly over the surface, filling in its position, outward normal and
+    // material, and returns the total surface area. Only shapes used as area lights need it.
+    virtual bool sample_surface(hit_record& /*rec*/, double& /*area*/) const { return false; }
 };
 
 
@@ -10,6 +10,11 @@ class interval {
 
     interval(double min, double max) : min(min), max(max) {}
 
+    interval(const interval& a, const interval& b) {
+        min = a.min <= b.min ? a.min : b.min;
+        max = a.max >= b.max ? a.max : b.max;
+    }
+
     double size() const {
         return max - min;
     }
@@ -28,6 +33,15 @@ class interval {
         return x;
     }
 
+    interval intersect(const interval& other) const {
+        return interval(min >= other.min ? min : other.min, max <= other.max ? max : other.max);
+    }
+
+    interval expand(double delta) const {
+        auto padding = delta/2;
+        return interval(min - padding, max + padding);
+    }
+
     static const interval empty, universe;
 };
 
@@ -0,0 +1,345 @@
+#ifndef KD_TREE_H
+#define KD_TREE_H
+
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// Eight bytes per node. Interior nodes keep the split plane as a float and the index of their
+// above child (the below child directly follows its parent); leaves keep either their single
+// primitive or an offset into the shared primitive index list.
+struct kd_node {
+    union {
+        float    split;
+        uint32_t one_primitive;
+        uint32_t primitive_offset;
+    };
+    uint32_t flags;   // Low two bits: split axis, or 3 for a leaf. The rest: above child or count.
+
+    bool     is_leaf() const        { return (flags & 3) == 3; }
+    int      axis() const           { return int(flags & 3); }
+    uint32_t count() const          { return flags >> 2; }
+    uint32_t above_child() const    { return flags >> 2; }
+};
+
+static_assert(sizeof(kd_node) == 8, "kd_node should stay at eight bytes");
+
+
+// SAH kd-tree over the objects of a hittable_list, built in O(N log N) after Wald and Havran:
+// the split candidates (box start, end and planar events) are sorted once per axis and every
+// node's sorted lists are split into its children's without sorting again, except for the
+// few pieces of objects that straddle the plane. Splits that cut off empty space get a cost
+// bonus, so the tree wraps tightly around the geometry.
+class kd_tree : public hittable {
+  public:
+    double traversal_cost = 1;
+    double intersection_cost = 1.5;
+    double empty_bonus = 0.2;   // Fraction of the cost saved by a split with one empty side.
+
+    explicit kd_tree(const hittable_list& list) : objects(list.objects) {
+        std::vector<kd_ref> refs;
+        for (int i = 0; i < int(objects.size()); i++) {
+            auto box = objects[i]->bounding_box();
+            refs.push_back({box, i});
+            bounds = aabb(bounds, box);
+        }
+        if (refs.empty())
+            return;
+
+        std::vector<kd_event> events[3];
+        for (int axis = 0; axis < 3; axis++) {
+            for (int r = 0; r < int(refs.size()); r++)
+                add_events(refs[r].box, axis, r, events[axis]);
+            std::sort(events[axis].begin(), events[axis].end());
+        }
+
+        max_depth = int(8 + 1.3 * std::log2(double(refs.size())));
+        build(refs, events, bounds, 0);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        const auto& o = r.origin();
+        const auto& d = r.direction();
+        double inv_dir[3] = { 1 / d[0], 1 / d[1], 1 / d[2] };
+
+        auto span = ray_t;
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = bounds.axis_interval(axis);
+            auto t0 = (ax.min - o[axis]) * inv_dir[axis];
+            auto t1 = (ax.max - o[axis]) * inv_dir[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            span.min = std::fmax(span.min, t0);
+            span.max = std::fmin(span.max, t1);
+        }
+        if (span.max < span.min)
+            return false;
+
+        struct entry { uint32_t node; double t_min, t_max; };
+        entry stack[64];
+        int stack_size = 0;
+
+        uint32_t current = 0;
+        double t_min = span.min, t_max = span.max;
+        bool hit_anything = false;
+
+        while (true) {
+            if (ray_t.max < t_min)
+                break;
+
+            const auto& node = nodes[current];
+            if (!node.is_leaf()) {
+                int axis = node.axis();
+                double split = node.split;
+                auto t_plane = (split - o[axis]) * inv_dir[axis];
+
+                bool below_first = (o[axis] < split) || (o[axis] == split && d[axis] <= 0);
+                uint32_t first  = below_first ? current + 1 : node.above_child();
+                uint32_t second = below_first ? node.above_child() : current + 1;
+
+                if (t_plane > t_max || t_plane <= 0) {
+                    current = first;
+                } else if (t_plane < t_min) {
+                    current = second;
+                } else {
+                    stack[stack_size++] = { second, t_plane, t_max };
+                    current = first;
+                    t_max = t_plane;
+                }
+                continue;
+            }
+
+            uint32_t n = node.count();
+            for (uint32_t k = 0; k < n; k++) {
+                auto prim = (n == 1) ? node.one_primitive : primitive_indices[node.primitive_offset + k];
+                if (objects[prim]->hit(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            auto next = stack[--stack_size];
+            current = next.node;
+            t_min = next.t_min;
+            t_max = next.t_max;
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bounds; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    size_t memory_bytes() const {
+        return nodes.size() * sizeof(kd_node) + primitive_indices.size() * sizeof(uint32_t);
+    }
+
+  private:
+    struct kd_ref {
+        aabb box;     // The part of the object inside the current node.
+        int  primitive;
+    };
+
+    // Ends sort before planar events before starts at the same position, so a sweep sees
+    // every object that finishes at a plane before any that begins there.
+    enum event_type { event_end = 0, event_planar = 1, event_start = 2 };
+
+    struct kd_event {
+        double pos;
+        int    type;
+        int    ref;
+
+        bool operator<(const kd_event& other) const {
+            return pos < other.pos || (pos == other.pos && type < other.type);
+        }
+    };
+
+    struct kd_split {
+        double cost = infinity;
+        int    axis = -1;
+        double pos = 0;
+        bool   planar_left = false;
+    };
+
+    enum side { left_only, right_only, both };
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<kd_node>              nodes;
+    std::vector<uint32_t>             primitive_indices;
+    aabb                              bounds;
+    int                               max_depth = 0;
+
+    static void add_events(const aabb& box, int axis, int ref, std::vector<kd_event>& out) {
+        const interval& ax = box.axis_interval(axis);
+        if (ax.min == ax.max) {
+            out.push_back({ax.min, event_planar, ref});
+        } else {
+            out.push_back({ax.min, event_start, ref});
+            out.push_back({ax.max, event_end, ref});
+        }
+    }
+
+    double sah(const aabb& voxel, int axis, double pos, int n_left, int n_right) const {
+        auto below = voxel.clip(axis, interval(voxel.axis_interval(axis).min, pos));
+        auto above = voxel.clip(axis, interval(pos, voxel.axis_interval(axis).max));
+        auto inv_area = 1 / voxel.surface_area();
+        auto cost = traversal_cost + intersection_cost * inv_area
+                  * (below.surface_area() * n_left + above.surface_area() * n_right);
+        if (n_left == 0 || n_right == 0)
+            cost *= 1 - empty_bonus;
+        return cost;
+    }
+
+    kd_split find_split(int n, const std::vector<kd_event> (&events)[3], const aabb& voxel) const {
+        kd_split best;
+        if (voxel.surface_area() <= 0)
+            return best;
+
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& list = events[axis];
+            const interval& extent = voxel.axis_interval(axis);
+            int n_left = 0, n_right = n;
+
+            for (size_t i = 0; i < list.size(); ) {
+                auto pos = list[i].pos;
+                int ending = 0, planar = 0, starting = 0;
+                while (i < list.size() && list[i].pos == pos && list[i].type == event_end)    { ending++;   i++; }
+                while (i < list.size() && list[i].pos == pos && list[i].type == event_planar) { planar++;   i++; }
+                while (i < list.size() && list[i].pos == pos && list[i].type == event_start)  { starting++; i++; }
+
+                n_right -= planar + ending;
+                if (extent.surrounds(pos)) {
+                    auto cost_left  = sah(voxel, axis, pos, n_left + planar, n_right);
+                    auto cost_right = sah(voxel, axis, pos, n_left, n_right + planar);
+                    if (cost_left < best.cost)
+                        best = { cost_left, axis, pos, true };
+                    if (cost_right < best.cost)
+                        best = { cost_right, axis, pos, false };
+                }
+                n_left += starting + planar;
+            }
+        }
+
+        return best;
+    }
+
+    uint32_t make_leaf(const std::vector<kd_ref>& refs) {
+        kd_node node;
+        node.flags = 3 | (uint32_t(refs.size()) << 2);
+        if (refs.size() == 1) {
+            node.one_primitive = uint32_t(refs[0].primitive);
+        } else {
+            node.primitive_offset = uint32_t(primitive_indices.size());
+            for (const auto& ref : refs)
+                primitive_indices.push_back(uint32_t(ref.primitive));
+        }
+        nodes.push_back(node);
+        return uint32_t(nodes.size() - 1);
+    }
+
+    uint32_t build(std::vector<kd_ref>& refs, std::vector<kd_event> (&events)[3],
+                   const aabb& voxel, int depth)
+    {
+        int n = int(refs.size());
+        auto best = find_split(n, events, voxel);
+        if (n <= 1 || depth >= max_depth || best.axis < 0 || best.cost >= intersection_cost * n)
+            return make_leaf(refs);
+
+        // The plane is stored as a float, so classify against the value traversal will see.
+        int axis = best.axis;
+        double pos = double(float(best.pos));
+        const interval& extent = voxel.axis_interval(axis);
+        if (!extent.surrounds(pos))
+            return make_leaf(refs);
+
+        std::vector<side> sides(n);
+        for (int r = 0; r < n; r++) {
+            const interval& ax = refs[r].box.axis_interval(axis);
+            if (ax.min == pos && ax.max == pos)
+                sides[r] = best.planar_left ? left_only : right_only;
+            else if (ax.max <= pos)
+                sides[r] = left_only;
+            else if (ax.min >= pos)
+                sides[r] = right_only;
+            else
+                sides[r] = both;
+        }
+
+        auto below = voxel.clip(axis, interval(extent.min, pos));
+        auto above = voxel.clip(axis, interval(pos, extent.max));
+
+        // Objects on one side keep their sorted events; straddling objects are clipped to
+        // each side and only their new events are sorted and merged in.
+        std::vector<kd_ref> left_refs, right_refs;
+        std::vector<int> left_index(n, -1), right_index(n, -1);
+        std::vector<kd_event> left_new[3], right_new[3];
+
+        for (int r = 0; r < n; r++) {
+            if (sides[r] == left_only) {
+                left_index[r] = int(left_refs.size());
+                left_refs.push_back(refs[r]);
+            } else if (sides[r] == right_only) {
+                right_index[r] = int(right_refs.size());
+                right_refs.push_back(refs[r]);
+            } else {
+                auto object = objects[refs[r].primitive];
+                auto l = object->clipped_bounding_box(axis, below.axis_interval(axis))
+                               .intersect(refs[r].box).intersect(below);
+                auto h = object->clipped_bounding_box(axis, above.axis_interval(axis))
+                               .intersect(refs[r].box).intersect(above);
+                if (!l.is_empty()) {
+                    for (int a = 0; a < 3; a++)
+                        add_events(l, a, int(left_refs.size()), left_new[a]);
+                    left_refs.push_back({l, refs[r].primitive});
+                }
+                if (!h.is_empty()) {
+                    for (int a = 0; a < 3; a++)
+                        add_events(h, a, int(right_refs.size()), right_new[a]);
+                    right_refs.push_back({h, refs[r].primitive});
+                }
+            }
+        }
+
+        std::vector<kd_event> left_events[3], right_events[3];
+        for (int a = 0; a < 3; a++) {
+            std::vector<kd_event> left_kept, right_kept;
+            for (const auto& e : events[a]) {
+                if (sides[e.ref] == left_only)
+                    left_kept.push_back({e.pos, e.type, left_index[e.ref]});
+                else if (sides[e.ref] == right_only)
+                    right_kept.push_back({e.pos, e.type, right_index[e.ref]});
+            }
+            events[a].clear();
+            events[a].shrink_to_fit();
+
+            std::sort(left_new[a].begin(), left_new[a].end());
+            std::sort(right_new[a].begin(), right_new[a].end());
+            std::merge(left_kept.begin(), left_kept.end(), left_new[a].begin(), left_new[a].end(),
+                       std::back_inserter(left_events[a]));
+            std::merge(right_kept.begin(), right_kept.end(), right_new[a].begin(), right_new[a].end(),
+                       std::back_inserter(right_events[a]));
+        }
+        refs.clear();
+        refs.shrink_to_fit();
+
+        uint32_t index = uint32_t(nodes.size());
+        nodes.emplace_back();
+        build(left_refs, left_events, below, depth + 1);
+        uint32_t above_child = build(right_refs, right_events, above, depth + 1);
+
+        nodes[index].split = float(pos);
+        nodes[index].flags = uint32_t(axis) | (above_child << 2);
+        return index;
+    }
+};
+
+
+#endif
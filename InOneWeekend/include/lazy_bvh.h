@@ -0,0 +1,169 @@
+#ifndef LAZY_BVH_H
+#define LAZY_BVH_H
+
+#include "bvh.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+struct lazy_bvh_options {
+    int         subtree_size = 1024;   // Primitives under a deferred subtree, at most.
+    bvh_options subtree;               // How each deferred subtree is built once it is needed.
+};
+
+
+// A bvh that only builds what rays reach. The constructor builds just the top of the tree,
+// splitting at the median centroid along the widest axis, which is a single pass per level,
+// until every node holds at most subtree_size primitives. Those nodes become deferred
+// subtrees: a list of primitives and a box. The first ray to reach one builds a full SAH bvh
+// over its primitives; geometry no ray reaches is never sorted at all.
+//
+// Building is thread-safe. One thread wins the build and any other thread reaching the same
+// subtree meanwhile waits for it, which costs less than tracing thousands of primitives
+// unsorted. Finished subtrees are found through an atomic pointer, so after the first frame
+// the only overhead left over a plain bvh is that load.
+class lazy_bvh : public hittable {
+  public:
+    lazy_bvh(const hittable_list& list, const lazy_bvh_options& options = lazy_bvh_options())
+      : objects(list.objects), options(options)
+    {
+        std::vector<bvh_reference> refs;
+        refs.reserve(objects.size());
+        for (int i = 0; i < int(objects.size()); i++)
+            refs.push_back({objects[i]->bounding_box(), i});
+
+        if (!refs.empty())
+            build_top(refs, 0, int(refs.size()));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+        const bool dir_negative[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+        int stack[64];
+        int stack_size = 0;
+        int current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = nodes[current];
+            if (bvh::slab_hit(node.bbox, r.origin(), inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    if (subtree_for(node.offset).hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_negative[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override {
+        return nodes.empty() ? aabb() : nodes[0].bbox;
+    }
+
+    int subtree_count() const { return int(subtrees.size()); }
+    int subtrees_built() const { return built.load(std::memory_order_relaxed); }
+
+    // Builds every subtree not built yet, for when the whole scene will be needed after all.
+    void build_all() const {
+        for (int k = 0; k < subtree_count(); k++)
+            subtree_for(k);
+    }
+
+    // Bytes of acceleration data so far: the top nodes, the primitive lists of subtrees still
+    // deferred, and the subtrees built.
+    size_t memory_bytes() const {
+        size_t bytes = nodes.size() * sizeof(bvh_node);
+        for (const auto& s : subtrees) {
+            auto tree = s->tree.load(std::memory_order_acquire);
+            bytes += tree ? tree->memory_bytes() : s->primitives.size() * sizeof(int);
+        }
+        return bytes;
+    }
+
+  private:
+    struct subtree {
+        std::vector<int>        primitives;   // Until built.
+        std::once_flag          once;
+        std::unique_ptr<bvh>    owner;
+        std::atomic<const bvh*> tree{nullptr};
+    };
+
+    std::vector<shared_ptr<hittable>>      objects;
+    lazy_bvh_options                       options;
+    std::vector<bvh_node>                  nodes;   // Leaves index subtrees, not primitives.
+    std::vector<std::unique_ptr<subtree>>  subtrees;
+    mutable std::atomic<int>               built{0};
+
+    int build_top(std::vector<bvh_reference>& refs, int begin, int end) {
+        aabb bounds, centroids;
+        for (int k = begin; k < end; k++) {
+            bounds = aabb(bounds, refs[k].bbox);
+            auto c = refs[k].bbox.centroid();
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        int index = int(nodes.size());
+        int axis = centroids.longest_axis();
+        if (end - begin <= options.subtree_size || centroids.axis_interval(axis).size() <= 0) {
+            auto s = std::make_unique<subtree>();
+            for (int k = begin; k < end; k++)
+                s->primitives.push_back(refs[k].primitive);
+            nodes.push_back({bounds, int(subtrees.size()), end - begin, 0});
+            subtrees.push_back(std::move(s));
+            return index;
+        }
+
+        int mid = begin + (end - begin) / 2;
+        std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                         [axis](const bvh_reference& a, const bvh_reference& b) {
+                             return a.bbox.centroid()[axis] < b.bbox.centroid()[axis];
+                         });
+
+        nodes.push_back({bounds, 0, 0, axis});
+        build_top(refs, begin, mid);
+        nodes[index].offset = build_top(refs, mid, end);
+        return index;
+    }
+
+    const bvh& subtree_for(int k) const {
+        auto& s = *subtrees[k];
+        if (auto tree = s.tree.load(std::memory_order_acquire))
+            return *tree;
+
+        std::call_once(s.once, [&] {
+            hittable_list list;
+            for (int i : s.primitives)
+                list.add(objects[i]);
+            s.owner = std::make_unique<bvh>(list, options.subtree);
+            s.tree.store(s.owner.get(), std::memory_order_release);
+            s.primitives.clear();
+            s.primitives.shrink_to_fit();
+            built.fetch_add(1, std::memory_order_relaxed);
+        });
+        return *s.tree.load(std::memory_order_acquire);
+    }
+};
+
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include "hittable_list.h"
+
+#include <vector>
+
+
+inline double luminance(const color& c) {
+    return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+}
+
+
+// Walker/Vose alias table: draws from a fixed discrete distribution in constant time with a
+// single uniform number.
+class alias_table {
+  public:
+    alias_table() {}
+
+    explicit alias_table(const std::vector<double>& weights) {
+        int n = int(weights.size());
+        prob.assign(n, 1.0);
+        alias.assign(n, 0);
+        pmfs.assign(n, 0.0);
+
+        double total = 0;
+        for (auto w : weights)
+            total += w;
+        if (n == 0 || total <= 0)
+            return;
+
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; i++) {
+            pmfs[i] = weights[i] / total;
+            scaled[i] = pmfs[i] * n;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(); small.pop_back();
+            int l = large.back(); large.pop_back();
+            prob[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1;
+            (scaled[l] < 1 ? small : large).push_back(l);
+        }
+        // Whatever is left is 1 up to rounding.
+        for (int i : large) prob[i] = 1;
+        for (int i : small) prob[i] = 1;
+    }
+
+    int sample(double u, double& pmf) const {
+        int n = int(prob.size());
+        auto scaled = u * n;
+        int i = int(scaled);
+        if (i >= n) i = n - 1;
+        int chosen = (scaled - i < prob[i]) ? i : alias[i];
+        pmf = pmfs[chosen];
+        return chosen;
+    }
+
+    double pmf(int i) const { return pmfs[i]; }
+
+    size_t size() const { return prob.size(); }
+
+  private:
+    std::vector<double> prob;
+    std::vector<int>    alias;
+    std::vector<double> pmfs;
+};
+
+
+// Picks emitters proportionally to their emitted power (area times luminance) and samples a
+// point uniformly on the chosen one.
+class light_sampler {
+  public:
+    light_sampler() {}
+
+    explicit light_sampler(const hittable_list& lights) {
+        std::vector<double> power;
+        for (const auto& object : lights.objects) {
+            hit_record rec;
+            double area;
+            if (!object->sample_surface(rec, area))
+                continue;
+            emitters.push_back({object.get(), rec.mat.get(), area});
+            power.push_back(area * luminance(rec.mat->emitted(rec)));
+        }
+        table = alias_table(power);
+    }
+
+    bool empty() const { return emitters.empty(); }
+
+    size_t size() const { return emitters.size(); }
+
+    // Samples a point on some emitter. pdf is with respect to surface area over all lights.
+    int sample(hit_record& rec, double& pdf) const {
+        double pmf;
+        int index = table.sample(random_double(), pmf);
+        double area;
+        emitters[index].object->sample_surface(rec, area);
+        pdf = pmf / area;
+        return index;
+    }
+
+    double pdf(int index) const {
+        return table.pmf(index) / emitters[index].area;
+    }
+
+    // Radiance leaving point p (outward normal n) of the given emitter towards x.
+    color emitted(int index, const point3& p, const vec3& n, const point3& x) const {
+        hit_record rec;
+        rec.p = p;
+        rec.normal = n;
+        rec.front_face = dot(x - p, n) > 0;
+        return emitters[index].mat->emitted(rec);
+    }
+
+  private:
+    struct emitter {
+        const hittable* object;
+        const material* mat;
+        double          area;
+    };
+
+    std::vector<emitter> emitters;
+    alias_table          table;
+};
+
+
+#endif
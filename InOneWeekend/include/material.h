@@ -14,6 +14,14 @@ class material {
     ) const {
         return false;
     }
+
+    // Diffuse surfaces end specular chains: photons are stored on them and camera paths
+    // gather there. Everything else is treated as part of a specular chain.
+    virtual bool is_diffuse() const { return false; }
+
+    virtual color diffuse_albedo() const { return color(0,0,0); }
+
+    virtual color emitted(const hit_record& /*rec*/) const { return color(0,0,0); }
 };
 
 
@@ -33,11 +41,32 @@ class lambertian : public material {
         return true;
     }
 
+    bool is_diffuse() const override { return true; }
+
+    color diffuse_albedo() const override { return albedo; }
+
+    // Materials may be edited between renders, never during one.
+    void set_albedo(const color& a) { albedo = a; }
+
   private:
     color albedo;
 };
 
 
+class diffuse_light : public material {
+  public:
+    diffuse_light(const color& emit) : emit(emit) {}
+
+    // Emits from the outside of the surface only.
+    color emitted(const hit_record& rec) const override {
+        return rec.front_face ? emit : color(0,0,0);
+    }
+
+  private:
+    color emit;
+};
+
+
 class metal : public material {
   public:
     metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
@@ -51,6 +80,10 @@ class metal : public material {
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    double fuzziness() const { return fuzz; }
+
+    void set_fuzz(double f) { fuzz = f < 1 ? f : 1; }
+
   private:
     color albedo;
     double fuzz;
@@ -0,0 +1,575 @@
+#ifndef PAGED_PARTICLES_H
+#define PAGED_PARTICLES_H
+
+#include "parallel.h"
+#include "particles.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+
+
+// Layout of a paged particle file: this header, the resident top of the BVH, a directory
+// of blocks, then the blocks themselves, each starting on a 4 KB boundary. A block is a
+// complete particle BVH of its own (nodes, then positions, radii and materials), indexed
+// from zero, so it can be read into any buffer and traced where it lands.
+struct paged_particle_header {
+    char     magic[4];   // "PTP1"
+    uint32_t block_count;
+    uint32_t top_count;
+    uint32_t reserved;
+    uint64_t particle_count;
+};
+
+// Where a block is in the file. In the top nodes, a leaf with count == top_leaf stands for
+// the block whose index is its offset.
+struct paged_particle_block {
+    static const uint16_t top_leaf = 0xffff;
+    static const size_t   particle_bytes = 4 * sizeof(float) + sizeof(uint16_t);
+
+    uint64_t offset;
+    uint32_t node_count;
+    uint32_t particle_count;
+
+    size_t size() const {
+        return node_count * sizeof(particle_node) + particle_count * particle_bytes;
+    }
+};
+
+
+// Cuts the BVH of an unquantized cloud into blocks of at most block_particles particles and
+// writes it in the paged layout. The cloud has to fit in memory once, when the file is made;
+// rendering from the file afterwards does not.
+inline void write_paged_particles(std::ostream& out, const particle_cloud& cloud,
+                                  int block_particles = 4096)
+{
+    if (cloud.is_quantized())
+        throw std::invalid_argument("paged particle files hold unquantized clouds");
+
+    const auto& nodes = cloud.node_array();
+    const auto view = cloud.arrays();
+
+    struct subtree { int node_end, first, last; };
+    std::vector<subtree> extent(nodes.size());
+    auto measure = [&](auto&& self, int index) -> subtree {
+        const auto& node = nodes[index];
+        if (node.count > 0)
+            return extent[index] = { index + 1, node.offset, node.offset + node.count };
+        auto left = self(self, index + 1);
+        auto right = self(self, node.offset);
+        return extent[index] = { right.node_end, left.first, right.last };
+    };
+
+    std::vector<particle_node> top;
+    std::vector<int> block_roots;
+    auto cut = [&](auto&& self, int index) -> int {
+        int at = int(top.size());
+        top.push_back(nodes[index]);
+        const auto& e = extent[index];
+        if (nodes[index].count > 0 || e.last - e.first <= block_particles) {
+            top[at].count = paged_particle_block::top_leaf;
+            top[at].offset = int(block_roots.size());
+            block_roots.push_back(index);
+            return at;
+        }
+        self(self, index + 1);
+        top[at].offset = self(self, nodes[index].offset);
+        return at;
+    };
+
+    if (!nodes.empty()) {
+        measure(measure, 0);
+        cut(cut, 0);
+    }
+
+    const uint64_t page = 4096;
+    auto round_up = [&](uint64_t x) { return (x + page - 1) / page * page; };
+
+    std::vector<paged_particle_block> directory;
+    uint64_t offset = round_up(sizeof(paged_particle_header) + top.size() * sizeof(particle_node)
+                               + block_roots.size() * sizeof(paged_particle_block));
+    for (int root : block_roots) {
+        const auto& e = extent[root];
+        directory.push_back({ offset, uint32_t(e.node_end - root), uint32_t(e.last - e.first) });
+        offset += round_up(directory.back().size());
+    }
+
+    paged_particle_header header = { {'P','T','P','1'}, uint32_t(directory.size()),
+                                      uint32_t(top.size()), 0, uint64_t(cloud.size()) };
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(top.data()), top.size() * sizeof(particle_node));
+    out.write(reinterpret_cast<const char*>(directory.data()),
+              directory.size() * sizeof(paged_particle_block));
+
+    uint64_t written = sizeof(header) + top.size() * sizeof(particle_node)
+                     + directory.size() * sizeof(paged_particle_block);
+    auto pad_to = [&](uint64_t target) {
+        static const char zeros[4096] = {};
+        while (written < target) {
+            auto n = std::min<uint64_t>(target - written, sizeof(zeros));
+            out.write(zeros, std::streamsize(n));
+            written += n;
+        }
+    };
+
+    for (size_t b = 0; b < block_roots.size(); b++) {
+        int root = block_roots[b];
+        const auto& e = extent[root];
+        pad_to(directory[b].offset);
+
+        // Rebase the subtree so its nodes and particles count from zero.
+        std::vector<particle_node> local(nodes.begin() + root, nodes.begin() + e.node_end);
+        for (auto& node : local)
+            node.offset -= node.count > 0 ? e.first : root;
+
+        auto n = size_t(e.last - e.first);
+        out.write(reinterpret_cast<const char*>(local.data()),
+                  local.size() * sizeof(particle_node));
+        out.write(reinterpret_cast<const char*>(view.positions + 3 * size_t(e.first)),
+                  3 * n * sizeof(float));
+        out.write(reinterpret_cast<const char*>(view.radii + e.first), n * sizeof(float));
+        out.write(reinterpret_cast<const char*>(view.materials + e.first), n * sizeof(uint16_t));
+        written += directory[b].size();
+    }
+    pad_to(round_up(written));
+}
+
+
+// A particle cloud traced out of core. Only the top of its BVH, down to the blocks, stays in
+// memory; blocks live in the mapped file and are copied into a cache of bounded size when a
+// ray reaches them, least recently used first out. Pages of the mapping are dropped again as
+// soon as a block has been copied, so memory use stays at the cache budget however large
+// the file.
+//
+// Render threads find cached blocks under a shared lock, so they only wait on each other
+// while a block is being inserted or evicted. A block is copied out of the file with no lock
+// held; threads that want it meanwhile wait for that one copy rather than making their own.
+// Recency is stamped per block with the count of loads so far, which only changes on a miss,
+// so a hit rarely writes anything shared.
+//
+// hit() traces one ray at a time, as the renderer does, and pages blocks in the order that
+// ray needs them. trace_batch() instead finds every block each ray of a batch could need,
+// then works through blocks rather than rays: every ray waits on the next block it needs, and
+// a block is traced for all the rays waiting on it at once, preferring blocks still in the
+// cache. Rays that arrive in scattered order then share page-ins instead of each causing its own.
+class paged_particle_cloud : public hittable {
+  public:
+    paged_particle_cloud(const std::string& path, std::vector<shared_ptr<material>> palette,
+                         size_t cache_bytes)
+      : file(path), path(path), palette(std::move(palette)), cache_budget(cache_bytes)
+    {
+        paged_particle_header header;
+        if (file.size() < sizeof(header))
+            throw std::runtime_error(path + " is not a paged particle file");
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, "PTP1", 4) != 0)
+            throw std::runtime_error(path + " is not a paged particle file");
+
+        // Every size and offset below comes from the file, so each is checked against the
+        // file's length before anything is copied, by division where a product could wrap.
+        auto bad = [&](const char* what) {
+            return std::runtime_error(path + " is corrupt: " + what);
+        };
+        size_t available = file.size() - sizeof(header);
+        if (header.top_count > available / sizeof(particle_node))
+            throw bad("top nodes run past the end");
+        available -= header.top_count * sizeof(particle_node);
+        if (header.block_count > available / sizeof(paged_particle_block))
+            throw bad("block directory runs past the end");
+
+        auto at = file.data() + sizeof(header);
+        top.resize(header.top_count);
+        std::memcpy(top.data(), at, top.size() * sizeof(particle_node));
+        at += top.size() * sizeof(particle_node);
+        directory.resize(header.block_count);
+        std::memcpy(directory.data(), at, directory.size() * sizeof(paged_particle_block));
+        at += directory.size() * sizeof(paged_particle_block);
+        file.release(0, size_t(at - file.data()));
+
+        for (const auto& entry : directory)
+            if (entry.offset > file.size() || entry.size() > file.size() - entry.offset)
+                throw bad("a block runs past the end");
+        bool blocks_ok = walkable(top.data(), top.size(), [&](const particle_node& leaf) {
+            return leaf.count == paged_particle_block::top_leaf && leaf.offset >= 0
+                && size_t(leaf.offset) < directory.size();
+        });
+        if (!blocks_ok)
+            throw bad("the top nodes are not a tree of blocks");
+
+        slots = std::vector<block_slot>(directory.size());
+        particle_count = size_t(header.particle_count);
+        if (this->palette.empty())
+            throw std::invalid_argument("paged_particle_cloud needs at least one material");
+        if (!top.empty()) {
+            bbox = aabb(point3(top[0].lo[0], top[0].lo[1], top[0].lo[2]),
+                        point3(top[0].hi[0], top[0].hi[1], top[0].hi[2]));
+        }
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (top.empty())
+            return false;
+
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+        const bool dir_negative[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+        int stack[128];
+        int stack_size = 0;
+        int current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = top[current];
+            if (particle_arrays::box_hit(node, r.origin(), inv_dir, ray_t)) {
+                if (node.count == paged_particle_block::top_leaf) {
+                    auto b = acquire(node.offset);
+                    int found = -1;
+                    point3 center;
+                    b->arrays.closest(r, ray_t, found, center);
+                    if (found >= 0) {
+                        fill(*b, found, center, r, ray_t.max, rec);
+                        hit_anything = true;
+                    }
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_negative[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_anything;
+    }
+
+    // Closest hits of a whole batch of rays over ray_t, deferring each ray until the block it
+    // needs next comes up. found[k] tells whether recs[k] holds a hit.
+    void trace_batch(const std::vector<ray>& rays, const interval& ray_t,
+                     std::vector<hit_record>& recs, std::vector<char>& found) const
+    {
+        size_t n = rays.size();
+        recs.resize(n);
+        found.assign(n, 0);
+
+        // Every block each ray passes through, nearest first.
+        std::vector<block_visit> visits;
+        std::vector<size_t> first(n + 1, 0);
+        for (size_t k = 0; k < n; k++) {
+            first[k] = visits.size();
+            collect_blocks(rays[k], ray_t, visits);
+            std::sort(visits.begin() + first[k], visits.end(),
+                      [](const block_visit& a, const block_visit& b) {
+                          return a.t_enter < b.t_enter;
+                      });
+        }
+        first[n] = visits.size();
+
+        // Where each ray is in its list of blocks, and its closest hit so far.
+        struct ray_state { size_t next; double t_max; };
+        std::vector<ray_state> state(n);
+        for (size_t k = 0; k < n; k++)
+            state[k] = { first[k], ray_t.max };
+
+        // Rays wait on the next block they need. Whenever a block is traced, the rays it
+        // held move on to their next block's queue; blocks beyond a ray's closest hit so far
+        // can no longer matter to it.
+        std::vector<std::vector<int>> waiting(directory.size());
+        std::vector<int> pending;
+        auto advance = [&](int k) {
+            auto& s = state[k];
+            if (s.next < first[k + 1] && visits[s.next].t_enter > s.t_max)
+                s.next = first[k + 1];
+            if (s.next == first[k + 1])
+                return;
+            auto& queue = waiting[visits[s.next].block];
+            if (queue.empty())
+                pending.push_back(visits[s.next].block);
+            queue.push_back(k);
+        };
+        for (size_t k = 0; k < n; k++)
+            advance(int(k));
+
+        std::vector<int> rays_here;
+        while (!pending.empty()) {
+            // A block already in the cache goes first; failing that, the one the most rays
+            // are waiting on.
+            size_t pick = 0;
+            bool pick_resident = false;
+            for (size_t q = 0; q < pending.size(); q++) {
+                bool resident = is_resident(pending[q]);
+                if (resident && !pick_resident) {
+                    pick = q;
+                    pick_resident = true;
+                    break;
+                }
+                if (waiting[pending[q]].size() > waiting[pending[pick]].size())
+                    pick = q;
+            }
+            int id = pending[pick];
+            pending[pick] = pending.back();
+            pending.pop_back();
+            rays_here.swap(waiting[id]);
+
+            auto b = acquire(id);
+            for (int k : rays_here) {
+                auto& s = state[k];
+                interval span(ray_t.min, s.t_max);
+                int hit_index = -1;
+                point3 center;
+                b->arrays.closest(rays[k], span, hit_index, center);
+                if (hit_index >= 0) {
+                    s.t_max = span.max;
+                    fill(*b, hit_index, center, rays[k], s.t_max, recs[k]);
+                    found[k] = 1;
+                }
+                s.next++;
+                advance(k);
+            }
+            rays_here.clear();
+        }
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t size() const { return particle_count; }
+    size_t block_count() const { return directory.size(); }
+    size_t resident_top_bytes() const { return top.size() * sizeof(particle_node); }
+
+    // Cache traffic since construction or the last reset_stats().
+    long block_loads() const { return loads.load(std::memory_order_relaxed); }
+    long block_reuses() const { return reuses.total(); }
+
+    void reset_stats() {
+        loads.store(0);
+        reuses.reset();
+    }
+
+    // Empties the cache, as if nothing had been traced yet. Not while tracing.
+    void clear_cache() {
+        std::unique_lock<std::shared_mutex> lock(cache_mutex);
+        for (int id : resident)
+            slots[id].data.reset();
+        resident.clear();
+        resident_bytes = 0;
+    }
+
+  private:
+    // Deeper than any tree particle_cloud builds, about 62 levels, and shallow enough for the
+    // 128-entry stacks of the traversals, which hold at most one more entry than the depth.
+    static const int max_depth = 120;
+
+    struct block {
+        std::vector<char> bytes;
+        particle_arrays   arrays;
+    };
+
+    struct block_visit {
+        int    block;
+        double t_enter;
+    };
+
+    struct block_slot {
+        shared_ptr<const block>         data;             // Under cache_mutex.
+        bool                            loading = false;  // Under cache_mutex.
+        std::atomic<unsigned long long> last_used{0};
+    };
+
+    mapped_file                       file;
+    std::string                       path;
+    std::vector<particle_node>        top;
+    std::vector<paged_particle_block> directory;
+    std::vector<shared_ptr<material>> palette;
+    size_t                            particle_count = 0;
+    aabb                              bbox;
+
+    size_t                                  cache_budget;
+    mutable std::shared_mutex               cache_mutex;
+    mutable std::condition_variable_any     block_loaded;
+    mutable std::vector<block_slot>         slots;            // One per block.
+    mutable std::vector<int>                resident;         // Blocks with data, any order.
+    mutable size_t                          resident_bytes = 0;
+    mutable std::atomic<unsigned long long> load_clock{0};    // Stamps recency.
+    mutable std::atomic<long>               loads{0};
+    mutable thread_counter                  reuses;
+
+    bool is_resident(int id) const {
+        std::shared_lock<std::shared_mutex> lock(cache_mutex);
+        return slots[id].data != nullptr;
+    }
+
+    void touch(int id) const {
+        auto now = load_clock.load(std::memory_order_relaxed);
+        auto& stamp = slots[id].last_used;
+        if (stamp.load(std::memory_order_relaxed) != now)
+            stamp.store(now, std::memory_order_relaxed);
+    }
+
+    // The block, paged in if it isn't cached. Evicted blocks stay valid for as long as a
+    // ray still holds them.
+    shared_ptr<const block> acquire(int id) const {
+        {
+            std::shared_lock<std::shared_mutex> lock(cache_mutex);
+            if (auto data = slots[id].data) {
+                touch(id);
+                reuses.add(1);
+                return data;
+            }
+        }
+
+        // A miss: claim the load unless another thread already has, and wait for that.
+        std::unique_lock<std::shared_mutex> lock(cache_mutex);
+        block_loaded.wait(lock, [&] { return !slots[id].loading; });
+        if (auto data = slots[id].data) {
+            touch(id);
+            reuses.add(1);
+            return data;
+        }
+        slots[id].loading = true;
+        lock.unlock();
+
+        shared_ptr<const block> b;
+        try {
+            b = load(id);
+        } catch (...) {
+            lock.lock();
+            slots[id].loading = false;
+            lock.unlock();
+            block_loaded.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        slots[id].loading = false;
+        slots[id].data = b;
+        slots[id].last_used.store(++load_clock, std::memory_order_relaxed);
+        resident.push_back(id);
+        resident_bytes += b->bytes.size();
+        while (resident_bytes > cache_budget && resident.size() > 1) {
+            // The least recently used block other than this one.
+            size_t victim = resident.front() == id ? 1 : 0;
+            for (size_t k = 0; k < resident.size(); k++) {
+                auto stamp = slots[resident[k]].last_used.load(std::memory_order_relaxed);
+                if (resident[k] != id
+                    && stamp < slots[resident[victim]].last_used.load(std::memory_order_relaxed))
+                    victim = k;
+            }
+            auto& evicted = slots[resident[victim]];
+            resident_bytes -= evicted.data->bytes.size();
+            evicted.data.reset();
+            resident[victim] = resident.back();
+            resident.pop_back();
+        }
+        lock.unlock();
+        block_loaded.notify_all();
+        return b;
+    }
+
+    // Copies block id out of the mapping and drops its pages again.
+    shared_ptr<const block> load(int id) const {
+        const auto& entry = directory[id];
+        size_t node_bytes = entry.node_count * sizeof(particle_node);
+        size_t n = entry.particle_count;
+        size_t size = entry.size();
+
+        auto b = make_shared<block>();
+        b->bytes.assign(file.data() + entry.offset, file.data() + entry.offset + size);
+        file.release(size_t(entry.offset), size);
+
+        // Checked on the copy, which is what gets traced.
+        const char* base = b->bytes.data();
+        bool particles_ok = entry.node_count > 0
+            && walkable(reinterpret_cast<const particle_node*>(base), entry.node_count,
+                        [&](const particle_node& leaf) {
+                            return leaf.offset >= 0 && size_t(leaf.offset) + leaf.count <= n;
+                        });
+        if (!particles_ok) {
+            throw std::runtime_error(path + " is corrupt: block " + std::to_string(id)
+                                     + " is not a tree of its particles");
+        }
+
+        b->arrays.nodes = reinterpret_cast<const particle_node*>(base);
+        b->arrays.positions = reinterpret_cast<const float*>(base + node_bytes);
+        b->arrays.radii = b->arrays.positions + 3 * n;
+        b->arrays.materials = reinterpret_cast<const uint16_t*>(b->arrays.radii + n);
+        loads.fetch_add(1, std::memory_order_relaxed);
+        return b;
+    }
+
+    // Whether nodes[0, count) is a tree the traversals can walk: interior nodes have their
+    // children after them and inside the array, split on one of three axes, with no path
+    // deeper than max_depth; every other node is a leaf that leaf_ok accepts.
+    template <typename LeafOk>
+    static bool walkable(const particle_node* nodes, size_t count, LeafOk&& leaf_ok) {
+        std::vector<int> depth(count, 0);
+        for (size_t k = 0; k < count; k++) {
+            const auto& node = nodes[k];
+            if (node.count != 0) {
+                if (!leaf_ok(node))
+                    return false;
+                continue;
+            }
+            // The left child is the node after this one, the right child after its subtree.
+            if (node.axis >= 3 || depth[k] >= max_depth || node.offset < 0
+                || size_t(node.offset) <= k + 1 || size_t(node.offset) >= count)
+                return false;
+            depth[k + 1] = std::max(depth[k + 1], depth[k] + 1);
+            depth[node.offset] = std::max(depth[node.offset], depth[k] + 1);
+        }
+        return true;
+    }
+
+    // Appends the blocks whose boxes r passes through within ray_t, with where it enters.
+    void collect_blocks(const ray& r, const interval& ray_t,
+                        std::vector<block_visit>& visits) const
+    {
+        if (top.empty())
+            return;
+
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+        int stack[128];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const auto& node = top[stack[--stack_size]];
+            interval span = ray_t;
+            bool crossed = true;
+            for (int axis = 0; axis < 3 && crossed; axis++) {
+                auto t0 = (node.lo[axis] - r.origin()[axis]) * inv_dir[axis];
+                auto t1 = (node.hi[axis] - r.origin()[axis]) * inv_dir[axis];
+                if (t0 > t1) std::swap(t0, t1);
+                span.min = std::fmax(span.min, t0);
+                span.max = std::fmin(span.max, t1);
+                crossed = span.min <= span.max;
+            }
+            if (!crossed)
+                continue;
+
+            if (node.count == paged_particle_block::top_leaf) {
+                visits.push_back({ node.offset, span.min });
+            } else {
+                stack[stack_size++] = node.offset;
+                stack[stack_size++] = int(&node - top.data()) + 1;
+            }
+        }
+    }
+
+    void fill(const block& b, int index, const point3& center, const ray& r, double t,
+              hit_record& rec) const
+    {
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, (rec.p - center) / b.arrays.radii[index]);
+        auto m = b.arrays.materials[index];
+        rec.mat = palette[m < palette.size() ? m : 0];
+    }
+};
+
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+
+inline int thread_count() {
+    int n = int(std::thread::hardware_concurrency());
+    return (n == 0) ? 4 : n;
+}
+
+
+// Splits [0, count) into one contiguous chunk per thread, the same way main() splits rows,
+// and calls body(thread_index, begin, end) on each chunk. Returns once every chunk is done.
+template <typename Body>
+void parallel_for(int count, Body&& body) {
+    int threads = thread_count();
+    if (threads > count) threads = (count > 0) ? count : 1;
+
+    int per_thread = count / threads;
+    int remaining  = count % threads;
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+
+    int begin = 0;
+    for (int t = 0; t < threads; t++) {
+        int end = begin + per_thread + (t < remaining ? 1 : 0);
+        workers.emplace_back([&body, t, begin, end] { body(t, begin, end); });
+        begin = end;
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+
+// A count that many threads add to on hot paths, such as statistics kept per ray. Each
+// thread takes one of slot_count slots as it first adds, on a cache line of its own, so
+// adding never contends; total() sums the slots. Only past slot_count threads do two share a
+// slot, which is why the slots stay atomic.
+class thread_counter {
+  public:
+    void add(long n) { slots[slot()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    long total() const {
+        long sum = 0;
+        for (const auto& s : slots)
+            sum += s.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    void reset() {
+        for (auto& s : slots)
+            s.value.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    static const int slot_count = 64;
+
+    struct alignas(64) padded_count {
+        std::atomic<long> value{0};
+    };
+
+    std::array<padded_count, slot_count> slots;
+
+    static int slot() {
+        static std::atomic<int> next_slot{0};
+        thread_local int mine = next_slot.fetch_add(1) % slot_count;
+        return mine;
+    }
+};
+
+
+#endif
@@ -0,0 +1,507 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include "hittable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// One particle as simulations dump them: a file is a 16-byte header ("PTC1", four reserved
+// bytes, a 64-bit count) followed by count of these, packed.
+struct particle_record {
+    float    position[3];
+    float    radius;
+    uint32_t material;   // Index into the palette the cloud is given.
+};
+
+static_assert(sizeof(particle_record) == 20, "particle_record must match the file layout");
+
+
+inline void write_particle_file(std::ostream& out, const std::vector<particle_record>& particles) {
+    uint32_t reserved = 0;
+    uint64_t count = particles.size();
+    out.write("PTC1", 4);
+    out.write(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(particles.data()),
+              particles.size() * sizeof(particle_record));
+}
+
+
+// A whole file mapped read-only into memory, so it can be read in place without first
+// copying it through a stream. Platforms without mmap read it into a buffer instead.
+class mapped_file {
+  public:
+    explicit mapped_file(const std::string& path) {
+#if defined(_WIN32)
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("cannot open " + path);
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        bytes = buffer.data();
+        length = buffer.size();
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + path);
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot stat " + path);
+        }
+        length = size_t(info.st_size);
+        if (length > 0) {
+            void* view = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("cannot map " + path);
+            }
+            // The file is read front to back once while building.
+            ::madvise(view, length, MADV_SEQUENTIAL);
+            bytes = static_cast<const char*>(view);
+        }
+        ::close(fd);
+#endif
+    }
+
+    ~mapped_file() {
+#if !defined(_WIN32)
+        if (bytes)
+            ::munmap(const_cast<char*>(bytes), length);
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+    // Lets the OS drop the pages of a range that won't be read again soon, so a large file
+    // that is read piece by piece doesn't stay mapped in memory as a whole.
+    void release(size_t offset, size_t count) const {
+#if !defined(_WIN32)
+        const size_t page = size_t(::sysconf(_SC_PAGESIZE));
+        auto begin = (offset + page - 1) / page * page;
+        auto end = (offset + count) / page * page;
+        if (bytes && end > begin)
+            ::madvise(const_cast<char*>(bytes) + begin, end - begin, MADV_DONTNEED);
+#endif
+    }
+
+  private:
+    const char*       bytes = nullptr;
+    size_t            length = 0;
+#if defined(_WIN32)
+    std::vector<char> buffer;
+#endif
+};
+
+
+// A node of a particle BVH: nodes are in depth-first order, so a left child directly follows
+// its parent, and leaves own contiguous runs of particles.
+struct particle_node {
+    float    lo[3], hi[3];
+    int32_t  offset;   // Leaf: first particle. Interior: index of the right child.
+    uint16_t count;    // Particles in a leaf, 0 for an interior node.
+    uint16_t axis;
+};
+
+static_assert(sizeof(particle_node) == 32, "particle_node should stay compact");
+
+
+// A particle BVH and the arrays it indexes, wherever they are kept. Centers are either three
+// floats per particle or, when quantized_positions is set, 16-bit fractions of their leaf's
+// box.
+struct particle_arrays {
+    const particle_node* nodes               = nullptr;
+    const float*         positions           = nullptr;
+    const uint16_t*      quantized_positions = nullptr;
+    const float*         radii               = nullptr;
+    const uint16_t*      materials           = nullptr;
+
+    // The closest particle along r within ray_t, narrowing ray_t.max to it. best is its
+    // index, or stays as it was when nothing is hit.
+    void closest(const ray& r, interval& ray_t, int& best, point3& best_center) const {
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+        const bool dir_negative[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+        int stack[128];
+        int stack_size = 0;
+        int current = 0;
+
+        while (true) {
+            const auto& node = nodes[current];
+            if (box_hit(node, r.origin(), inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    hit_leaf(node, r, ray_t, best, best_center);
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_negative[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+    }
+
+    static bool box_hit(const particle_node& n, const point3& origin, const vec3& inv_dir,
+                        interval ray_t)
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            auto t0 = (n.lo[axis] - origin[axis]) * inv_dir[axis];
+            auto t1 = (n.hi[axis] - origin[axis]) * inv_dir[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max < ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    point3 center(const particle_node& leaf, int k) const {
+        if (!quantized_positions)
+            return point3(positions[3*k], positions[3*k + 1], positions[3*k + 2]);
+        point3 c;
+        for (int a = 0; a < 3; a++)
+            c[a] = leaf.lo[a] + (leaf.hi[a] - leaf.lo[a]) * (quantized_positions[3*k+a] / 65535.0);
+        return c;
+    }
+
+    // Closest sphere of a leaf, same roots as sphere::hit; narrows ray_t to it.
+    void hit_leaf(const particle_node& leaf, const ray& r, interval& ray_t, int& best,
+                  point3& best_center) const
+    {
+        const auto& d = r.direction();
+        auto a = d.length_squared();
+        for (int k = leaf.offset; k < leaf.offset + leaf.count; k++) {
+            auto c = center(leaf, k);
+            vec3 oc = c - r.origin();
+            auto h = dot(d, oc);
+            auto cc = oc.length_squared() - double(radii[k]) * radii[k];
+            auto discriminant = h*h - a*cc;
+            if (discriminant < 0)
+                continue;
+            auto sqrtd = std::sqrt(discriminant);
+            auto t = (h - sqrtd) / a;
+            if (t <= ray_t.min)
+                t = (h + sqrtd) / a;
+            if (t <= ray_t.min || t >= ray_t.max)
+                continue;
+            ray_t.max = t;
+            best = k;
+            best_center = c;
+        }
+    }
+};
+
+
+// Millions of small spheres with no hittable per sphere: centers, radii and material indices
+// live in flat arrays, and the cloud carries its own BVH over them, so loading a dump is a
+// copy out of the mapped file and one build.
+//
+// The BVH is a linear one: particles are sorted along a Morton curve over their centers and
+// the tree follows the bits of their codes, which is fast enough to build over tens of
+// millions of particles in seconds. The particles themselves are sorted, rather than an index
+// array, so every leaf owns a contiguous run of the arrays. That is also what makes the
+// optional quantization cheap: each leaf's centers are stored as 16-bit fractions of the
+// leaf's own box, which is tiny, instead of three floats. Leaf boxes are widened by a step
+// of that grid first, so they still bound the dequantized spheres that are intersected.
+class particle_cloud : public hittable {
+  public:
+    static const int max_leaf_size = 8;
+
+    // Particles are indexed with int, and sorted by 64-bit keys holding a 32-bit Morton code
+    // above the index, so a cloud holds at most this many.
+    static const size_t max_particles = size_t(std::numeric_limits<int32_t>::max());
+
+    particle_cloud(const particle_record* records, size_t count,
+                   std::vector<shared_ptr<material>> palette, bool quantize)
+      : palette(std::move(palette)), quantized(quantize)
+    {
+        if (this->palette.empty())
+            throw std::invalid_argument("particle_cloud needs at least one material");
+        if (count > max_particles)
+            throw std::length_error("particle_cloud holds at most 2^31 - 1 particles, not "
+                                    + std::to_string(count));
+        if (count == 0)
+            return;
+        std::vector<uint32_t> codes;
+        auto work = morton_order(records, count, codes);
+        for (auto& p : work)
+            if (p.material >= this->palette.size())
+                p.material = 0;
+
+        nodes.reserve(4 * count / max_leaf_size + 1);
+        build_recursive(work.data(), codes.data(), 0, int(count));
+        store(work);
+    }
+
+    static shared_ptr<particle_cloud> load(const std::string& path,
+                                           std::vector<shared_ptr<material>> palette,
+                                           bool quantize)
+    {
+        mapped_file file(path);
+        const size_t header_size = 16;
+        uint64_t count = 0;
+        if (file.size() < header_size || std::memcmp(file.data(), "PTC1", 4) != 0)
+            throw std::runtime_error(path + " is not a particle file");
+        std::memcpy(&count, file.data() + 8, sizeof(count));
+        // Checked by division, so a corrupt count cannot wrap the size around.
+        if (count > (file.size() - header_size) / sizeof(particle_record))
+            throw std::runtime_error(path + " ends early");
+        if (count > max_particles)
+            throw std::runtime_error(path + " holds " + std::to_string(count)
+                                     + " particles, more than the 2^31 - 1 a cloud can");
+
+        auto records = reinterpret_cast<const particle_record*>(file.data() + header_size);
+        return make_shared<particle_cloud>(records, size_t(count), std::move(palette), quantize);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        int best = -1;
+        point3 best_center;
+        arrays().closest(r, ray_t, best, best_center);
+        if (best < 0)
+            return false;
+
+        rec.t = ray_t.max;
+        rec.p = r.at(rec.t);
+        rec.set_face_normal(r, (rec.p - best_center) / radii[best]);
+        rec.mat = palette[materials[best]];
+        return true;
+    }
+
+    aabb bounding_box() const override {
+        if (nodes.empty())
+            return aabb();
+        const auto& root = nodes[0];
+        return aabb(point3(root.lo[0], root.lo[1], root.lo[2]),
+                    point3(root.hi[0], root.hi[1], root.hi[2]));
+    }
+
+    size_t size() const { return radii.size(); }
+
+    bool is_quantized() const { return quantized; }
+
+    particle_arrays arrays() const {
+        return { nodes.data(), quantized ? nullptr : positions.data(),
+                 quantized ? quantized_positions.data() : nullptr, radii.data(),
+                 materials.data() };
+    }
+
+    const std::vector<particle_node>& node_array() const { return nodes; }
+
+    size_t memory_bytes() const {
+        return nodes.size() * sizeof(particle_node) + positions.size() * sizeof(float)
+             + quantized_positions.size() * sizeof(uint16_t) + radii.size() * sizeof(float)
+             + materials.size() * sizeof(uint16_t);
+    }
+
+  private:
+    std::vector<particle_node>        nodes;
+    std::vector<float>                positions;             // x, y, z per particle, or
+    std::vector<uint16_t>             quantized_positions;   // fractions of the leaf box.
+    std::vector<float>                radii;
+    std::vector<uint16_t>             materials;
+    std::vector<shared_ptr<material>> palette;
+    bool                              quantized;
+
+    // Spreads the low 10 bits of v out to every third bit.
+    static uint32_t spread_bits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // A copy of the particles sorted along a 30-bit Morton curve over their centers, with
+    // their codes. Sorts (code, index) pairs with an LSD radix sort, then gathers the
+    // records once, straight out of wherever they are, such as a mapped file.
+    static std::vector<particle_record> morton_order(const particle_record* records,
+                                                     size_t count, std::vector<uint32_t>& codes)
+    {
+        float lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::numeric_limits<float>::max();
+            hi[a] = std::numeric_limits<float>::lowest();
+        }
+        for (size_t k = 0; k < count; k++) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::min(lo[a], records[k].position[a]);
+                hi[a] = std::max(hi[a], records[k].position[a]);
+            }
+        }
+        // Cubic cells, so a flat or thin dataset is not split across its thin side first.
+        float extent = std::max({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] });
+        float scale = extent > 0 ? 1023.999f / extent : 0;
+
+        std::vector<uint64_t> keys(count), sorted(count);
+        for (size_t k = 0; k < count; k++) {
+            uint32_t cell[3];
+            for (int a = 0; a < 3; a++)
+                cell[a] = uint32_t((records[k].position[a] - lo[a]) * scale);
+            uint64_t code = spread_bits(cell[0]) << 2 | spread_bits(cell[1]) << 1
+                          | spread_bits(cell[2]);
+            keys[k] = code << 32 | k;
+        }
+
+        for (int shift = 32; shift < 62; shift += 8) {
+            size_t offsets[256] = {};
+            for (auto key : keys)
+                offsets[(key >> shift) & 0xff]++;
+            size_t total = 0;
+            for (auto& offset : offsets) {
+                auto n = offset;
+                offset = total;
+                total += n;
+            }
+            for (auto key : keys)
+                sorted[offsets[(key >> shift) & 0xff]++] = key;
+            keys.swap(sorted);
+        }
+
+        std::vector<particle_record> work(count);
+        codes.resize(count);
+        for (size_t k = 0; k < count; k++) {
+            work[k] = records[keys[k] & 0xffffffffu];
+            codes[k] = uint32_t(keys[k] >> 32);
+        }
+        return work;
+    }
+
+    // Splits [begin, end) where the highest bit that differs among its codes turns on, which
+    // since they are sorted is one binary search; runs of equal codes split in the middle.
+    // Boxes are filled in on the way back up.
+    int build_recursive(const particle_record* p, const uint32_t* codes, int begin, int end) {
+        int index = int(nodes.size());
+        nodes.push_back({ {}, {}, begin, 0, 0 });
+        int n = end - begin;
+
+        if (n <= max_leaf_size) {
+            nodes[index].count = uint16_t(n);
+            float lo[3], hi[3];
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::numeric_limits<float>::max();
+                hi[a] = std::numeric_limits<float>::lowest();
+            }
+            for (int k = begin; k < end; k++) {
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = std::min(lo[a], p[k].position[a] - p[k].radius);
+                    hi[a] = std::max(hi[a], p[k].position[a] + p[k].radius);
+                }
+            }
+            std::copy(lo, lo + 3, nodes[index].lo);
+            std::copy(hi, hi + 3, nodes[index].hi);
+            return index;
+        }
+
+        int middle = begin + n / 2;
+        int axis = 0;
+        auto differing = codes[begin] ^ codes[end - 1];
+        if (differing != 0) {
+            int bit = 31;
+            while (!(differing >> bit))
+                bit--;
+            middle = int(std::partition_point(codes + begin, codes + end, [bit](uint32_t c) {
+                return !((c >> bit) & 1);
+            }) - codes);
+            axis = 2 - bit % 3;
+        }
+
+        nodes[index].axis = uint16_t(axis);
+        int left = build_recursive(p, codes, begin, middle);
+        int right = build_recursive(p, codes, middle, end);
+        auto& node = nodes[index];
+        node.offset = right;
+        for (int a = 0; a < 3; a++) {
+            node.lo[a] = std::min(nodes[left].lo[a], nodes[right].lo[a]);
+            node.hi[a] = std::max(nodes[left].hi[a], nodes[right].hi[a]);
+        }
+        return index;
+    }
+
+    // Moves the sorted particles into the final arrays.
+    void store(const std::vector<particle_record>& work) {
+        size_t n = work.size();
+        radii.resize(n);
+        materials.resize(n);
+        for (size_t k = 0; k < n; k++) {
+            radii[k] = work[k].radius;
+            materials[k] = uint16_t(work[k].material);
+        }
+
+        if (!quantized) {
+            positions.resize(3 * n);
+            for (size_t k = 0; k < n; k++)
+                for (int a = 0; a < 3; a++)
+                    positions[3*k + a] = work[k].position[a];
+            return;
+        }
+
+        // Rounding moves a center by at most half a step of the widened box, which is less
+        // than the step the box was widened by.
+        quantized_positions.resize(3 * n);
+        for (auto& leaf : nodes) {
+            if (leaf.count == 0)
+                continue;
+            for (int a = 0; a < 3; a++) {
+                auto step = (leaf.hi[a] - leaf.lo[a]) / 32768.0f;
+                leaf.lo[a] -= step;
+                leaf.hi[a] += step;
+                auto extent = double(leaf.hi[a]) - leaf.lo[a];
+                for (int k = leaf.offset; k < leaf.offset + leaf.count; k++) {
+                    auto f = extent > 0 ? (work[k].position[a] - leaf.lo[a]) / extent : 0.0;
+                    auto q = std::lround(std::clamp(f, 0.0, 1.0) * 65535);
+                    quantized_positions[3*k + a] = uint16_t(q);
+                }
+            }
+        }
+        refit(0);
+    }
+
+    // Recomputes interior boxes bottom-up from their children.
+    void refit(int index) {
+        auto& n = nodes[index];
+        if (n.count > 0)
+            return;
+        refit(index + 1);
+        refit(n.offset);
+        const auto& left = nodes[index + 1];
+        const auto& right = nodes[n.offset];
+        for (int a = 0; a < 3; a++) {
+            n.lo[a] = std::min(left.lo[a], right.lo[a]);
+            n.hi[a] = std::max(left.hi[a], right.hi[a]);
+        }
+    }
+};
+
+
+#endif
@@ -0,0 +1,388 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "parallel.h"
+#include "sky.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+struct photon {
+    point3 p;
+    vec3   dir;    // unit direction of travel when the photon landed
+    color  power;
+};
+
+
+// Camera paths that reach the sky through their first diffuse vertex followed only by
+// specular bounces (L S+ D S* E) are exactly what the caustic photon map estimates, so the
+// path tracer drops them when both are combined and nothing is counted twice.
+enum class caustic_filter { off, before_diffuse, after_diffuse, caustic, unfiltered };
+
+inline caustic_filter next_caustic_filter(caustic_filter f, bool diffuse_vertex) {
+    switch (f) {
+        case caustic_filter::before_diffuse:
+            return diffuse_vertex ? caustic_filter::after_diffuse : caustic_filter::before_diffuse;
+        case caustic_filter::after_diffuse:
+        case caustic_filter::caustic:
+            return diffuse_vertex ? caustic_filter::unfiltered : caustic_filter::caustic;
+        default:
+            return f;
+    }
+}
+
+
+// Spatial hash grid over a photon set. Photons are bucketed by a hash of their integer cell
+// coordinates and stored contiguously per bucket, so a gather walks a few dense ranges
+// instead of chasing pointers. The grid is rebuilt every iteration with a parallel counting
+// sort: per-thread bucket histograms, a prefix sum, then a stable scatter where each thread
+// writes only into the slots it reserved.
+class photon_grid {
+  public:
+    void build(const std::vector<photon>& input, double cell) {
+        inv_cell_size = 1.0 / cell;
+
+        int n = int(input.size());
+        table_size = 1;
+        while (table_size < n/2 && table_size < max_buckets)
+            table_size <<= 1;
+
+        int threads = thread_count();
+        std::vector<uint32_t> bucket_of(n);
+        std::vector<std::vector<int>> offsets(threads, std::vector<int>(table_size, 0));
+
+        parallel_for(n, [&](int t, int begin, int end) {
+            auto& count = offsets[t];
+            for (int i = begin; i < end; i++) {
+                bucket_of[i] = bucket(input[i].p);
+                count[bucket_of[i]]++;
+            }
+        });
+
+        // Bucket totals and the per-thread write offsets are independent across buckets,
+        // so both passes split the table between threads; only the running sum is serial.
+        cell_start.assign(table_size + 1, 0);
+        parallel_for(table_size, [&](int, int begin, int end) {
+            for (int b = begin; b < end; b++)
+                for (int t = 0; t < threads; t++)
+                    cell_start[b+1] += offsets[t][b];
+        });
+
+        for (int b = 0; b < table_size; b++)
+            cell_start[b+1] += cell_start[b];
+
+        parallel_for(table_size, [&](int, int begin, int end) {
+            for (int b = begin; b < end; b++) {
+                int running = cell_start[b];
+                for (int t = 0; t < threads; t++) {
+                    int count = offsets[t][b];
+                    offsets[t][b] = running;
+                    running += count;
+                }
+            }
+        });
+
+        photons.resize(n);
+        parallel_for(n, [&](int t, int begin, int end) {
+            auto& offset = offsets[t];
+            for (int i = begin; i < end; i++)
+                photons[offset[bucket_of[i]]++] = input[i];
+        });
+    }
+
+    // Calls visit(photon) for every photon within radius of p. The cell size must be at
+    // least twice the largest query radius, so at most eight cells are touched.
+    template <typename Visit>
+    void for_each_near(const point3& p, double radius, Visit&& visit) const {
+        if (photons.empty())
+            return;
+
+        int lo[3], hi[3];
+        for (int axis = 0; axis < 3; axis++) {
+            lo[axis] = cell_coord(p[axis] - radius);
+            hi[axis] = cell_coord(p[axis] + radius);
+        }
+
+        // Distinct cells can hash to the same bucket; visit each bucket once.
+        uint32_t seen[8];
+        int seen_count = 0;
+        auto radius_squared = radius*radius;
+
+        for (int x = lo[0]; x <= hi[0]; x++)
+        for (int y = lo[1]; y <= hi[1]; y++)
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            auto b = hash(x, y, z);
+            if (std::find(seen, seen + seen_count, b) != seen + seen_count)
+                continue;
+            if (seen_count < 8)
+                seen[seen_count++] = b;
+
+            for (int i = cell_start[b]; i < cell_start[b+1]; i++) {
+                if ((photons[i].p - p).length_squared() <= radius_squared)
+                    visit(photons[i]);
+            }
+        }
+    }
+
+    size_t size() const { return photons.size(); }
+
+  private:
+    static const int max_buckets = 1 << 18;
+
+    std::vector<photon> photons;
+    std::vector<int>    cell_start;
+    int                 table_size = 1;
+    double              inv_cell_size = 1;
+
+    int cell_coord(double x) const {
+        return int(std::floor(x * inv_cell_size));
+    }
+
+    uint32_t hash(int x, int y, int z) const {
+        uint32_t h = (uint32_t(x) * 73856093u) ^ (uint32_t(y) * 19349663u) ^ (uint32_t(z) * 83492791u);
+        return h & uint32_t(table_size - 1);
+    }
+
+    uint32_t bucket(const point3& p) const {
+        return hash(cell_coord(p.x()), cell_coord(p.y()), cell_coord(p.z()));
+    }
+};
+
+
+// Stochastic progressive photon mapping for caustics. Each iteration traces one camera
+// sample per pixel through specular bounces to its first diffuse hit (the visible point),
+// shoots photons from the sky at the specular "caster" objects, keeps only those that land
+// on a diffuse surface after at least one specular bounce, and gathers them at the visible
+// points with a per-pixel radius that shrinks as photons accumulate.
+class photon_mapper {
+  public:
+    int    photons_per_iteration = 200000;
+    double initial_radius        = 0.05;
+    double alpha                 = 0.7;   // Fraction of newly gathered photons kept.
+    int    max_depth             = 10;
+
+    photon_mapper(const hittable& world, const hittable_list& casters, const camera& cam,
+                  int image_width, int image_height)
+      : world(world), cam(cam), width(image_width), height(image_height)
+    {
+        points.resize(width * height);
+        pixels.resize(width * height);
+
+        double total = 0;
+        for (const auto& object : casters.objects) {
+            auto box = object->bounding_box();
+            auto half_diagonal = vec3(box.x.size(), box.y.size(), box.z.size()) / 2;
+            targets.push_back({box.centroid(), half_diagonal.length()});
+            total += half_diagonal.length_squared();
+            target_cdf.push_back(total);
+        }
+        target_area = pi * total;
+
+        auto bounds = world.bounding_box();
+        launch_distance = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length();
+    }
+
+    void iterate() {
+        if (iteration_count == 0) {
+            for (auto& px : pixels)
+                px.radius = initial_radius;
+        }
+
+        trace_visible_points();
+        shoot_photons();
+
+        double max_radius = 0;
+        for (const auto& px : pixels)
+            max_radius = std::fmax(max_radius, px.radius);
+        grid.build(photons, 2 * max_radius);
+
+        gather();
+
+        photons_emitted += photons_per_iteration;
+        iteration_count++;
+    }
+
+    color radiance(int i, int j) const {
+        const auto& px = pixels[j * width + i];
+        if (photons_emitted == 0)
+            return color(0,0,0);
+        return px.tau / (photons_emitted * pi * px.radius * px.radius);
+    }
+
+    int iterations() const { return iteration_count; }
+
+    size_t photons_stored() const { return grid.size(); }
+
+  private:
+    struct visible_point {
+        point3 p;
+        vec3   normal;
+        color  weight;   // Path throughput times the diffuse BRDF.
+        bool   valid = false;
+    };
+
+    struct sppm_pixel {
+        double radius = 0;
+        double n = 0;
+        color  tau;
+    };
+
+    struct caster {
+        point3 center;
+        double radius;
+    };
+
+    const hittable& world;
+    const camera&   cam;
+    int width, height;
+
+    std::vector<visible_point> points;
+    std::vector<sppm_pixel>    pixels;
+    std::vector<photon>        photons;
+    photon_grid                grid;
+
+    std::vector<caster> targets;
+    std::vector<double> target_cdf;
+    double target_area = 0;
+    double launch_distance = 0;
+
+    double photons_emitted = 0;
+    int    iteration_count = 0;
+
+    void trace_visible_points() {
+        parallel_for(height, [&](int, int begin, int end) {
+            for (int j = begin; j < end; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto& vp = points[j * width + i];
+                    vp.valid = false;
+
+                    // The filter weight rides along in beta, so the caustics are filtered
+                    // like the path traced image they are composited over.
+                    double weight;
+                    ray r = cam.get_ray(i, j, weight);
+                    color beta(weight, weight, weight);
+
+                    for (int depth = 0; depth < max_depth; depth++) {
+                        hit_record rec;
+                        if (!world.hit(r, interval(0.001, infinity), rec))
+                            break;
+
+                        if (rec.mat->is_diffuse()) {
+                            vp.p = rec.p;
+                            vp.normal = rec.normal;
+                            vp.weight = beta * rec.mat->diffuse_albedo() / pi;
+                            vp.valid = true;
+                            break;
+                        }
+
+                        ray scattered;
+                        color attenuation;
+                        if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                            break;
+                        beta = beta * attenuation;
+                        r = scattered;
+                    }
+                }
+            }
+        });
+    }
+
+    void shoot_photons() {
+        std::vector<std::vector<photon>> stored(thread_count());
+
+        if (!targets.empty()) {
+            parallel_for(photons_per_iteration, [&](int t, int begin, int end) {
+                for (int k = begin; k < end; k++)
+                    trace_photon(stored[t]);
+            });
+        }
+
+        photons.clear();
+        for (const auto& part : stored)
+            photons.insert(photons.end(), part.begin(), part.end());
+    }
+
+    void trace_photon(std::vector<photon>& out) const {
+        // Pick a caster with probability proportional to its projected disk area, a sky
+        // direction uniformly over the sphere, and a point on the caster's disk facing it.
+        auto u = random_double() * target_cdf.back();
+        auto k = std::upper_bound(target_cdf.begin(), target_cdf.end(), u) - target_cdf.begin();
+        const auto& target = targets[std::min<size_t>(k, targets.size() - 1)];
+
+        auto from = random_unit_vector();
+        auto a = unit_vector(cross(std::fabs(from.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0), from));
+        auto b = cross(from, a);
+        auto d = random_in_unit_disk();
+        point3 on_disk = target.center + target.radius * (d.x()*a + d.y()*b);
+
+        // Disks of neighbouring casters overlap; the photon's density is the sum over every
+        // disk its line passes through.
+        int covering = 0;
+        for (const auto& other : targets) {
+            if (cross(other.center - on_disk, from).length_squared() <= other.radius*other.radius)
+                covering++;
+        }
+        if (covering == 0)
+            covering = 1;
+
+        color power = sky_radiance(from) * (4*pi * target_area / covering);
+        ray r(on_disk + launch_distance * from, -from);
+        bool specular = false;
+
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            if (!world.hit(r, interval(0.001, infinity), rec))
+                return;
+
+            if (rec.mat->is_diffuse()) {
+                if (specular)
+                    out.push_back({rec.p, unit_vector(r.direction()), power});
+                return;
+            }
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return;
+            power = power * attenuation;
+            specular = true;
+            r = scattered;
+        }
+    }
+
+    void gather() {
+        parallel_for(height, [&](int, int begin, int end) {
+            for (int idx = begin * width; idx < end * width; idx++) {
+                const auto& vp = points[idx];
+                auto& px = pixels[idx];
+                if (!vp.valid)
+                    continue;
+
+                color flux(0,0,0);
+                double m = 0;
+                grid.for_each_near(vp.p, px.radius, [&](const photon& ph) {
+                    if (dot(ph.dir, vp.normal) < 0) {
+                        flux += ph.power;
+                        m += 1;
+                    }
+                });
+
+                if (m == 0)
+                    continue;
+
+                auto n_new = px.n + alpha * m;
+                auto ratio = n_new / (px.n + m);
+                px.tau = (px.tau + vp.weight * flux) * ratio;
+                px.radius *= std::sqrt(ratio);
+                px.n = n_new;
+            }
+        });
+    }
+};
+
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef PIXEL_FILTER_H
+#define PIXEL_FILTER_H
+
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+enum class filter_type { box, gaussian, mitchell, blackman_harris };
+
+inline const char* filter_name(filter_type type) {
+    switch (type) {
+        case filter_type::gaussian:        return "Gaussian";
+        case filter_type::mitchell:        return "Mitchell";
+        case filter_type::blackman_harris: return "Blackman-Harris";
+        default:                           return "box";
+    }
+}
+
+
+// A separable pixel reconstruction filter, f(x, y) = f1(x) f1(y), applied by filter
+// importance sampling: instead of splatting every sample into all the pixels under the
+// filter, each pixel draws its own sample offsets with density proportional to |f|, and a
+// plain average of its samples is then the filtered value. Samples never leave the pixel
+// they were taken for, so nothing is shared between pixels or tiles.
+//
+// Where f goes negative, as Mitchell's lobes do, a sample carries weight -1 there, scaled by
+// the integral of |f| over that of f so the weights still average to one.
+//
+// Offsets are drawn per axis from a tabulated inverse CDF of |f1|, so a sample costs a table
+// lookup whatever the filter.
+class pixel_filter {
+  public:
+    // One shared, immutable filter of each type.
+    static const pixel_filter& get(filter_type type) {
+        static const pixel_filter filters[] = {
+            pixel_filter(filter_type::box), pixel_filter(filter_type::gaussian),
+            pixel_filter(filter_type::mitchell), pixel_filter(filter_type::blackman_harris),
+        };
+        return filters[int(type)];
+    }
+
+    filter_type type() const { return kind; }
+
+    // How far from the pixel center, in pixels, a sample can land.
+    double radius() const { return filter_radius; }
+
+    // Offset from the pixel center for the uniform numbers u1 and u2, and its weight.
+    vec3 sample(double u1, double u2, double& weight) const {
+        if (kind == filter_type::box) {
+            weight = 1;
+            return vec3(u1 - 0.5, u2 - 0.5, 0);
+        }
+        auto x = invert(u1), y = invert(u2);
+        weight = negative_lobes ? sign(x) * sign(y) * lobe_scale : 1;
+        return vec3(x, y, 0);
+    }
+
+    // The one-dimensional profile f1.
+    double evaluate(double x) const {
+        x = std::fabs(x);
+        if (x >= filter_radius)
+            return 0;
+        switch (kind) {
+            case filter_type::gaussian: {
+                const double sigma = 0.5;
+                auto g = [&](double d) { return std::exp(-d * d / (2 * sigma * sigma)); };
+                return g(x) - g(filter_radius);
+            }
+            case filter_type::mitchell: {
+                // B = C = 1/3, over [-2, 2].
+                const double b = 1.0 / 3, c = 1.0 / 3;
+                if (x < 1)
+                    return ((12 - 9*b - 6*c) * x*x*x + (-18 + 12*b + 6*c) * x*x + (6 - 2*b)) / 6;
+                return ((-b - 6*c) * x*x*x + (6*b + 30*c) * x*x + (-12*b - 48*c) * x
+                        + (8*b + 24*c)) / 6;
+            }
+            case filter_type::blackman_harris: {
+                auto t = (x + filter_radius) / (2 * filter_radius);
+                return 0.35875 - 0.48829 * std::cos(2 * pi * t) + 0.14128 * std::cos(4 * pi * t)
+                     - 0.01168 * std::cos(6 * pi * t);
+            }
+            default:
+                return 1;
+        }
+    }
+
+  private:
+    static const int table_size = 1024;
+
+    filter_type         kind;
+    double              filter_radius;
+    bool                negative_lobes = false;
+    double              lobe_scale = 1;   // (Integral of |f| / integral of f), squared.
+    std::vector<double> inverse_cdf;      // table_size + 1 offsets at evenly spaced u.
+
+    explicit pixel_filter(filter_type type) : kind(type) {
+        switch (type) {
+            case filter_type::box:             filter_radius = 0.5; return;
+            case filter_type::gaussian:        filter_radius = 1.5; break;
+            case filter_type::mitchell:        filter_radius = 2.0; break;
+            case filter_type::blackman_harris: filter_radius = 1.5; break;
+        }
+
+        // CDF of |f1| on a fine grid, then inverted at evenly spaced u.
+        const int steps = 16 * table_size;
+        auto dx = 2 * filter_radius / steps;
+        std::vector<double> cdf(steps + 1, 0.0);
+        double signed_total = 0;
+        for (int k = 0; k < steps; k++) {
+            auto a = evaluate(-filter_radius + k * dx), b = evaluate(-filter_radius + (k + 1) * dx);
+            cdf[k + 1] = cdf[k] + 0.5 * (std::fabs(a) + std::fabs(b)) * dx;
+            signed_total += 0.5 * (a + b) * dx;
+            negative_lobes = negative_lobes || a < 0;
+        }
+        auto total = cdf[steps];
+        lobe_scale = (total / signed_total) * (total / signed_total);
+
+        inverse_cdf.resize(table_size + 1);
+        int k = 0;
+        for (int m = 0; m <= table_size; m++) {
+            auto target = total * m / table_size;
+            while (k < steps - 1 && cdf[k + 1] < target)
+                k++;
+            auto span = cdf[k + 1] - cdf[k];
+            auto t = span > 0 ? (target - cdf[k]) / span : 0.0;
+            inverse_cdf[m] = -filter_radius + (k + std::fmin(t, 1.0)) * dx;
+        }
+    }
+
+    double invert(double u) const {
+        auto position = u * table_size;
+        int k = std::min(int(position), table_size - 1);
+        auto t = position - k;
+        return inverse_cdf[k] + t * (inverse_cdf[k + 1] - inverse_cdf[k]);
+    }
+
+    double sign(double x) const { return evaluate(x) < 0 ? -1 : 1; }
+};
+
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef PRIMARY_HIT_CACHE_H
+#define PRIMARY_HIT_CACHE_H
+
+#include "camera.h"
+#include "parallel.h"
+#include "tile_culling.h"
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+// One primary ray, its reconstruction filter weight and what it hit, in 28 bytes. The hit
+// point is not stored: it is the ray origin plus t times the direction.
+struct cached_hit {
+    static const uint16_t missed   = 0xffff;
+    static const uint16_t uncached = 0xfffe;   // Material table full: trace this one again.
+
+    float    direction[3];
+    float    t;
+    float    weight;      // From camera::get_ray(i, j, weight); scales the sample's radiance.
+    int16_t  normal[2];   // Octahedral, already facing the ray like hit_record::normal.
+    uint16_t material;    // Index into the cache's material table, or one of the above.
+    uint16_t front_face;
+};
+
+static_assert(sizeof(cached_hit) == 28, "cached_hit should stay compact");
+
+
+// Primary hits of the first few samples of every pixel. While only materials are being
+// edited, the camera and geometry stay put and every re-render would trace exactly the same
+// primary rays again; paths started from the cache go straight to shading instead. Materials
+// are kept by reference, so an edited albedo or fuzz shows up without rebuilding. Anything
+// that moves rays or surfaces makes the cache stale: check matches() before using it.
+class primary_hit_cache {
+  public:
+    enum result { hit, miss, not_cached };
+
+    explicit primary_hit_cache(int samples_per_pixel) : samples(samples_per_pixel) {}
+
+    int samples_per_pixel() const { return samples; }
+
+    // Whether the cache was built for this camera and this version of the geometry.
+    bool matches(const camera& cam, int geometry_version) const {
+        return built && version == geometry_version && view.same_view(cam);
+    }
+
+    void invalidate() {
+        built = false;
+        hits.clear();
+        hits.shrink_to_fit();
+        origins.clear();
+        origins.shrink_to_fit();
+        materials.clear();
+    }
+
+    // Traces the first samples_per_pixel() rays of every pixel, against each tile's primary
+    // candidates, and keeps what they hit.
+    void build(const tile_culling& tiles, const camera& cam, int image_width, int image_height,
+               int geometry_version)
+    {
+        invalidate();
+        width = image_width;
+        hits.resize(size_t(image_width) * image_height * samples);
+        if (!cam.is_pinhole())
+            origins.resize(hits.size());
+
+        std::unordered_map<const material*, uint16_t> shared_ids;
+        std::mutex table_mutex;
+
+        parallel_for(image_height, [&](int, int begin, int end) {
+            // Scenes have far fewer materials than pixels, so threads mostly find them here.
+            std::unordered_map<const material*, uint16_t> local_ids;
+
+            auto material_id = [&](const shared_ptr<material>& mat) {
+                auto found = local_ids.find(mat.get());
+                if (found != local_ids.end())
+                    return found->second;
+
+                std::lock_guard<std::mutex> lock(table_mutex);
+                auto shared = shared_ids.find(mat.get());
+                uint16_t id;
+                if (shared != shared_ids.end()) {
+                    id = shared->second;
+                } else if (materials.size() < cached_hit::uncached) {
+                    id = uint16_t(materials.size());
+                    materials.push_back(mat);
+                    shared_ids.emplace(mat.get(), id);
+                } else {
+                    return cached_hit::uncached;
+                }
+                local_ids.emplace(mat.get(), id);
+                return id;
+            };
+
+            for (int j = begin; j < end; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    const auto& primary = tiles.candidates(i, j);
+                    for (int s = 0; s < samples; s++) {
+                        auto index = slot(i, j, s);
+                        double weight;
+                        ray r = cam.get_ray(i, j, weight);
+                        auto& entry = hits[index];
+                        entry.weight = float(weight);
+                        for (int a = 0; a < 3; a++)
+                            entry.direction[a] = float(r.direction()[a]);
+                        if (!origins.empty())
+                            for (int a = 0; a < 3; a++)
+                                origins[index][a] = float(r.origin()[a]);
+
+                        hit_record rec;
+                        if (primary.hit(r, interval(0.001, infinity), rec)) {
+                            entry.t = float(rec.t);
+                            encode_normal(rec.normal, entry.normal);
+                            entry.material = material_id(rec.mat);
+                            entry.front_face = rec.front_face;
+                        } else {
+                            entry.t = float(infinity);
+                            entry.normal[0] = entry.normal[1] = 0;
+                            entry.material = cached_hit::missed;
+                            entry.front_face = 0;
+                        }
+                    }
+                }
+            }
+        });
+
+        view = cam;
+        version = geometry_version;
+        built = true;
+    }
+
+    // Sample s of pixel (i, j): always sets r to its primary ray and weight to its filter
+    // weight, and rec to its hit when the result is hit. A not_cached sample has to be
+    // traced again.
+    result lookup(int i, int j, int s, ray& r, double& weight, hit_record& rec) const {
+        auto index = slot(i, j, s);
+        const auto& entry = hits[index];
+        weight = entry.weight;
+        vec3 direction(entry.direction[0], entry.direction[1], entry.direction[2]);
+        point3 origin = origins.empty()
+                      ? view.position()
+                      : point3(origins[index][0], origins[index][1], origins[index][2]);
+        r = ray(origin, direction);
+
+        if (entry.material == cached_hit::missed)
+            return miss;
+        if (entry.material == cached_hit::uncached)
+            return not_cached;
+
+        rec.t = entry.t;
+        rec.p = r.at(rec.t);
+        rec.normal = decode_normal(entry.normal);
+        rec.front_face = entry.front_face != 0;
+        rec.mat = materials[entry.material];
+        return hit;
+    }
+
+    size_t memory_bytes() const {
+        return hits.size() * sizeof(cached_hit) + origins.size() * sizeof(origins[0])
+             + materials.size() * sizeof(materials[0]);
+    }
+
+  private:
+    int                                  samples;
+    int                                  width = 0;
+    bool                                 built = false;
+    int                                  version = 0;
+    camera                               view;
+    std::vector<cached_hit>              hits;
+    std::vector<std::array<float, 3>>    origins;   // Lens positions, for depth of field only.
+    std::vector<shared_ptr<material>>    materials;
+
+    size_t slot(int i, int j, int s) const {
+        return (size_t(j) * width + i) * samples + s;
+    }
+};
+
+
+#endif
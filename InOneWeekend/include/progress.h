@@ -0,0 +1,180 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "render_region.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+
+// One finished piece of a render: the pixels it covered, how many camera samples and rays
+// went into it, and how long the thread that rendered it took. A representative tile spread
+// its samples evenly over its thread's share of the render, as a coarse preview pass does,
+// so its cost per sample holds for the whole share rather than for one part of the image.
+struct tile_event {
+    int           thread = 0;
+    render_region area;
+    long long     samples = 0;
+    long long     rays = 0;
+    double        seconds = 0;
+    bool          representative = false;
+};
+
+// Where a render stands, as of the last render_progress::update().
+struct progress_snapshot {
+    int       tiles_done = 0;
+    int       threads = 0;
+    int       threads_active = 0;
+    long long samples_done = 0;
+    long long samples_total = 0;
+    long long rays_done = 0;
+    double    elapsed = 0;              // Seconds since start().
+    double    samples_per_second = 0;
+    double    rays_per_second = 0;
+    double    eta = -1;                 // Seconds left, or -1 until a tile has finished.
+
+    double fraction() const {
+        return samples_total > 0 ? double(samples_done) / samples_total : 0;
+    }
+    bool finished() const { return threads_active == 0; }
+};
+
+
+// Progress of a render, reported by the render threads and read by whoever shows it: the UI,
+// a log, or the headless runner. Render threads count in thread-local variables while they
+// trace and call tile_done() once per finished tile, which appends to a queue under a lock;
+// nothing shared is touched per sample or per ray. The consumer calls update() whenever it
+// wants to know, which hands it the tiles finished since its last call and sums them up.
+//
+// The ETA comes from measured cost rather than elapsed time. Rows of sky cost a fraction of
+// rows of geometry, so the cost per sample so far says little about what is left. Once
+// representative tiles have finished, their cost per sample prices the whole render, and
+// the ETA is that total less the thread-seconds spent, spread over the threads still
+// running. Before that, the cost per sample of the tiles so far prices the samples left.
+class render_progress {
+  public:
+    // Begins a render of samples_total camera samples on threads threads.
+    void start(long long samples_total, int threads) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.clear();
+        threads_finished = 0;
+        state = progress_snapshot();
+        state.samples_total = samples_total;
+        state.threads = threads;
+        state.threads_active = threads;
+        thread_seconds = 0;
+        sampled_seconds = 0;
+        sampled_samples = 0;
+        started = std::chrono::steady_clock::now();
+    }
+
+    // Called by a render thread for each tile it finishes.
+    void tile_done(const tile_event& event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(event);
+    }
+
+    // Called by a render thread once it has no tiles left.
+    void thread_done() {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads_finished++;
+    }
+
+    // Passes each tile finished since the last call to on_tile, in the order they finished,
+    // and returns the totals including them. For one consumer at a time.
+    template <typename OnTile>
+    progress_snapshot update(OnTile&& on_tile) {
+        std::vector<tile_event> events;
+        int finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            events.swap(pending);
+            finished = threads_finished;
+        }
+
+        for (const auto& event : events) {
+            state.tiles_done++;
+            state.samples_done += event.samples;
+            state.rays_done += event.rays;
+            thread_seconds += event.seconds;
+            if (event.representative) {
+                sampled_seconds += event.seconds;
+                sampled_samples += event.samples;
+            }
+            on_tile(event);
+        }
+
+        state.threads_active = std::max(0, state.threads - finished);
+        state.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                      - started).count();
+        if (state.elapsed > 0) {
+            state.samples_per_second = state.samples_done / state.elapsed;
+            state.rays_per_second = state.rays_done / state.elapsed;
+        }
+        auto threads_left = std::max(1, state.threads_active);
+        if (sampled_samples > 0) {
+            auto total = sampled_seconds / sampled_samples * state.samples_total;
+            state.eta = std::max(0.0, total - thread_seconds) / threads_left;
+        } else if (state.samples_done > 0) {
+            auto cost = thread_seconds / state.samples_done;
+            auto left = std::max(0LL, state.samples_total - state.samples_done);
+            state.eta = cost * left / threads_left;
+        }
+        if (state.threads_active == 0)
+            state.eta = 0;
+        return state;
+    }
+
+    progress_snapshot update() {
+        return update([](const tile_event&) {});
+    }
+
+  private:
+    std::mutex              mutex;
+    std::vector<tile_event> pending;            // Finished, not yet passed to update().
+    int                     threads_finished = 0;
+
+    // Only touched by update() and start().
+    progress_snapshot                     state;
+    double                                thread_seconds = 0;
+    double                                sampled_seconds = 0;   // Representative tiles.
+    long long                             sampled_samples = 0;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+};
+
+
+// Times the tiles one render thread finishes one after another, and reports each.
+class tile_timer {
+  public:
+    tile_timer(render_progress& progress, int thread, long long rays_so_far)
+      : progress(progress), thread(thread), rays_before(rays_so_far),
+        started(std::chrono::steady_clock::now()) {}
+
+    // Reports area as finished with samples camera samples, given the rays this thread has
+    // traced in all by now; the tile's time runs from the previous report.
+    void finish(const render_region& area, long long samples, long long rays_so_far,
+                bool representative = false) {
+        auto now = std::chrono::steady_clock::now();
+        tile_event event;
+        event.thread = thread;
+        event.area = area;
+        event.samples = samples;
+        event.rays = rays_so_far - rays_before;
+        event.seconds = std::chrono::duration<double>(now - started).count();
+        event.representative = representative;
+        progress.tile_done(event);
+        rays_before = rays_so_far;
+        started = now;
+    }
+
+  private:
+    render_progress&                      progress;
+    int                                   thread;
+    long long                             rays_before;
+    std::chrono::steady_clock::time_point started;
+};
+
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef PSSMLT_H
+#define PSSMLT_H
+
+#include "light_sampler.h"
+#include "parallel.h"
+#include "splat_buffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+
+// The primary sample vector of one Markov chain. It is handed to random_double() through
+// active_sample_stream, so whatever integrator runs sees ordinary uniform numbers while the
+// chain decides whether they are fresh (large step) or small perturbations of the last
+// accepted ones. Entries are mutated lazily, the first time a path asks for them.
+class pssmlt_sampler : public sample_stream {
+  public:
+    pssmlt_sampler(uint64_t seed, double sigma, double large_step_probability)
+      : rng(seed), sigma(sigma), large_step_probability(large_step_probability) {}
+
+    void start_iteration() {
+        current_iteration++;
+        large_step = uniform() < large_step_probability;
+        index = 0;
+    }
+
+    double next() override {
+        ensure_ready(index);
+        return samples[index++].value;
+    }
+
+    void accept() {
+        if (large_step)
+            last_large_step_iteration = current_iteration;
+    }
+
+    void reject() {
+        for (auto& x : samples) {
+            if (x.last_modified == current_iteration)
+                x.restore();
+        }
+        current_iteration--;
+    }
+
+  private:
+    struct primary_sample {
+        double  value = 0, value_backup = 0;
+        int64_t last_modified = 0, modify_backup = 0;
+
+        void backup()  { value_backup = value; modify_backup = last_modified; }
+        void restore() { value = value_backup; last_modified = modify_backup; }
+    };
+
+    std::mt19937_64 rng;
+    std::vector<primary_sample> samples;
+    double  sigma, large_step_probability;
+    int64_t current_iteration = 0;
+    int64_t last_large_step_iteration = 0;
+    bool    large_step = true;
+    size_t  index = 0;
+
+    double uniform() {
+        return std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    }
+
+    void ensure_ready(size_t i) {
+        // Entries a path never asked for before start out uniform. Rejection loops such as
+        // random_unit_vector() keep asking for more, and a small step away from an unset
+        // entry would keep them rejecting forever.
+        while (i >= samples.size()) {
+            primary_sample fresh;
+            fresh.value = uniform();
+            fresh.last_modified = current_iteration;
+            samples.push_back(fresh);
+        }
+        auto& x = samples[i];
+
+        // Catch up on a large step this entry missed because the path did not use it.
+        if (x.last_modified < last_large_step_iteration) {
+            x.value = uniform();
+            x.last_modified = last_large_step_iteration;
+        }
+
+        x.backup();
+        if (large_step) {
+            x.value = uniform();
+        } else if (current_iteration > x.last_modified) {
+            // Apply all the small steps skipped since the entry was last used at once.
+            auto skipped = double(current_iteration - x.last_modified);
+            auto step = std::normal_distribution<double>(0.0, sigma * std::sqrt(skipped))(rng);
+            x.value += step;
+            x.value -= std::floor(x.value);
+        }
+        x.last_modified = current_iteration;
+    }
+};
+
+
+// Primary sample space Metropolis light transport over an existing path integrator. A
+// bootstrap pass of independent samples estimates the image brightness b and picks start
+// states; then many independent chains, divided between the threads, mutate their primary
+// sample vectors and splat both the proposal and the current state, weighted by the
+// acceptance probability, into per-thread splat buffers.
+//
+// The chains target the magnitude of the luminance, so an integrand that goes negative, as
+// one weighted by a filter with negative lobes does, still has a valid target; each splat
+// keeps the sign of its sample.
+class pssmlt_renderer {
+  public:
+    using integrand = std::function<color(int i, int j)>;
+
+    int    bootstrap_samples      = 100000;
+    int    chains                 = 1024;
+    double mutations_per_pixel    = 16;
+    double sigma                  = 0.01;
+    double large_step_probability = 0.3;
+
+    // For progress reports, any of which may be empty. chains_starting is called once the
+    // bootstrap is done and the chains are about to run; chain_done on the thread that ran it
+    // after each chain, with the mutations the chain made; and thread_done once for each of
+    // chain_threads() after its last chain, even if the image is black and no chain runs.
+    std::function<void()>                              chains_starting;
+    std::function<void(int thread, int64_t mutations)> chain_done;
+    std::function<void(int thread)>                    thread_done;
+
+    pssmlt_renderer(integrand radiance, int image_width, int image_height)
+      : radiance(radiance), width(image_width), height(image_height) {}
+
+    void render(std::vector<color>& out) {
+        chains_done.store(0);
+
+        // Bootstrap: the integrand's average luminance over primary sample space.
+        std::vector<double> weights(bootstrap_samples);
+        parallel_for(bootstrap_samples, [&](int, int begin, int end) {
+            for (int k = begin; k < end; k++) {
+                pssmlt_sampler sampler(uint64_t(k), sigma, large_step_probability);
+                int i, j;
+                weights[k] = std::fabs(luminance(evaluate(sampler, i, j)));
+            }
+        });
+
+        double total = 0;
+        for (auto w : weights)
+            total += w;
+        out.assign(width * height, color(0,0,0));
+        if (total <= 0) {
+            for (int t = 0; t < chain_threads() && thread_done; t++)
+                thread_done(t);
+            return;
+        }
+
+        double b = total / bootstrap_samples;
+        alias_table start_states(weights);
+
+        auto total_mutations = int64_t(mutations_per_pixel * width * height);
+        // Tiny images can ask for fewer mutations than there are chains: every chain still
+        // takes at least one, so the normalization below never divides by zero.
+        auto mutations_per_chain = std::max<int64_t>(1, total_mutations / chains);
+
+        splat_buffer splats(width, height, thread_count());
+        if (chains_starting)
+            chains_starting();
+        parallel_for(chains, [&](int thread, int begin, int end) {
+            for (int c = begin; c < end; c++) {
+                run_chain(c, start_states, mutations_per_chain, splats, thread);
+                chains_done.fetch_add(1);
+                if (chain_done)
+                    chain_done(thread, mutations_per_chain);
+            }
+            if (thread_done)
+                thread_done(thread);
+        });
+
+        splats.reduce(out, b * width * height / double(mutations_per_chain * chains));
+    }
+
+    double progress() const { return double(chains_done.load()) / chains; }
+
+    // How many threads the chains are divided between, as parallel_for divides them.
+    int chain_threads() const { return std::max(1, std::min(thread_count(), chains)); }
+
+  private:
+    integrand radiance;
+    int width, height;
+    std::atomic<int> chains_done{0};
+
+    // Evaluates the integrand with random_double() drawing from the chain's sample vector;
+    // the first two numbers choose the pixel.
+    color evaluate(pssmlt_sampler& sampler, int& i, int& j) const {
+        active_sample_stream = &sampler;
+        i = std::min(int(sampler.next() * width), width - 1);
+        j = std::min(int(sampler.next() * height), height - 1);
+        auto L = radiance(i, j);
+        active_sample_stream = nullptr;
+        return L;
+    }
+
+    void run_chain(int c, const alias_table& start_states, int64_t mutations,
+                   splat_buffer& splats, int thread) const
+    {
+        std::mt19937_64 rng(0x9e3779b97f4a7c15ull + uint64_t(c));
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        // Replaying the bootstrap seed reproduces the chosen start state exactly.
+        double pmf;
+        int start = start_states.sample(uniform(rng), pmf);
+        pssmlt_sampler sampler(uint64_t(start), sigma, large_step_probability);
+
+        int i, j;
+        auto current = evaluate(sampler, i, j);
+        auto current_i = i, current_j = j;
+
+        for (int64_t m = 0; m < mutations; m++) {
+            sampler.start_iteration();
+            auto proposed = evaluate(sampler, i, j);
+
+            auto current_y  = std::fabs(luminance(current));
+            auto proposed_y = std::fabs(luminance(proposed));
+            auto accept = current_y > 0 ? std::min(1.0, proposed_y / current_y) : 1.0;
+
+            if (accept > 0)
+                splats.add(thread, i + 0.5, j + 0.5, proposed * (accept / proposed_y));
+            if (accept < 1)
+                splats.add(thread, current_i + 0.5, current_j + 0.5,
+                           current * ((1 - accept) / current_y));
+
+            if (uniform(rng) < accept) {
+                current = proposed;
+                current_i = i;
+                current_j = j;
+                sampler.accept();
+            } else {
+                sampler.reject();
+            }
+        }
+    }
+};
+
+
+#endif
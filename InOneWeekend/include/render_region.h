@@ -0,0 +1,81 @@
+#ifndef RENDER_REGION_H
+#define RENDER_REGION_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+
+// The pixels [x0, x1) x [y0, y1) of a frame, for rendering only part of it. An empty region
+// stands for the whole frame.
+struct render_region {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    bool empty() const { return x1 <= x0 || y1 <= y0; }
+
+    bool contains(int i, int j) const { return x0 <= i && i < x1 && y0 <= j && j < y1; }
+
+    // The region with its corners in either order, kept within a width by height frame, or
+    // the whole frame if nothing of it is left.
+    render_region within(int width, int height) const {
+        render_region r;
+        r.x0 = std::clamp(std::min(x0, x1), 0, width);
+        r.x1 = std::clamp(std::max(x0, x1), 0, width);
+        r.y0 = std::clamp(std::min(y0, y1), 0, height);
+        r.y1 = std::clamp(std::max(y0, y1), 0, height);
+        return r.empty() ? full_frame(width, height) : r;
+    }
+
+    static render_region full_frame(int width, int height) {
+        render_region r;
+        r.x1 = width;
+        r.y1 = height;
+        return r;
+    }
+
+    // Reads "x0,y0,x1,y1". Returns false, leaving region alone, if text is not four numbers.
+    static bool parse(const char* text, render_region& region) {
+        render_region r;
+        if (std::sscanf(text, "%d,%d,%d,%d", &r.x0, &r.y0, &r.x1, &r.y1) != 4)
+            return false;
+        region = r;
+        return true;
+    }
+};
+
+
+// Writes region of a width by height RGBA image as a binary PPM of just the region. Where it
+// sits in the frame goes in header comments, named after OpenEXR's windows: the data window
+// is the region, the display window the whole frame, so the crop can be placed back.
+inline bool write_region_ppm(const std::string& path, const uint8_t* rgba, int width, int height,
+                             const render_region& region)
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+        return false;
+
+    out << "P6\n"
+        << "# data window " << region.x0 << ' ' << region.y0 << ' '
+        << region.x1 << ' ' << region.y1 << '\n'
+        << "# display window 0 0 " << width << ' ' << height << '\n'
+        << region.width() << ' ' << region.height() << "\n255\n";
+
+    std::string row(3 * size_t(region.width()), '\0');
+    for (int j = region.y0; j < region.y1; j++) {
+        const uint8_t* p = rgba + 4 * (size_t(j) * width + region.x0);
+        for (int i = 0; i < region.width(); i++) {
+            row[3 * i]     = char(p[4 * i]);
+            row[3 * i + 1] = char(p[4 * i + 1]);
+            row[3 * i + 2] = char(p[4 * i + 2]);
+        }
+        out.write(row.data(), std::streamsize(row.size()));
+    }
+    return bool(out);
+}
+
+
+#endif
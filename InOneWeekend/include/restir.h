@@ -0,0 +1,312 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+
+#include "camera.h"
+#include "light_sampler.h"
+#include "parallel.h"
+#include "sky.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// One light sample and its resampling state, packed into 32 bytes per pixel. The sample is
+// either a point on an emitter (emitter index, position and octahedral-encoded normal) or,
+// when light == sky_light, a sky direction stored in y.
+struct reservoir {
+    static const uint32_t no_light  = 0xffffffffu;
+    static const uint32_t sky_light = 0xfffffffeu;
+
+    float    y[3] = {0, 0, 0};
+    int16_t  normal[2] = {0, 0};
+    uint32_t light = no_light;
+    float    w_sum = 0;
+    float    W = 0;
+    uint16_t M = 0;
+
+    point3 position() const { return point3(y[0], y[1], y[2]); }
+
+    // Weighted reservoir sampling: keeps the new candidate with probability w / w_sum.
+    bool update(const reservoir& candidate, double w, int count) {
+        w_sum += float(w);
+        M = uint16_t(std::min(65535, M + count));
+        if (w <= 0 || random_double() * w_sum >= w)
+            return false;
+        std::copy(candidate.y, candidate.y + 3, y);
+        normal[0] = candidate.normal[0];
+        normal[1] = candidate.normal[1];
+        light = candidate.light;
+        return true;
+    }
+};
+
+static_assert(sizeof(reservoir) == 32, "reservoir should stay compact");
+
+
+// Resampled importance sampling for direct lighting (ReSTIR DI). Each frame finds the first
+// diffuse surface behind every pixel, streams a handful of cheap light candidates through a
+// per-pixel reservoir, then reuses the reservoirs of the same pixel in the previous frame
+// (temporal) and of nearby pixels with similar geometry (spatial). That costs two shadow rays
+// per pixel: one for the initial sample, so occluded picks are dropped before they spread,
+// and one for the final sample. The reuse is the biased variant: neighbours are merged
+// without re-checking their visibility at this pixel, trading a little darkening at shadow
+// edges for noise.
+class restir_direct {
+  public:
+    int    initial_candidates = 16;
+    int    spatial_neighbors  = 4;
+    double spatial_radius     = 16;    // In pixels.
+    int    history_limit      = 20;    // Temporal M cap, in multiples of initial_candidates.
+    double sky_fraction       = 0.5;   // Share of candidates drawn from the sky.
+    int    max_depth          = 10;
+
+    restir_direct(const hittable& world, const hittable_list& lights, const camera& cam,
+                  int image_width, int image_height)
+      : world(world), cam(cam), lights(lights), width(image_width), height(image_height)
+    {
+        surfaces.resize(width * height);
+        current.resize(width * height);
+        previous.resize(width * height);
+    }
+
+    void reset() {
+        std::fill(previous.begin(), previous.end(), reservoir());
+        frame_count = 0;
+    }
+
+    // Renders one sample per pixel of emission plus resampled direct lighting.
+    void render_frame(std::vector<color>& out) {
+        out.resize(width * height);
+
+        parallel_for(height, [&](int, int begin, int end) {
+            for (int idx = begin * width; idx < end * width; idx++) {
+                trace_surface(idx % width, idx / width, surfaces[idx]);
+                current[idx] = initial_reservoir(surfaces[idx]);
+                if (frame_count > 0)
+                    merge(current[idx], previous[idx], surfaces[idx],
+                          history_limit * initial_candidates);
+            }
+        });
+
+        parallel_for(height, [&](int, int begin, int end) {
+            for (int idx = begin * width; idx < end * width; idx++) {
+                previous[idx] = spatial_reuse(idx % width, idx / width);
+                out[idx] = shade(surfaces[idx], previous[idx]);
+            }
+        });
+
+        frame_count++;
+    }
+
+    int frames() const { return frame_count; }
+
+  private:
+    struct surface {
+        point3 p;
+        vec3   normal;
+        color  weight;    // Throughput to the surface times its diffuse BRDF.
+        color  emitted;   // Emission and sky seen along the way.
+        bool   valid = false;
+    };
+
+    const hittable&     world;
+    const camera&       cam;
+    light_sampler       lights;
+    int                 width, height;
+    int                 frame_count = 0;
+
+    std::vector<surface>   surfaces;
+    std::vector<reservoir> current;
+    std::vector<reservoir> previous;
+
+    void trace_surface(int i, int j, surface& s) const {
+        s.valid = false;
+        s.emitted = color(0,0,0);
+
+        // Box filtered only: reservoirs are reused between neighbouring pixels on the
+        // assumption that each one's surface lies inside its own pixel.
+        ray r = cam.get_ray(i, j);
+        color beta(1,1,1);
+
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            if (!world.hit(r, interval(0.001, infinity), rec)) {
+                s.emitted += beta * sky_radiance(r.direction());
+                return;
+            }
+
+            s.emitted += beta * rec.mat->emitted(rec);
+
+            if (rec.mat->is_diffuse()) {
+                s.p = rec.p;
+                s.normal = rec.normal;
+                s.weight = beta * rec.mat->diffuse_albedo() / pi;
+                s.valid = true;
+                return;
+            }
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return;
+            beta = beta * attenuation;
+            r = scattered;
+        }
+    }
+
+    // Unshadowed contribution of a sample at surface s, and its luminance as the target
+    // function. Emitter samples live in area measure, sky samples in solid angle.
+    color unshadowed(const surface& s, const reservoir& r) const {
+        if (!s.valid || r.light == reservoir::no_light)
+            return color(0,0,0);
+
+        if (r.light == reservoir::sky_light) {
+            auto d = r.position();
+            auto cos_theta = dot(d, s.normal);
+            return cos_theta > 0 ? s.weight * sky_radiance(d) * cos_theta : color(0,0,0);
+        }
+
+        auto y = r.position();
+        auto n = decode_normal(r.normal);
+        auto w = y - s.p;
+        auto distance_squared = w.length_squared();
+        auto d = w / std::sqrt(distance_squared);
+        auto cos_x = dot(d, s.normal);
+        auto cos_y = -dot(d, n);
+        if (cos_x <= 0 || cos_y <= 0)
+            return color(0,0,0);
+        return s.weight * lights.emitted(r.light, y, n, s.p) * (cos_x * cos_y / distance_squared);
+    }
+
+    double target(const surface& s, const reservoir& r) const {
+        return luminance(unshadowed(s, r));
+    }
+
+    reservoir initial_reservoir(const surface& s) const {
+        reservoir r;
+        if (!s.valid)
+            return r;
+
+        auto sky_share = lights.empty() ? 1.0 : sky_fraction;
+
+        for (int k = 0; k < initial_candidates; k++) {
+            reservoir candidate;
+            double pdf;
+
+            if (random_double() < sky_share) {
+                // Cosine-weighted direction about the surface normal.
+                auto d = s.normal + random_unit_vector();
+                if (d.near_zero())
+                    d = s.normal;
+                d = unit_vector(d);
+                candidate.y[0] = float(d.x());
+                candidate.y[1] = float(d.y());
+                candidate.y[2] = float(d.z());
+                candidate.light = reservoir::sky_light;
+                pdf = sky_share * dot(d, s.normal) / pi;
+            } else {
+                hit_record rec;
+                double area_pdf;
+                candidate.light = uint32_t(lights.sample(rec, area_pdf));
+                candidate.y[0] = float(rec.p.x());
+                candidate.y[1] = float(rec.p.y());
+                candidate.y[2] = float(rec.p.z());
+                encode_normal(rec.normal, candidate.normal);
+                pdf = (1 - sky_share) * area_pdf;
+            }
+
+            if (pdf > 0)
+                r.update(candidate, target(s, candidate) / pdf, 1);
+            else
+                r.M++;
+        }
+
+        finalize(r, s);
+
+        // Visibility reuse: a chosen sample that turns out to be occluded is dropped now so
+        // it does not spread to the neighbours.
+        if (r.W > 0 && !visible(s, r))
+            r.W = 0;
+
+        return r;
+    }
+
+    void finalize(reservoir& r, const surface& s) const {
+        auto p_hat = target(s, r);
+        r.W = (p_hat > 0 && r.M > 0) ? float(r.w_sum / (r.M * p_hat)) : 0.0f;
+    }
+
+    // Streams another pixel's reservoir into r as a single candidate that stands for all of
+    // its samples, with that history capped at max_m.
+    void merge(reservoir& r, const reservoir& other, const surface& s, int max_m) const {
+        if (other.M == 0)
+            return;
+        int m = std::min<int>(other.M, max_m);
+        r.update(other, target(s, other) * other.W * m, m);
+        finalize(r, s);
+    }
+
+    bool similar(const surface& a, const surface& b) const {
+        if (!a.valid || !b.valid)
+            return false;
+        if (dot(a.normal, b.normal) < 0.9)
+            return false;
+        auto depth_a = (a.p - cam.position()).length();
+        auto depth_b = (b.p - cam.position()).length();
+        return std::fabs(depth_a - depth_b) < 0.1 * depth_a;
+    }
+
+    reservoir spatial_reuse(int i, int j) const {
+        int self = j * width + i;
+        const auto& s = surfaces[self];
+        reservoir r = current[self];
+        if (!s.valid)
+            return r;
+
+        int used[16] = { self };
+        int used_count = 1;
+        int max_m = history_limit * initial_candidates;
+
+        for (int k = 0; k < spatial_neighbors && used_count < 16; k++) {
+            auto offset = spatial_radius * random_in_unit_disk();
+            int ni = i + int(offset.x());
+            int nj = j + int(offset.y());
+            if (ni < 0 || ni >= width || nj < 0 || nj >= height || (ni == i && nj == j))
+                continue;
+
+            int n = nj * width + ni;
+            if (similar(s, surfaces[n])) {
+                merge(r, current[n], s, max_m);
+                used[used_count++] = n;
+            }
+        }
+
+        // Normalize by the samples of only those pixels that could have produced the chosen
+        // light sample at all; counting the rest would darken edges between surfaces.
+        double z = 0;
+        for (int k = 0; k < used_count; k++) {
+            if (target(surfaces[used[k]], r) > 0)
+                z += std::min<int>(current[used[k]].M, max_m);
+        }
+        auto p_hat = target(s, r);
+        r.W = (p_hat > 0 && z > 0) ? float(r.w_sum / (z * p_hat)) : 0.0f;
+
+        return r;
+    }
+
+    bool visible(const surface& s, const reservoir& r) const {
+        hit_record rec;
+        if (r.light == reservoir::sky_light)
+            return !world.hit(ray(s.p, r.position()), interval(0.001, infinity), rec);
+        return !world.hit(ray(s.p, r.position() - s.p), interval(0.001, 0.999), rec);
+    }
+
+    color shade(const surface& s, const reservoir& r) const {
+        if (!s.valid || r.W <= 0 || !visible(s, r))
+            return s.emitted;
+        return s.emitted + unshadowed(s, r) * double(r.W);
+    }
+};
+
+
+#endif
@@ -19,7 +19,20 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// A replacement source for the numbers random_double() returns on the current thread.
+// Metropolis rendering installs one to replay and mutate the numbers a path consumes.
+class sample_stream {
+  public:
+    virtual ~sample_stream() = default;
+
+    virtual double next() = 0;
+};
+
+inline thread_local sample_stream* active_sample_stream = nullptr;
+
 inline double random_double() {
+    if (active_sample_stream)
+        return active_sample_stream->next();
     return std::rand() / (RAND_MAX + 1.0);
 }
 
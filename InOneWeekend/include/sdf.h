@@ -0,0 +1,232 @@
+#ifndef SDF_H
+#define SDF_H
+
+#include "hittable.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// A shape given by a signed distance bound: negative inside, positive outside, and never
+// changing faster than lipschitz() per unit of movement, so distance() / lipschitz() is
+// always a safe step toward the surface.
+class sdf_shape {
+  public:
+    virtual ~sdf_shape() = default;
+
+    virtual double distance(const point3& p) const = 0;
+
+    // A box the surface stays inside.
+    virtual aabb bounds() const = 0;
+
+    virtual double lipschitz() const { return 1; }
+};
+
+
+// Spheres melted together with a smooth minimum: any two closer than blend merge into one
+// blob instead of meeting at a crease.
+class sdf_blobs : public sdf_shape {
+  public:
+    sdf_blobs(const std::vector<point3>& centers, const std::vector<double>& radii, double blend)
+      : centers(centers), radii(radii), blend(blend)
+    {
+        // Each smooth minimum after the first can swell the shape by another blend / 4, so
+        // n spheres reach up to (n - 1) blend / 4 beyond themselves.
+        auto swell = 0.25 * blend * std::max(0.0, double(centers.size()) - 1);
+        for (size_t k = 0; k < centers.size(); k++) {
+            auto r = vec3(1, 1, 1) * (radii[k] + swell);
+            box = aabb(box, aabb(centers[k] - r, centers[k] + r));
+        }
+    }
+
+    double distance(const point3& p) const override {
+        double d = infinity;
+        for (size_t k = 0; k < centers.size(); k++) {
+            auto dk = (p - centers[k]).length() - radii[k];
+            // Quadratic smooth minimum; never above the plain minimum, so still a safe bound.
+            auto h = std::fmax(blend - std::fabs(d - dk), 0.0) / blend;
+            d = std::fmin(d, dk) - h * h * blend * 0.25;
+        }
+        return d;
+    }
+
+    aabb bounds() const override { return box; }
+
+  private:
+    std::vector<point3> centers;
+    std::vector<double> radii;
+    double              blend;
+    aabb                box;
+};
+
+
+// Menger sponge: a cube with crosses cut out of it, recursively, to the given depth.
+class sdf_menger : public sdf_shape {
+  public:
+    sdf_menger(const point3& center, double half_size, int iterations)
+      : center(center), half_size(half_size), iterations(iterations) {}
+
+    double distance(const point3& world) const override {
+        auto p = (world - center) / half_size;
+
+        vec3 q(std::fabs(p.x()) - 1, std::fabs(p.y()) - 1, std::fabs(p.z()) - 1);
+        vec3 outside(std::fmax(q.x(), 0.0), std::fmax(q.y(), 0.0), std::fmax(q.z(), 0.0));
+        double d = outside.length() + std::fmin(std::fmax(q.x(), std::fmax(q.y(), q.z())), 0.0);
+
+        double scale = 1;
+        for (int m = 0; m < iterations; m++) {
+            vec3 r;
+            for (int a = 0; a < 3; a++) {
+                auto x = p[a] * scale;
+                auto wrapped = x - 2 * std::floor(x / 2) - 1;
+                r[a] = std::fabs(1 - 3 * std::fabs(wrapped));
+            }
+            scale *= 3;
+            auto da = std::fmax(r.x(), r.y());
+            auto db = std::fmax(r.y(), r.z());
+            auto dc = std::fmax(r.z(), r.x());
+            d = std::fmax(d, (std::fmin(da, std::fmin(db, dc)) - 1) / scale);
+        }
+        return d * half_size;
+    }
+
+    aabb bounds() const override {
+        auto h = vec3(half_size, half_size, half_size);
+        return aabb(center - h, center + h);
+    }
+
+  private:
+    point3 center;
+    double half_size;
+    int    iterations;
+};
+
+
+// A hittable surface at the zero set of an sdf_shape, found by sphere tracing: march along
+// the ray by the distance bound, which can never step through the surface. The march is
+// over-relaxed (Keinert et al., Enhanced Sphere Tracing): steps are stretched by relaxation,
+// and whenever the unbounding spheres of two consecutive points stop overlapping, the step
+// was too long, so the march goes back to the last safe step and continues unrelaxed.
+//
+// Only the part of the ray inside the shape's bounding box is marched, and that box is also
+// what the BVH sees. Step counts are kept, per thread, so scenes can be tuned against them.
+class sdf : public hittable {
+  public:
+    int    max_steps  = 256;
+    double epsilon    = 1e-4;   // Distance to the surface that counts as a hit.
+    double relaxation = 1.2;
+
+    sdf(shared_ptr<sdf_shape> shape, shared_ptr<material> mat)
+      : shape(std::move(shape)), mat(std::move(mat))
+    {
+        auto box = this->shape->bounds();
+        auto margin = 8 * epsilon;
+        bbox = aabb(box.x.expand(margin), box.y.expand(margin), box.z.expand(margin));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!clip_to_box(r, ray_t))
+            return false;
+
+        auto length = r.direction().length();
+        auto direction = r.direction() / length;
+        auto inv_lipschitz = 1 / shape->lipschitz();
+
+        // Distances along the unit direction. Rays that start inside, such as refracted
+        // rays, march on the negated field toward the way out.
+        auto s = ray_t.min * length;
+        auto s_max = ray_t.max * length;
+        double sign = shape->distance(r.origin() + s * direction) < 0 ? -1 : 1;
+
+        double omega = relaxation;
+        double previous_radius = 0, step = 0;
+        int steps = 0;
+        bool found = false;
+
+        while (steps < max_steps && s <= s_max) {
+            steps++;
+            auto radius = sign * shape->distance(r.origin() + s * direction) * inv_lipschitz;
+
+            if (omega > 1 && std::fabs(radius) + previous_radius < step) {
+                // The last stretched step left the safe sphere: take the plain step instead.
+                s -= step;
+                step = previous_radius;
+                omega = 1;
+                relaxation_failures.add(1);
+            } else {
+                if (radius < epsilon) {
+                    found = true;
+                    break;
+                }
+                previous_radius = radius;
+                step = omega * radius;
+            }
+            s += step;
+        }
+
+        rays_traced.add(1);
+        steps_taken.add(steps);
+
+        auto t = s / length;
+        if (!found || !ray_t.surrounds(t))
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, gradient(rec.p));
+        rec.mat = mat;
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    long rays() const              { return rays_traced.total(); }
+    long steps() const             { return steps_taken.total(); }
+    long relaxation_misses() const { return relaxation_failures.total(); }
+
+    double steps_per_ray() const {
+        auto n = rays();
+        return n > 0 ? double(steps()) / n : 0;
+    }
+
+    void reset_stats() {
+        rays_traced.reset();
+        steps_taken.reset();
+        relaxation_failures.reset();
+    }
+
+  private:
+    shared_ptr<sdf_shape> shape;
+    shared_ptr<material>  mat;
+    aabb                  bbox;
+
+    mutable thread_counter rays_traced;
+    mutable thread_counter steps_taken;
+    mutable thread_counter relaxation_failures;
+
+    bool clip_to_box(const ray& r, interval& ray_t) const {
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = bbox.axis_interval(axis);
+            auto inv = 1 / r.direction()[axis];
+            auto t0 = (ax.min - r.origin()[axis]) * inv;
+            auto t1 = (ax.max - r.origin()[axis]) * inv;
+            if (t0 > t1) std::swap(t0, t1);
+            ray_t.min = std::fmax(ray_t.min, t0);
+            ray_t.max = std::fmin(ray_t.max, t1);
+        }
+        return ray_t.min <= ray_t.max;
+    }
+
+    // Outward normal from the field's gradient, with four samples on a tetrahedron.
+    vec3 gradient(const point3& p) const {
+        const double h = 10 * epsilon;
+        const vec3 k0(1, -1, -1), k1(-1, -1, 1), k2(-1, 1, -1), k3(1, 1, 1);
+        auto n = k0 * shape->distance(p + h * k0) + k1 * shape->distance(p + h * k1)
+               + k2 * shape->distance(p + h * k2) + k3 * shape->distance(p + h * k3);
+        return n.length_squared() > 0 ? unit_vector(n) : vec3(0, 1, 0);
+    }
+};
+
+
+#endif
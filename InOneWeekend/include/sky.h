@@ -0,0 +1,15 @@
+#ifndef SKY_H
+#define SKY_H
+
+
+// Radiance arriving along a ray that escapes the scene: a white-to-blue gradient over the
+// ray's vertical direction. The sky is the only light source in the default scene, so the
+// photon mapper emits from it with this same function.
+inline color sky_radiance(const vec3& direction) {
+    vec3 unit_direction = unit_vector(direction);
+    auto a = 0.5*(unit_direction.y() + 1.0);
+    return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
+}
+
+
+#endif
@@ -7,7 +7,11 @@
 class sphere : public hittable {
   public:
     sphere(const point3& center, double radius, shared_ptr<material> mat)
-      : center(center), radius(std::fmax(0,radius)), mat(mat) {}
+      : center(center), radius(std::fmax(0,radius)), mat(mat)
+    {
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center - rvec, center + rvec);
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         vec3 oc = center - r.origin();
@@ -37,10 +41,44 @@ class sphere : public hittable {
         return true;
     }
 
+    aabb bounding_box() const override { return bbox; }
+
+    aabb clipped_bounding_box(int axis, const interval& slab) const override {
+        auto c = center[axis];
+        interval inside = interval(c - radius, c + radius).intersect(slab);
+        if (inside.size() < 0)
+            return aabb::empty;
+
+        // The widest cross-section within the slab is the one closest to the center.
+        auto d = (c < inside.min) ? inside.min - c : (c > inside.max) ? c - inside.max : 0;
+        auto rho = std::sqrt(std::fmax(0, radius*radius - d*d));
+        auto section = aabb(center - vec3(rho, rho, rho), center + vec3(rho, rho, rho));
+        return aabb(axis == 0 ? inside : section.x,
+                    axis == 1 ? inside : section.y,
+                    axis == 2 ? inside : section.z);
+    }
+
+    bool sample_surface(hit_record& rec, double& area) const override {
+        auto n = random_unit_vector();
+        rec.p = center + radius * n;
+        rec.normal = n;
+        rec.front_face = true;
+        rec.mat = mat;
+        rec.t = 0;
+        area = 4 * pi * radius * radius;
+        return true;
+    }
+
+    // For accelerators that copy spheres out and intersect them in bulk.
+    const point3&               sphere_center() const { return center; }
+    double                      sphere_radius() const { return radius; }
+    const shared_ptr<material>& sphere_material() const { return mat; }
+
   private:
     point3 center;
     double radius;
     shared_ptr<material> mat;
+    aabb bbox;
 };
 
 
@@ -0,0 +1,142 @@
+#ifndef SPLAT_BUFFER_H
+#define SPLAT_BUFFER_H
+
+#include "hdr_buffer.h"
+#include "parallel.h"
+#include "render_region.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+
+
+// Accumulates contributions that land on arbitrary pixels, such as light subpaths connected
+// to the camera. Every render thread owns its own buffer and writes only to it, so the
+// shared framebuffer needs no atomics or locks; the buffers are summed in parallel once the
+// pass is over.
+//
+// A thread's buffer is sparse: the image is cut into 32x32 pixel tiles, and a thread only
+// allocates the tiles its splats have landed in. Light paths that stay in one part of the
+// image cost that part, not a full frame per thread, and the reduction only visits tiles
+// some thread wrote. Each thread's tiles and bookkeeping sit on cache lines of their own, so
+// threads splatting at the same time never share one.
+class splat_buffer {
+  public:
+    static const int tile_size = 32;
+
+    splat_buffer(int width, int height, int threads)
+      : width(width), height(height),
+        tiles_x((width + tile_size - 1) / tile_size),
+        tiles_y((height + tile_size - 1) / tile_size),
+        buffers(threads)
+    {
+        for (auto& buffer : buffers) {
+            buffer.tiles.resize(size_t(tiles_x) * tiles_y);
+            buffer.written.assign(buffer.tiles.size(), 0);
+        }
+    }
+
+    // Zeroes the tiles written since the last clear. They stay allocated for the next pass.
+    void clear() {
+        for (auto& buffer : buffers) {
+            for (int t : buffer.touched) {
+                std::fill(buffer.tiles[t]->begin(), buffer.tiles[t]->end(), color(0,0,0));
+                buffer.written[t] = 0;
+            }
+            buffer.touched.clear();
+        }
+    }
+
+    void add(int thread, double x, double y, const color& c) {
+        int i = int(x), j = int(y);
+        if (x < 0 || i >= width || y < 0 || j >= height)
+            return;
+
+        auto& buffer = buffers[thread];
+        int t = (j / tile_size) * tiles_x + i / tile_size;
+        auto& tile = buffer.tiles[t];
+        if (!buffer.written[t]) {
+            if (!tile)
+                tile = std::make_unique<tile_pixels>();
+            buffer.written[t] = 1;
+            buffer.touched.push_back(t);
+        }
+        (*tile)[(j % tile_size) * tile_size + i % tile_size] += c;
+    }
+
+    // Writes the sum of every thread's splats, scaled by scale, into out.
+    void reduce(std::vector<color>& out, double scale = 1.0) const {
+        out.assign(size_t(width) * height, color(0,0,0));
+        reduce_tiles(scale, [&](int i, int j, const color& sum) { out[j * width + i] = sum; });
+    }
+
+    // Adds the sum of every thread's splats, scaled by scale, to image, touching only the
+    // tiles some thread splatted into. With a region, splats outside it are dropped, for
+    // when only the region was rendered and the rest of image holds an earlier frame.
+    void add_to(hdr_buffer& image, double scale = 1.0,
+                const render_region& region = render_region()) const {
+        reduce_tiles(scale, [&](int i, int j, const color& sum) {
+            if (region.empty() || region.contains(i, j))
+                image.set(i, j, image.get(i, j) + sum);
+        });
+    }
+
+    int threads() const { return int(buffers.size()); }
+
+    // Bytes of tiles allocated across all threads.
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        for (const auto& buffer : buffers)
+            for (const auto& tile : buffer.tiles)
+                if (tile)
+                    bytes += sizeof(tile_pixels);
+        return bytes;
+    }
+
+  private:
+    using tile_pixels = std::array<color, tile_size * tile_size>;
+
+    struct alignas(64) thread_buffer {
+        std::vector<std::unique_ptr<tile_pixels>> tiles;
+        std::vector<char>                         written;   // Per tile, since clear().
+        std::vector<int>                          touched;   // The tiles written, in order.
+    };
+
+    int width, height;
+    int tiles_x, tiles_y;
+    std::vector<thread_buffer> buffers;
+
+    // Calls write(i, j, sum) for every pixel of every tile any thread wrote, one tile per
+    // task, with sum the scaled total over threads.
+    template <typename Write>
+    void reduce_tiles(double scale, Write&& write) const {
+        std::vector<char> used(size_t(tiles_x) * tiles_y, 0);
+        for (const auto& buffer : buffers)
+            for (int t : buffer.touched)
+                used[t] = 1;
+        std::vector<int> tiles;
+        for (int t = 0; t < int(used.size()); t++)
+            if (used[t])
+                tiles.push_back(t);
+
+        parallel_for(int(tiles.size()), [&](int, int begin, int end) {
+            for (int k = begin; k < end; k++) {
+                int t = tiles[k];
+                int i0 = (t % tiles_x) * tile_size, j0 = (t / tiles_x) * tile_size;
+                for (int j = j0; j < std::min(j0 + tile_size, height); j++) {
+                    for (int i = i0; i < std::min(i0 + tile_size, width); i++) {
+                        color sum(0,0,0);
+                        for (const auto& buffer : buffers)
+                            if (const auto* tile = buffer.tiles[t].get())
+                                sum += (*tile)[(j - j0) * tile_size + (i - i0)];
+                        write(i, j, scale * sum);
+                    }
+                }
+            }
+        });
+    }
+};
+
+
+#endif
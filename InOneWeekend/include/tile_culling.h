@@ -0,0 +1,101 @@
+#ifndef TILE_CULLING_H
+#define TILE_CULLING_H
+
+#include "bvh.h"
+#include "camera.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <vector>
+
+
+// Per-tile candidate sets for primary rays. A primary ray through a 16x16 tile can only hit
+// objects that overlap the tile's frustum, so each tile walks the scene BVH once with that
+// frustum, keeps the objects whose boxes survive, and gets a small BVH of its own over them.
+// Objects off screen, or in another part of the frame, never reach a tile's primary rays.
+// The sets depend on the camera and must be rebuilt when it moves.
+class tile_culling {
+  public:
+    static const int tile_size = 16;
+
+    tile_culling(const bvh& world, const camera& cam, int image_width, int image_height)
+      : tiles_x((image_width + tile_size - 1) / tile_size),
+        tiles_y((image_height + tile_size - 1) / tile_size)
+    {
+        tiles.resize(tiles_x * tiles_y);
+        counts.resize(tiles_x * tiles_y);
+
+        parallel_for(tiles_x * tiles_y, [&](int, int begin, int end) {
+            std::vector<int> found;
+            for (int t = begin; t < end; t++) {
+                int i0 = (t % tiles_x) * tile_size;
+                int j0 = (t / tiles_x) * tile_size;
+                auto region = cam.pixel_frustum(i0, j0, std::min(i0 + tile_size, image_width),
+                                                std::min(j0 + tile_size, image_height));
+
+                found.clear();
+                collect(world, region, found);
+                std::sort(found.begin(), found.end());
+                found.erase(std::unique(found.begin(), found.end()), found.end());
+
+                hittable_list candidates;
+                for (int index : found)
+                    candidates.add(world.primitives()[index]);
+                tiles[t] = std::make_unique<bvh>(candidates);
+                counts[t] = int(found.size());
+            }
+        });
+    }
+
+    // What primary rays through pixel (i, j) should be traced against.
+    const hittable& candidates(int i, int j) const {
+        return *tiles[(j / tile_size) * tiles_x + i / tile_size];
+    }
+
+    double average_candidates() const {
+        double total = 0;
+        for (int c : counts)
+            total += c;
+        return counts.empty() ? 0 : total / counts.size();
+    }
+
+  private:
+    int tiles_x, tiles_y;
+    std::vector<std::unique_ptr<bvh>> tiles;
+    std::vector<int>                  counts;
+
+    static void collect(const bvh& world, const frustum& region, std::vector<int>& out) {
+        const auto& nodes = world.node_array();
+        if (nodes.empty())
+            return;
+
+        // Descends into the left child and defers only the right, one entry per level.
+        int stack[bvh::max_depth];
+        int stack_size = 0;
+        int current = 0;
+
+        while (true) {
+            const auto& node = nodes[current];
+            if (region.overlaps(node.bbox)) {
+                if (node.count == 0) {
+                    assert(stack_size < bvh::max_depth);
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                    continue;
+                }
+                for (int k = node.offset; k < node.offset + node.count; k++) {
+                    int index = world.primitive_order()[k];
+                    if (region.overlaps(world.primitives()[index]->bounding_box()))
+                        out.push_back(index);
+                }
+            }
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+};
+
+
+#endif
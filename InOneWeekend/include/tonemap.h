@@ -0,0 +1,171 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include "hdr_buffer.h"
+#include "parallel.h"
+#include "vec3.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+enum class tone_curve { clamp, reinhard, aces };
+
+inline const char* tone_curve_name(tone_curve curve) {
+    switch (curve) {
+        case tone_curve::reinhard: return "Reinhard";
+        case tone_curve::aces:     return "ACES";
+        default:                   return "clamp";
+    }
+}
+
+
+// Turns linear HDR radiance into 8-bit RGBA for display, as a pass of its own over the
+// whole image, so exposure and tone curve can be changed and the image shown again without
+// tracing a single ray. Per pixel: scale by 2^exposure, apply the tone curve, encode with
+// gamma through a table, and round to 8 bits with an 8x8 ordered dither against banding.
+//
+// apply() splits the image into row bands across threads. Within a row, the channels are
+// scaled into a planar float buffer and the tone curve runs over it four values at a time
+// with SSE; the gamma table then needs a lookup per value, which stays scalar. map() does
+// the same for a single pixel, for renderers that show pixels as they finish.
+class tone_mapper {
+  public:
+    double     exposure = 0;   // In stops.
+    tone_curve curve    = tone_curve::clamp;
+    bool       dither   = true;
+
+    explicit tone_mapper(double gamma = 2.0) : gamma_lut(lut_size) {
+        // 8.8 fixed point, so the dither threshold can be added before dropping the fraction.
+        for (int k = 0; k < lut_size; k++) {
+            auto encoded = std::pow(double(k) / (lut_size - 1), 1 / gamma);
+            gamma_lut[k] = uint16_t(std::lround(encoded * 255 * 256));
+        }
+    }
+
+    void map(const vec3& linear, int i, int j, uint8_t rgba[4]) const {
+        auto gain = float(std::exp2(exposure));
+        auto t = threshold(i, j);
+        for (int c = 0; c < 3; c++)
+            rgba[c] = uint8_t((gamma_lut[lut_index(float(linear[c]) * gain)] + t) >> 8);
+        rgba[3] = 255;
+    }
+
+    // Maps scale * hdr[k] for every pixel of a width by height image into rgba.
+    void apply(const vec3* hdr, double scale, uint8_t* rgba, int width, int height) const {
+        apply_rows(width, height, scale, rgba,
+                   [&](int j, float gain, float* r, float* g, float* b) {
+                       const vec3* row = hdr + size_t(j) * width;
+                       for (int i = 0; i < width; i++) {
+                           r[i] = float(row[i].x()) * gain;
+                           g[i] = float(row[i].y()) * gain;
+                           b[i] = float(row[i].z()) * gain;
+                       }
+                   });
+    }
+
+    void apply(const hdr_buffer& image, double scale, uint8_t* rgba) const {
+        apply_rows(image.width(), image.height(), scale, rgba,
+                   [&](int j, float gain, float* r, float* g, float* b) {
+                       image.load_row(j, gain, r, g, b);
+                   });
+    }
+
+  private:
+    static const int lut_size = 65536;   // One step at the dark end is about one 8-bit level.
+
+    std::vector<uint16_t> gamma_lut;
+
+    // load_row(j, gain, r, g, b) fills row j's channels, multiplied by gain, as planar floats.
+    template <typename LoadRow>
+    void apply_rows(int width, int height, double scale, uint8_t* rgba, LoadRow&& load_row) const {
+        auto gain = float(scale * std::exp2(exposure));
+        int padded = (width + 3) & ~3;
+
+        parallel_for(height, [&](int, int begin, int end) {
+            std::vector<float>   channels(3 * size_t(padded), 0.0f);
+            std::vector<int32_t> index(channels.size());
+            for (int j = begin; j < end; j++) {
+                load_row(j, gain, channels.data(), channels.data() + padded,
+                         channels.data() + 2 * padded);
+
+                lut_indices(channels.data(), index.data(), int(channels.size()));
+
+                // The dither pattern repeats every eight pixels along the row.
+                uint16_t row_threshold[8];
+                for (int i = 0; i < 8; i++)
+                    row_threshold[i] = threshold(i, j);
+                const int32_t* r = index.data();
+                const int32_t* g = r + padded;
+                const int32_t* b = g + padded;
+                uint8_t* out = rgba + 4 * size_t(j) * width;
+                for (int i = 0; i < width; i++) {
+                    auto t = row_threshold[i & 7];
+                    out[4 * i]     = uint8_t((gamma_lut[r[i]] + t) >> 8);
+                    out[4 * i + 1] = uint8_t((gamma_lut[g[i]] + t) >> 8);
+                    out[4 * i + 2] = uint8_t((gamma_lut[b[i]] + t) >> 8);
+                    out[4 * i + 3] = 255;
+                }
+            }
+        });
+    }
+
+    // Tone curve, then the place in the gamma table. NaN goes to black; the comparisons are
+    // ordered so the SSE path and this one agree on it.
+    int32_t lut_index(float x) const {
+        x = (x > 0) ? x : 0.0f;
+        if (curve == tone_curve::reinhard)
+            x = x / (1 + x);
+        else if (curve == tone_curve::aces)
+            x = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+        x = (x < 1) ? x : 1.0f;
+        return int32_t(x * (lut_size - 1) + 0.5f);
+    }
+
+    void lut_indices(const float* x, int32_t* index, int count) const {
+#if defined(__SSE2__)
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+        const __m128 top = _mm_set1_ps(lut_size - 1), half = _mm_set1_ps(0.5f);
+        for (int k = 0; k < count; k += 4) {
+            __m128 v = _mm_max_ps(_mm_loadu_ps(x + k), zero);
+            if (curve == tone_curve::reinhard) {
+                v = _mm_div_ps(v, _mm_add_ps(one, v));
+            } else if (curve == tone_curve::aces) {
+                __m128 a = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), v), _mm_set1_ps(0.03f));
+                __m128 b = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), v), _mm_set1_ps(0.59f));
+                v = _mm_div_ps(_mm_mul_ps(v, a), _mm_add_ps(_mm_mul_ps(v, b), _mm_set1_ps(0.14f)));
+            }
+            v = _mm_min_ps(v, one);
+            __m128i q = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, top), half));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(index + k), q);
+        }
+#else
+        for (int k = 0; k < count; k++)
+            index[k] = lut_index(x[k]);
+#endif
+    }
+
+    // What is added to a fixed point table entry before keeping its integer part: the
+    // pixel's place in the dither pattern, or plain rounding without dither.
+    uint16_t threshold(int i, int j) const {
+        static const uint8_t bayer[8][8] = {
+            {  0, 32,  8, 40,  2, 34, 10, 42 },
+            { 48, 16, 56, 24, 50, 18, 58, 26 },
+            { 12, 44,  4, 36, 14, 46,  6, 38 },
+            { 60, 28, 52, 20, 62, 30, 54, 22 },
+            {  3, 35, 11, 43,  1, 33,  9, 41 },
+            { 51, 19, 59, 27, 49, 17, 57, 25 },
+            { 15, 47,  7, 39, 13, 45,  5, 37 },
+            { 63, 31, 55, 23, 61, 29, 53, 21 },
+        };
+        return uint16_t(dither ? 4 * bayer[j & 7][i & 7] + 2 : 128);
+    }
+};
+
+
+#endif
@@ -2,8 +2,7 @@
 #ifndef VEC3_H
 #define VEC3_H
 
-
-
+#include <cstdint>
 
 
 class vec3 {
@@ -144,4 +143,29 @@ inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
 }
 
 
+// Octahedral mapping of a unit normal to two snorm16 values.
+inline void encode_normal(const vec3& n, int16_t out[2]) {
+    auto l1 = std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z());
+    double u = n.x() / l1, v = n.y() / l1;
+    if (n.z() < 0) {
+        double pu = (1 - std::fabs(v)) * (u >= 0 ? 1 : -1);
+        double pv = (1 - std::fabs(u)) * (v >= 0 ? 1 : -1);
+        u = pu;
+        v = pv;
+    }
+    out[0] = int16_t(std::round(u * 32767));
+    out[1] = int16_t(std::round(v * 32767));
+}
+
+inline vec3 decode_normal(const int16_t in[2]) {
+    double u = in[0] / 32767.0, v = in[1] / 32767.0;
+    vec3 n(u, v, 1 - std::fabs(u) - std::fabs(v));
+    if (n.z() < 0) {
+        n[0] = (1 - std::fabs(v)) * (u >= 0 ? 1 : -1);
+        n[1] = (1 - std::fabs(u)) * (v >= 0 ? 1 : -1);
+    }
+    return unit_vector(n);
+}
+
+
 #endif
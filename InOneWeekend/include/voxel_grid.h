@@ -0,0 +1,254 @@
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include "hittable.h"
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+
+// Solid voxels stored sparsely: the volume is cut into bricks of 8x8x8 voxels, and only
+// bricks holding at least one solid voxel are allocated. A voxel is one byte, an index into
+// the grid's material palette, with 0 meaning empty.
+//
+// Rays are walked with a 3D-DDA over the bricks, which steps over empty ones without looking
+// inside, and a second DDA over the voxels of each occupied brick they cross. The first solid
+// voxel a ray enters is the hit, with the normal of the face it came through.
+//
+// The binary format is a small header followed by the voxels one z-slice at a time, so a
+// scan much larger than memory as a dense array can be loaded slice by slice, straight into
+// the bricks.
+class voxel_grid : public hittable {
+  public:
+    static const int brick_size = 8;
+
+    voxel_grid(int nx, int ny, int nz, double voxel_size, const point3& origin)
+      : voxel_size(voxel_size), origin(origin)
+    {
+        size[0] = nx; size[1] = ny; size[2] = nz;
+        for (int a = 0; a < 3; a++)
+            bricks[a] = (size[a] + brick_size - 1) / brick_size;
+        brick_index.assign(size_t(bricks[0]) * bricks[1] * bricks[2], -1);
+        palette.resize(256);
+
+        auto extent = vec3(nx, ny, nz) * voxel_size;
+        bbox = aabb(origin, origin + extent);
+    }
+
+    void set_material(uint8_t id, shared_ptr<material> mat) { palette[id] = std::move(mat); }
+
+    uint8_t get(int x, int y, int z) const {
+        auto b = brick_index[brick_of(x, y, z)];
+        return b < 0 ? 0 : voxels[size_t(b) * brick_voxels + voxel_in_brick(x, y, z)];
+    }
+
+    void set(int x, int y, int z, uint8_t id) {
+        auto& b = brick_index[brick_of(x, y, z)];
+        if (b < 0) {
+            if (id == 0)
+                return;
+            b = int(voxels.size() / brick_voxels);
+            voxels.resize(voxels.size() + brick_voxels, 0);
+        }
+        voxels[size_t(b) * brick_voxels + voxel_in_brick(x, y, z)] = id;
+    }
+
+    // Reads the format save() writes. Only one z-slice is held densely at a time.
+    static shared_ptr<voxel_grid> load(std::istream& in) {
+        char magic[4];
+        uint32_t dims[3];
+        float header[4];
+        in.read(magic, 4);
+        in.read(reinterpret_cast<char*>(dims), sizeof(dims));
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!in || std::memcmp(magic, file_magic, 4) != 0)
+            throw std::runtime_error("not a voxel file");
+
+        auto grid = make_shared<voxel_grid>(int(dims[0]), int(dims[1]), int(dims[2]), header[0],
+                                            point3(header[1], header[2], header[3]));
+
+        std::vector<uint8_t> slice(size_t(dims[0]) * dims[1]);
+        for (int z = 0; z < int(dims[2]); z++) {
+            in.read(reinterpret_cast<char*>(slice.data()), slice.size());
+            if (!in)
+                throw std::runtime_error("voxel file ends early");
+            for (int y = 0; y < int(dims[1]); y++)
+                for (int x = 0; x < int(dims[0]); x++)
+                    grid->set(x, y, z, slice[size_t(y) * dims[0] + x]);
+        }
+        return grid;
+    }
+
+    void save(std::ostream& out) const {
+        uint32_t dims[3] = { uint32_t(size[0]), uint32_t(size[1]), uint32_t(size[2]) };
+        float header[4] = { float(voxel_size), float(origin.x()), float(origin.y()),
+                            float(origin.z()) };
+        out.write(file_magic, 4);
+        out.write(reinterpret_cast<const char*>(dims), sizeof(dims));
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        std::vector<uint8_t> slice(size_t(size[0]) * size[1]);
+        for (int z = 0; z < size[2]; z++) {
+            for (int y = 0; y < size[1]; y++)
+                for (int x = 0; x < size[0]; x++)
+                    slice[size_t(y) * size[0] + x] = get(x, y, z);
+            out.write(reinterpret_cast<const char*>(slice.data()), slice.size());
+        }
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Clip to the grid, remembering which face the ray enters through.
+        int entry_axis = -1;
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = bbox.axis_interval(axis);
+            auto inv = 1 / r.direction()[axis];
+            auto t0 = (ax.min - r.origin()[axis]) * inv;
+            auto t1 = (ax.max - r.origin()[axis]) * inv;
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > ray_t.min) {
+                ray_t.min = t0;
+                entry_axis = axis;
+            }
+            ray_t.max = std::fmin(ray_t.max, t1);
+        }
+        if (ray_t.max <= ray_t.min)
+            return false;
+
+        const int brick_res[3] = { bricks[0], bricks[1], bricks[2] };
+        double hit_t = 0;
+        int hit_axis = -1, hit_step = 0;
+        uint8_t hit_id = 0;
+
+        march(r, origin, voxel_size * brick_size, brick_res, ray_t.min, ray_t.max, entry_axis,
+              [&](const int brick[3], double enter, double exit, int axis, const int[3]) {
+            auto b = brick_index[(size_t(brick[2]) * bricks[1] + brick[1]) * bricks[0] + brick[0]];
+            if (b < 0)
+                return false;
+
+            // Inside an occupied brick, walk its voxels over the same stretch of the ray.
+            const uint8_t* cells = &voxels[size_t(b) * brick_voxels];
+            int res[3];
+            for (int a = 0; a < 3; a++)
+                res[a] = std::min(brick_size, size[a] - brick[a] * brick_size);
+            auto corner = origin + voxel_size * brick_size * vec3(brick[0], brick[1], brick[2]);
+
+            return march(r, corner, voxel_size, res, enter, exit, axis,
+                         [&](const int v[3], double v_enter, double, int v_axis, const int v_step[3]) {
+                auto id = cells[(v[2] * brick_size + v[1]) * brick_size + v[0]];
+                // A ray that starts inside solid has no face to hit there; let it out first.
+                if (id == 0 || v_axis < 0)
+                    return false;
+                hit_t = v_enter;
+                hit_axis = v_axis;
+                hit_step = v_step[v_axis];
+                hit_id = id;
+                return true;
+            });
+        });
+
+        if (hit_axis < 0 || !palette[hit_id])
+            return false;
+
+        rec.t = hit_t;
+        rec.p = r.at(hit_t);
+        vec3 outward_normal(0, 0, 0);
+        outward_normal[hit_axis] = -hit_step;
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = palette[hit_id];
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t brick_count() const { return voxels.size() / brick_voxels; }
+
+    size_t memory_bytes() const {
+        return brick_index.size() * sizeof(int32_t) + voxels.size();
+    }
+
+  private:
+    static constexpr const char* file_magic = "VOX1";
+    static const int brick_voxels = brick_size * brick_size * brick_size;
+
+    int                  size[3];
+    int                  bricks[3];
+    double               voxel_size;
+    point3               origin;
+    aabb                 bbox;
+    std::vector<int32_t> brick_index;   // Per brick, its place in voxels, or -1 when empty.
+    std::vector<uint8_t> voxels;        // Occupied bricks, 512 material ids each.
+    std::vector<shared_ptr<material>> palette;
+
+    size_t brick_of(int x, int y, int z) const {
+        return (size_t(z / brick_size) * bricks[1] + y / brick_size) * bricks[0] + x / brick_size;
+    }
+
+    static int voxel_in_brick(int x, int y, int z) {
+        return ((z % brick_size) * brick_size + y % brick_size) * brick_size + x % brick_size;
+    }
+
+    // 3D-DDA over a res[0] x res[1] x res[2] block of cubic cells from corner, between ray
+    // parameters t_enter and t_exit. visit(cell, enter, exit, axis, step) is called on each
+    // cell in order, with the axis the ray crossed to get in (entry_axis for the first cell),
+    // until it returns true.
+    template <typename Visit>
+    static bool march(const ray& r, const point3& corner, double cell_size, const int res[3],
+                      double t_enter, double t_exit, int entry_axis, Visit&& visit)
+    {
+        const auto& o = r.origin();
+        const auto& d = r.direction();
+        // Where the ray enters lies on a cell face; clamping settles which side it counts for.
+        auto start = r.at(t_enter);
+
+        int cell[3], step[3], out[3];
+        double t_next[3], t_delta[3];
+        for (int axis = 0; axis < 3; axis++) {
+            int c = int(std::floor((start[axis] - corner[axis]) / cell_size));
+            cell[axis] = std::clamp(c, 0, res[axis] - 1);
+            auto lo = corner[axis] + cell[axis] * cell_size;
+            if (d[axis] > 0) {
+                step[axis] = 1;
+                out[axis] = res[axis];
+                t_next[axis] = (lo + cell_size - o[axis]) / d[axis];
+                t_delta[axis] = cell_size / d[axis];
+            } else if (d[axis] < 0) {
+                step[axis] = -1;
+                out[axis] = -1;
+                t_next[axis] = (lo - o[axis]) / d[axis];
+                t_delta[axis] = -cell_size / d[axis];
+            } else {
+                step[axis] = 0;
+                out[axis] = -1;
+                t_next[axis] = infinity;
+                t_delta[axis] = infinity;
+            }
+        }
+
+        auto enter = t_enter;
+        int axis_in = entry_axis;
+        while (true) {
+            int axis = (t_next[0] < t_next[1])
+                     ? (t_next[0] < t_next[2] ? 0 : 2)
+                     : (t_next[1] < t_next[2] ? 1 : 2);
+            auto exit = std::fmin(t_next[axis], t_exit);
+            if (visit(cell, enter, exit, axis_in, step))
+                return true;
+            if (t_next[axis] >= t_exit)
+                return false;
+
+            cell[axis] += step[axis];
+            if (cell[axis] == out[axis])
+                return false;
+            enter = t_next[axis];
+            axis_in = axis;
+            t_next[axis] += t_delta[axis];
+        }
+    }
+};
+
+
+#endif
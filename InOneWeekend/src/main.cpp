@@ -4,10 +4,37 @@
 #include "ray.h"
 #include "hittable.h"
 #include "sphere.h"
+#include "curve.h"
+#include "sdf.h"
+#include "voxel_grid.h"
+#include "heightfield.h"
+#include "particles.h"
+#include "paged_particles.h"
 #include "hittable_list.h"
 #include "camera.h"
 #include "material.h"
 #include "interval.h"
+#include "bvh.h"
+#include "lazy_bvh.h"
+#include "compressed_bvh.h"
+#include "bucketed_bvh.h"
+#include "bench.h"
+#include "grid.h"
+#include "kd_tree.h"
+#include "tile_culling.h"
+#include "primary_hit_cache.h"
+#include "photon_map.h"
+#include "bdpt.h"
+#include "restir.h"
+#include "pssmlt.h"
+#include "splat_buffer.h"
+#include "parallel.h"
+#include "sky.h"
+#include "hdr_buffer.h"
+#include "pixel_filter.h"
+#include "render_region.h"
+#include "progress.h"
+#include "tonemap.h"
 #include "raylib.h"
 #include <cmath>
 #include <memory>
@@ -16,86 +43,245 @@
 #include <algorithm>
 #include <atomic>
 #include <mutex>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <random>
 
 using std::make_shared;
 using std::shared_ptr;
 
-std::atomic<int> completed_rows(0);
+// Tiles finished by the render threads, for the UI or a headless run to read.
+rt::render_progress progress;
+
+// Rays traced by this thread in all, counted where nothing else sees it; render threads
+// report the difference per tile.
+thread_local long long rays_traced = 0;
+
+// Before the full render, the path tracer shows a preview at one ray per 8x8 block, then per
+// 4x4, 2x2 and 1x1. Each pixel is traced once over all four levels, as its first sample.
+const int preview_block = 8;
 std::mutex texture_mutex;
 
-rt::vec3 ray_color(const rt::ray& r, const rt::hittable& world, int depth) {
+// Exposure, tone curve and dither of what is on screen. Only changed while no render is
+// running, since render threads read it as they show finished pixels.
+rt::tone_mapper display;
+
+enum class integrator { path, bdpt, metropolis };
+
+const char* integrator_name(integrator mode) {
+    switch (mode) {
+        case integrator::bdpt:       return "bidirectional";
+        case integrator::metropolis: return "metropolis (PSSMLT)";
+        default:                     return "path";
+    }
+}
+
+rt::vec3 ray_color(const rt::ray& r, const rt::hittable& world, int depth,
+                   rt::caustic_filter filter, const rt::hittable* first_hit);
+
+// Radiance leaving rec, already found to be r's closest hit, back along r; the rest of the
+// path is traced from there.
+rt::vec3 shade(const rt::ray& r, const rt::hit_record& rec, const rt::hittable& world, int depth,
+               rt::caustic_filter filter = rt::caustic_filter::off) {
+    rt::ray scattered;
+    rt::vec3 attenuation;
+    rt::vec3 emission = rec.mat->emitted(rec);
+    if (rec.mat->scatter(r, rec, attenuation, scattered))
+        return emission + attenuation * ray_color(scattered, world, depth-1,
+                                       rt::next_caustic_filter(filter, rec.mat->is_diffuse()),
+                                       nullptr);
+    return emission;
+}
+
+// first_hit, when given, is a subset of world that is known to hold everything r can hit,
+// such as a tile's primary ray candidates; bounces are traced against the whole world.
+rt::vec3 ray_color(const rt::ray& r, const rt::hittable& world, int depth,
+                   rt::caustic_filter filter = rt::caustic_filter::off,
+                   const rt::hittable* first_hit = nullptr) {
     if (depth <= 0) return rt::vec3(0,0,0);
 
+    rays_traced++;
     rt::hit_record rec;
 
-    if (world.hit(r, rt::interval(0.001, rt::infinity), rec)) {
-        rt::ray scattered;
-        rt::vec3 attenuation;
-        if (rec.mat->scatter(r, rec, attenuation, scattered))
-            return attenuation * ray_color(scattered, world, depth-1);
-        return rt::vec3(0,0,0);
+    if ((first_hit ? *first_hit : world).hit(r, rt::interval(0.001, rt::infinity), rec))
+        return shade(r, rec, world, depth, filter);
+
+    if (filter == rt::caustic_filter::caustic) return rt::vec3(0,0,0);
+
+    return rt::sky_radiance(r.direction());
+}
+
+static_assert(sizeof(Color) == 4, "Color is written as packed RGBA bytes");
+
+Color to_display(const rt::vec3& linear, int i, int j) {
+    Color c;
+    display.map(linear, i, j, &c.r);
+    return c;
+}
+
+// Maps a whole HDR image, each value scaled by scale, to the screen pixels.
+void show(const rt::hdr_buffer& image, double scale, Color* pixels) {
+    display.apply(image, scale, &pixels[0].r);
+}
+
+rt::pixel_format parse_pixel_format(const char* name) {
+    if (std::strcmp(name, "half") == 0)
+        return rt::pixel_format::half;
+    if (std::strcmp(name, "rgb9e5") == 0)
+        return rt::pixel_format::rgb9e5;
+    return rt::pixel_format::float32;
+}
+
+rt::filter_type parse_filter(const char* name) {
+    if (std::strcmp(name, "gaussian") == 0)
+        return rt::filter_type::gaussian;
+    if (std::strcmp(name, "mitchell") == 0)
+        return rt::filter_type::mitchell;
+    if (std::strcmp(name, "blackman-harris") == 0)
+        return rt::filter_type::blackman_harris;
+    return rt::filter_type::box;
+}
+
+// Renders the rows [start_row, end_row) of region, which give the columns, reporting each
+// preview level and then each row as a tile.
+void render_block(int thread, int start_row, int end_row, int width,
+                  const rt::render_region& region, int samples, int depth, rt::camera& cam,
+                  const rt::hittable& world, const rt::tile_culling& tiles, bool caustics,
+                  rt::hdr_buffer& radiance, Color* pixels)
+{
+    rt::tile_timer timer(progress, thread, rays_traced);
+    auto filter = caustics ? rt::caustic_filter::before_diffuse : rt::caustic_filter::off;
+    auto sample = [&](int i, int j) {
+        double weight;
+        rt::ray r = cam.get_ray(i, j, weight);
+        return weight * ray_color(r, world, depth, filter, &tiles.candidates(i, j));
+    };
+
+    // The preview levels, coarse to fine over this block's rows. A level traces the pixels
+    // on its grid that no coarser level has, and shows each over the block it stands for
+    // until a finer level or the full render replaces it.
+    int columns = region.width();
+    std::vector<rt::vec3> first(size_t(end_row - start_row) * columns);
+    for (int block = preview_block; block >= 1; block /= 2) {
+        long long traced_count = 0;
+        for (int j = start_row; j < end_row; j += block) {
+            for (int i = region.x0; i < region.x1; i += block) {
+                bool traced = block < preview_block && (i - region.x0) % (2 * block) == 0
+                           && (j - start_row) % (2 * block) == 0;
+                if (traced)
+                    continue;
+                auto c = sample(i, j);
+                traced_count++;
+                first[size_t(j - start_row) * columns + (i - region.x0)] = c;
+                auto shown = to_display(c, i, j);
+                for (int y = j; y < std::min(j + block, end_row); y++)
+                    for (int x = i; x < std::min(i + block, region.x1); x++)
+                        pixels[y * width + x] = shown;
+            }
+        }
+        timer.finish({region.x0, start_row, region.x1, end_row}, traced_count, rays_traced,
+                     true);
+    }
+
+    for (int j = start_row; j < end_row; ++j) {
+        for (int i = region.x0; i < region.x1; ++i) {
+            rt::vec3 pixel_color = first[size_t(j - start_row) * columns + (i - region.x0)];
+            for (int s = 1; s < samples; ++s)
+                pixel_color += sample(i, j);
+            auto scale = 1.0 / samples;
+            radiance.set(i, j, scale * pixel_color);
+            pixels[j * width + i] = to_display(scale * pixel_color, i, j);
+        }
+        timer.finish({region.x0, j, region.x1, j + 1}, (samples - 1) * (long long)columns,
+                     rays_traced);
     }
+    progress.thread_done();
+}
 
-    rt::vec3 unit_direction = rt::unit_vector(r.direction());
-    auto t = 0.5*(unit_direction.y() + 1.0);
-    return (1.0 - t)*rt::vec3(1.0,1.0,1.0) + t*rt::vec3(0.5,0.7,1.0);
+// Material editor preview: every sample starts from the primary hit cache, so only the
+// bounces after the first surface are traced.
+void render_cached(const rt::primary_hit_cache& cache, const rt::hittable& world,
+                   const rt::tile_culling& tiles, int width, int height, int depth,
+                   rt::hdr_buffer& radiance, Color* pixels)
+{
+    int samples = cache.samples_per_pixel();
+    rt::parallel_for(height, [&](int, int begin, int end) {
+        for (int j = begin; j < end; ++j) {
+            for (int i = 0; i < width; ++i) {
+                rt::vec3 pixel_color(0,0,0);
+                for (int s = 0; s < samples; ++s) {
+                    rt::ray r;
+                    double weight;
+                    rt::hit_record rec;
+                    switch (cache.lookup(i, j, s, r, weight, rec)) {
+                        case rt::primary_hit_cache::hit:
+                            pixel_color += weight * shade(r, rec, world, depth);
+                            break;
+                        case rt::primary_hit_cache::miss:
+                            pixel_color += weight * rt::sky_radiance(r.direction());
+                            break;
+                        case rt::primary_hit_cache::not_cached:
+                            pixel_color += weight * ray_color(r, world, depth,
+                                                              rt::caustic_filter::off,
+                                                              &tiles.candidates(i, j));
+                            break;
+                    }
+                }
+                radiance.set(i, j, pixel_color / samples);
+                pixels[j * width + i] = to_display(pixel_color / samples, i, j);
+            }
+        }
+    });
 }
 
-void render_block(int start_row, int end_row, int width, int height, int samples, int depth,
-                  rt::camera& cam, const rt::hittable_list& world, Color* pixels)
+// Camera subpath contributions go straight to the pixel; light subpaths that connect to the
+// camera are splatted into this thread's buffer and added once every thread is done.
+void render_block_bdpt(int thread, int start_row, int end_row, int width,
+                       const rt::render_region& region, int samples,
+                       const rt::bdpt_integrator& bdpt, rt::splat_buffer& splats,
+                       rt::hdr_buffer& radiance, Color* pixels)
 {
+    // Rays inside bdpt are not counted; its tiles report samples only.
+    rt::tile_timer timer(progress, thread, 0);
     for (int j = start_row; j < end_row; ++j) {
-        for (int i = 0; i < width; ++i) {
+        for (int i = region.x0; i < region.x1; ++i) {
             rt::vec3 pixel_color(0,0,0);
             for (int s = 0; s < samples; ++s) {
-                rt::ray r = cam.get_ray(i, j);
-                pixel_color += ray_color(r, world, depth);
+                pixel_color += bdpt.sample(i, j, splats, thread);
             }
-            auto scale = 1.0 / samples;
-            auto r_col = sqrt(scale * pixel_color.x());
-            auto g_col = sqrt(scale * pixel_color.y());
-            auto b_col = sqrt(scale * pixel_color.z());
-
-            pixels[j * width + i] = (Color) {
-                (unsigned char)(256 * std::clamp(r_col, 0.0, 0.999)),
-                (unsigned char)(256 * std::clamp(g_col, 0.0, 0.999)),
-                (unsigned char)(256 * std::clamp(b_col, 0.0, 0.999)), 
-                255
-            };
+            radiance.set(i, j, pixel_color / samples);
+            pixels[j * width + i] = to_display(pixel_color / samples, i, j);
         }
-        completed_rows.fetch_add(1);
+        timer.finish({region.x0, j, region.x1, j + 1}, samples * (long long)region.width(), 0);
     }
+    progress.thread_done();
 }
 
-int main() {
-    const int image_width = 800;
-    const int image_height = 450;
-    const int samples_per_pixel = 50;
-    const int max_depth = 10;
-    
-    const int num_threads = std::thread::hardware_concurrency();
-    if (num_threads == 0) {
-        std::cout << "Could not detect number of threads, using 4" << std::endl;
-    }
-    const int actual_threads = (num_threads == 0) ? 4 : num_threads;
-    
-    std::cout << "Using " << actual_threads << " threads for rendering" << std::endl;
+struct scene {
+    rt::hittable_list world;
+    rt::hittable_list caustic_casters;
+    rt::hittable_list lights;
+    bool open_sky = true;
 
-    SetConfigFlags(FLAG_VSYNC_HINT);
-    
-    InitWindow(image_width, image_height, "Multithreaded RayTracing - Raylib");
-    SetTargetFPS(60);
+    // What the material editor adjusts; either may be missing.
+    shared_ptr<rt::lambertian> edit_diffuse;
+    shared_ptr<rt::metal>      edit_metal;
 
-    Color* pixels = (Color*)MemAlloc(image_width * image_height * sizeof(Color));
-    
-    for (int i = 0; i < image_width * image_height; i++) {
-        pixels[i] = BLACK;
-    }
+    std::vector<shared_ptr<rt::sdf>> sdfs;   // For their step statistics.
+    shared_ptr<rt::paged_particle_cloud> paged_particles;
+};
 
-    Image img = GenImageColor(image_width, image_height, BLACK);
-    Texture2D texture = LoadTextureFromImage(img);
+void draw_display_settings(int y) {
+    DrawText(TextFormat("+/-: exposure %+.1f   T: tone curve [%s]   D: dither [%s]",
+                        display.exposure, rt::tone_curve_name(display.curve),
+                        display.dither ? "on" : "off"),
+             10, y, 16, DARKGRAY);
+}
 
-    rt::hittable_list world;
+void random_spheres_scene(scene& s, rt::camera& cam) {
+    auto& world = s.world;
+    auto& caustic_casters = s.caustic_casters;
 
     auto ground_material = make_shared<rt::lambertian>(rt::vec3(0.5, 0.5, 0.5));
     world.add(make_shared<rt::sphere>(rt::vec3(0,-1000,0), 1000, ground_material));
@@ -119,121 +305,1616 @@ int main() {
                     sphere_material = make_shared<rt::dielectric>(1.5);
                 }
 
-                world.add(make_shared<rt::sphere>(center, 0.2, sphere_material));
+                auto small_sphere = make_shared<rt::sphere>(center, 0.2, sphere_material);
+                world.add(small_sphere);
+                if (!sphere_material->is_diffuse())
+                    caustic_casters.add(small_sphere);
             }
         }
     }
 
     auto material1 = make_shared<rt::dielectric>(1.5);
-    world.add(make_shared<rt::sphere>(rt::vec3(0, 1, 0), 1.0, material1));
+    auto glass_sphere = make_shared<rt::sphere>(rt::vec3(0, 1, 0), 1.0, material1);
+    world.add(glass_sphere);
+    caustic_casters.add(glass_sphere);
 
     auto material2 = make_shared<rt::lambertian>(rt::vec3(0.4, 0.2, 0.1));
     world.add(make_shared<rt::sphere>(rt::vec3(-4, 1, 0), 1.0, material2));
 
     auto material3 = make_shared<rt::metal>(rt::vec3(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<rt::sphere>(rt::vec3(4, 1, 0), 1.0, material3));
+    auto metal_sphere = make_shared<rt::sphere>(rt::vec3(4, 1, 0), 1.0, material3);
+    world.add(metal_sphere);
+    caustic_casters.add(metal_sphere);
 
-    rt::camera cam;
-    cam.aspect_ratio = double(image_width) / image_height;
-    cam.image_width = image_width;
-    cam.samples_per_pixel = samples_per_pixel;
-    cam.max_depth = max_depth;
+    s.edit_diffuse = material2;
+    s.edit_metal = material3;
 
     cam.vfov = 20;
     cam.lookfrom = rt::vec3(13,2,3);
     cam.lookat = rt::vec3(0,0,0);
     cam.vup = rt::vec3(0,1,0);
+}
+
+// A closed room (the inside of a large sphere) whose only light comes from two small lamps
+// hidden behind a pair of large spheres, reaching the room through the narrow gap between
+// them. Unidirectional path tracing rarely finds the lamps; BDPT starts paths on them.
+void interior_scene(scene& s, rt::camera& cam) {
+    auto& world = s.world;
+    s.open_sky = false;
+
+    auto walls = make_shared<rt::lambertian>(rt::vec3(0.73, 0.73, 0.73));
+    world.add(make_shared<rt::sphere>(rt::vec3(0, 2, 0), 12, walls));
+    world.add(make_shared<rt::sphere>(rt::vec3(0, -1000, 0), 1000, walls));
+
+    auto screen = make_shared<rt::lambertian>(rt::vec3(0.6, 0.3, 0.2));
+    world.add(make_shared<rt::sphere>(rt::vec3(-3.1, 2, -4), 3.0, screen));
+    world.add(make_shared<rt::sphere>(rt::vec3( 3.1, 2, -4), 3.0, screen));
+
+    auto lamp = make_shared<rt::diffuse_light>(rt::vec3(40, 36, 30));
+    for (auto x : {-0.6, 0.6}) {
+        auto bulb = make_shared<rt::sphere>(rt::vec3(x, 2, -8), 0.3, lamp);
+        world.add(bulb);
+        s.lights.add(bulb);
+    }
+
+    s.edit_diffuse = make_shared<rt::lambertian>(rt::vec3(0.2, 0.4, 0.7));
+    world.add(make_shared<rt::sphere>(rt::vec3(-1.5, 0.8, 2), 0.8, s.edit_diffuse));
+    world.add(make_shared<rt::sphere>(rt::vec3(1.4, 0.8, 2.5), 0.8,
+                                      make_shared<rt::dielectric>(1.5)));
+
+    cam.vfov = 60;
+    cam.lookfrom = rt::vec3(0, 2.5, 9);
+    cam.lookat = rt::vec3(0, 1.5, 0);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// count small spheres scattered through a cube, for measuring the acceleration structures on
+// far more primitives than the book scene has.
+void sphere_cloud_scene(scene& s, rt::camera& cam, int count) {
+    const double side = 100;
+    auto radius = 0.3 * side / std::cbrt(double(count));
+    auto material = make_shared<rt::lambertian>(rt::vec3(0.6, 0.6, 0.6));
+    s.edit_diffuse = material;
+
+    for (int k = 0; k < count; k++) {
+        auto center = side * (rt::vec3::random() - rt::vec3(0.5, 0.5, 0.5));
+        s.world.add(make_shared<rt::sphere>(center, radius, material));
+    }
+
+    cam.vfov = 40;
+    cam.lookfrom = rt::vec3(0, 20, 160);
+    cam.lookat = rt::vec3(0,0,0);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// count small spheres gathered into a few tight clusters with empty space between them, the
+// case a single uniform grid handles badly.
+void clustered_spheres_scene(scene& s, rt::camera& cam, int count) {
+    const int clusters = 8;
+    auto material = make_shared<rt::lambertian>(rt::vec3(0.6, 0.6, 0.6));
+    s.edit_diffuse = material;
+
+    std::vector<rt::vec3> centers;
+    for (int c = 0; c < clusters; c++)
+        centers.push_back(100 * (rt::vec3::random() - rt::vec3(0.5, 0.5, 0.5)));
+
+    for (int k = 0; k < count; k++) {
+        auto center = centers[k % clusters]
+                    + 3 * std::cbrt(rt::random_double()) * rt::random_unit_vector();
+        s.world.add(make_shared<rt::sphere>(center, 0.1, material));
+    }
+
+    cam.vfov = 40;
+    cam.lookfrom = rt::vec3(0, 20, 160);
+    cam.lookat = rt::vec3(0,0,0);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// Spheres with heavy-tailed radii over a huge ground sphere, so many large objects overlap
+// each other and the small ones: the case spatial splits are meant for.
+void overlapping_spheres_scene(scene& s, rt::camera& cam, int count) {
+    auto material = make_shared<rt::lambertian>(rt::vec3(0.6, 0.6, 0.6));
+    s.edit_diffuse = material;
+    s.world.add(make_shared<rt::sphere>(rt::vec3(0, -1050, 0), 1000, material));
+
+    for (int k = 0; k < count; k++) {
+        auto center = 100 * (rt::vec3::random() - rt::vec3(0.5, 0.5, 0.5));
+        auto radius = 0.5 * std::pow(40.0, std::pow(rt::random_double(), 4));
+        s.world.add(make_shared<rt::sphere>(center, radius, material));
+    }
+
+    cam.vfov = 40;
+    cam.lookfrom = rt::vec3(0, 20, 160);
+    cam.lookat = rt::vec3(0,0,0);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// count hair strands growing out of a ball, each a curve drooping under its own weight.
+void hair_scene(scene& s, rt::camera& cam, int count) {
+    auto skin = make_shared<rt::lambertian>(rt::vec3(0.6, 0.45, 0.35));
+    auto hair = make_shared<rt::lambertian>(rt::vec3(0.35, 0.2, 0.08));
+    s.world.add(make_shared<rt::sphere>(rt::vec3(0,0,0), 1.0, skin));
+    s.world.add(make_shared<rt::sphere>(rt::vec3(0,-1001.2,0), 1000,
+                                        make_shared<rt::lambertian>(rt::vec3(0.5, 0.5, 0.5))));
+    s.edit_diffuse = hair;
+
+    for (int k = 0; k < count; k++) {
+        auto n = rt::random_unit_vector();
+        if (n.y() < -0.2)
+            n[1] = -n.y();
+        auto length = 0.4 + 0.2 * rt::random_double();
+        auto down = rt::vec3(0, -length, 0);
+        rt::point3 control[4] = {
+            n,
+            n + (length / 3) * n,
+            n + (2 * length / 3) * n + 0.3 * down,
+            n + length * n + 0.8 * down + 0.05 * rt::random_unit_vector(),
+        };
+        rt::add_curve(s.world, control, 0.004, 0.001, hair);
+    }
+
+    cam.vfov = 35;
+    cam.lookfrom = rt::vec3(0, 1, 4.5);
+    cam.lookat = rt::vec3(0,0,0);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// Procedural shapes marched through their distance fields: a Menger sponge and a cluster of
+// glass blobs melted together, on the book's ground.
+void sdf_scene(scene& s, rt::camera& cam) {
+    auto ground = make_shared<rt::lambertian>(rt::vec3(0.5, 0.5, 0.5));
+    s.world.add(make_shared<rt::sphere>(rt::vec3(0,-1000,0), 1000, ground));
+
+    auto sponge_material = make_shared<rt::lambertian>(rt::vec3(0.7, 0.4, 0.2));
+    auto sponge = make_shared<rt::sdf>(
+        make_shared<rt::sdf_menger>(rt::vec3(-1.6, 1, 0), 1.0, 4), sponge_material);
+    s.world.add(sponge);
+    s.sdfs.push_back(sponge);
+    s.edit_diffuse = sponge_material;
+
+    std::vector<rt::point3> centers;
+    std::vector<double> radii;
+    for (int k = 0; k < 7; k++) {
+        centers.push_back(rt::vec3(1.6, 1, 0) + 0.6 * rt::random_unit_vector());
+        radii.push_back(0.3 + 0.2 * rt::random_double());
+    }
+    auto blobs = make_shared<rt::sdf>(make_shared<rt::sdf_blobs>(centers, radii, 0.4),
+                                      make_shared<rt::dielectric>(1.5));
+    s.world.add(blobs);
+    s.caustic_casters.add(blobs);
+    s.sdfs.push_back(blobs);
+
+    auto chrome = make_shared<rt::metal>(rt::vec3(0.8, 0.8, 0.8), 0.05);
+    auto ball = make_shared<rt::sphere>(rt::vec3(0, 0.5, 2), 0.5, chrome);
+    s.world.add(ball);
+    s.caustic_casters.add(ball);
+    s.edit_metal = chrome;
+
+    cam.vfov = 30;
+    cam.lookfrom = rt::vec3(0, 2.5, 9);
+    cam.lookat = rt::vec3(0, 0.8, 0);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// A voxel scan next to ordinary spheres: loaded from voxel_file when one is given, otherwise a
+// procedural rock with layers of three materials.
+void voxel_scene(scene& s, rt::camera& cam, const char* voxel_file) {
+    auto ground = make_shared<rt::lambertian>(rt::vec3(0.5, 0.5, 0.5));
+    s.world.add(make_shared<rt::sphere>(rt::vec3(0,-1000,0), 1000, ground));
+
+    shared_ptr<rt::voxel_grid> rock;
+    if (voxel_file) {
+        std::ifstream in(voxel_file, std::ios::binary);
+        rock = rt::voxel_grid::load(in);
+    } else {
+        const int n = 96;
+        rock = make_shared<rt::voxel_grid>(n, n, n, 3.0 / n, rt::point3(-1.5, 0, -1.5));
+        for (int z = 0; z < n; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    auto p = (rt::vec3(x, y, z) + rt::vec3(0.5, 0.5, 0.5)) / n - rt::vec3(0.5, 0.3, 0.5);
+                    auto bumps = 0.04 * (std::sin(17 * p.x()) + std::sin(23 * p.y() + 1)
+                                       + std::sin(19 * p.z() + 2));
+                    if (p.length() < 0.4 + bumps)
+                        rock->set(x, y, z, uint8_t(1 + (y / 12) % 3));
+                }
+            }
+        }
+    }
+
+    s.edit_diffuse = make_shared<rt::lambertian>(rt::vec3(0.45, 0.3, 0.2));
+    rock->set_material(1, s.edit_diffuse);
+    rock->set_material(2, make_shared<rt::lambertian>(rt::vec3(0.6, 0.55, 0.45)));
+    rock->set_material(3, make_shared<rt::lambertian>(rt::vec3(0.25, 0.25, 0.3)));
+    s.world.add(rock);
+
+    s.edit_metal = make_shared<rt::metal>(rt::vec3(0.7, 0.6, 0.5), 0.0);
+    auto mirror = make_shared<rt::sphere>(rt::vec3(2.8, 1, 0), 1.0, s.edit_metal);
+    s.world.add(mirror);
+    s.caustic_casters.add(mirror);
+    auto glass = make_shared<rt::sphere>(rt::vec3(-2.8, 1, 0), 1.0, make_shared<rt::dielectric>(1.5));
+    s.world.add(glass);
+    s.caustic_casters.add(glass);
+
+    cam.vfov = 30;
+    cam.lookfrom = rt::vec3(0, 3, 11);
+    cam.lookat = rt::vec3(0, 1, 0);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// A kilometre of terrain at one sample per metre, traced straight from its heights: loaded
+// from a square raw 16-bit height image when one is given, otherwise procedural hills made
+// of a few octaves of value noise.
+void terrain_scene(scene& s, rt::camera& cam, const char* height_file) {
+    const double spacing = 1.0;
+    const double relief = 160.0;
+    auto rock = make_shared<rt::lambertian>(rt::vec3(0.45, 0.4, 0.32));
+    s.edit_diffuse = rock;
+
+    auto centred = [&](int n) {
+        return rt::point3(-0.5 * (n - 1) * spacing, 0, -0.5 * (n - 1) * spacing);
+    };
+
+    shared_ptr<rt::heightfield> terrain;
+    if (height_file) {
+        std::ifstream in(height_file, std::ios::binary | std::ios::ate);
+        auto samples = double(in.tellg()) / sizeof(uint16_t);
+        int n = int(std::lround(std::sqrt(samples)));
+        in.seekg(0);
+        terrain = rt::heightfield::load_raw(in, n, n, spacing, relief, centred(n), rock);
+    } else {
+        const int n = 1025;
+        const int lattice = 256;
+        std::vector<double> noise(lattice * lattice);
+        for (auto& value : noise)
+            value = rt::random_double();
+        auto value_noise = [&](double x, double z) {
+            auto fx = std::floor(x), fz = std::floor(z);
+            int ix = int(fx) & (lattice - 1), iz = int(fz) & (lattice - 1);
+            int jx = (ix + 1) & (lattice - 1), jz = (iz + 1) & (lattice - 1);
+            auto u = x - fx, v = z - fz;
+            u = u * u * (3 - 2 * u);
+            v = v * v * (3 - 2 * v);
+            auto a = noise[iz * lattice + ix], b = noise[iz * lattice + jx];
+            auto c = noise[jz * lattice + ix], d = noise[jz * lattice + jx];
+            return (1 - v) * ((1 - u) * a + u * b) + v * ((1 - u) * c + u * d);
+        };
+
+        std::vector<float> heights(size_t(n) * n);
+        for (int z = 0; z < n; z++) {
+            for (int x = 0; x < n; x++) {
+                double h = 0, amplitude = 0.5, frequency = 1.0 / 256;
+                for (int octave = 0; octave < 8; octave++) {
+                    h += amplitude * value_noise(x * frequency, z * frequency);
+                    amplitude *= 0.5;
+                    frequency *= 2;
+                }
+                heights[size_t(z) * n + x] = float(relief * h * h);
+            }
+        }
+        terrain = make_shared<rt::heightfield>(n, n, std::move(heights), spacing, centred(n),
+                                               rock);
+    }
+    s.world.add(terrain);
+
+    cam.vfov = 45;
+    cam.lookfrom = rt::vec3(0, 320, 620);
+    cam.lookat = rt::vec3(0, 0, -80);
+    cam.vup = rt::vec3(0,1,0);
+}
+
+// A planet inside a ring of count tiny ice particles, or the particle dump in particle_file;
+// either way no sphere objects are made for the particles. With quantize their positions are
+// kept as 16-bit fractions of their BVH leaves. A nonzero page_cache_bytes traces them out of
+// core instead, from a paged copy of the cloud written next to the dump on first use, with
+// at most that many bytes of blocks in memory.
+void particle_scene(scene& s, rt::camera& cam, int count, const char* particle_file,
+                    bool quantize, size_t page_cache_bytes)
+{
+    auto planet = make_shared<rt::lambertian>(rt::vec3(0.7, 0.5, 0.3));
+    s.world.add(make_shared<rt::sphere>(rt::vec3(0,0,0), 1.0, planet));
+    s.edit_diffuse = planet;
+
+    std::vector<shared_ptr<rt::material>> palette = {
+        make_shared<rt::lambertian>(rt::vec3(0.8, 0.8, 0.75)),
+        make_shared<rt::lambertian>(rt::vec3(0.6, 0.55, 0.5)),
+        make_shared<rt::lambertian>(rt::vec3(0.4, 0.4, 0.45)),
+    };
+
+    cam.vfov = 40;
+    cam.lookfrom = rt::vec3(0, 1.8, 7.5);
+    cam.lookat = rt::vec3(0,0,0);
+    cam.vup = rt::vec3(0,1,0);
+
+    auto start = std::chrono::steady_clock::now();
+    std::string pages_file = std::string(particle_file ? particle_file : "particles") + ".pages";
+    auto open_pages = [&]() {
+        s.paged_particles = make_shared<rt::paged_particle_cloud>(pages_file, palette,
+                                                                  page_cache_bytes);
+        std::cout << "Particles: " << s.paged_particles->size() << " out of core from "
+                  << pages_file << ", " << s.paged_particles->block_count() << " blocks, "
+                  << page_cache_bytes / (1024 * 1024) << " MB cache" << std::endl;
+        s.world.add(s.paged_particles);
+    };
+    if (page_cache_bytes > 0 && std::ifstream(pages_file).good()) {
+        open_pages();
+        return;
+    }
+
+    shared_ptr<rt::particle_cloud> ring;
+    if (particle_file) {
+        ring = rt::particle_cloud::load(particle_file, palette, quantize && !page_cache_bytes);
+    } else {
+        std::vector<rt::particle_record> particles(count);
+        for (auto& p : particles) {
+            auto radius = std::sqrt(rt::random_double(1.5 * 1.5, 3.0 * 3.0));
+            auto angle = 2 * rt::pi * rt::random_double();
+            p.position[0] = float(radius * std::cos(angle));
+            p.position[1] = float(0.03 * (rt::random_double() - 0.5));
+            p.position[2] = float(radius * std::sin(angle));
+            p.radius = float(0.003 + 0.006 * rt::random_double());
+            p.material = uint32_t(3 * rt::random_double());
+        }
+        ring = make_shared<rt::particle_cloud>(particles.data(), particles.size(), palette,
+                                               quantize && !page_cache_bytes);
+    }
+
+    if (page_cache_bytes > 0) {
+        {
+            std::ofstream out(pages_file, std::ios::binary);
+            rt::write_paged_particles(out, *ring);
+        }
+        std::cout << "Particles: wrote " << pages_file << std::endl;
+        ring.reset();
+        open_pages();
+        return;
+    }
+
+    auto seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::cout << "Particles: " << ring->size() << " ready in " << seconds << " s, "
+              << ring->memory_bytes() / (1024.0 * 1024.0) << " MB"
+              << (quantize ? " (quantized)" : "") << std::endl;
+    s.world.add(ring);
+}
+
+void report_sdf_steps(const scene& s) {
+    for (const auto& shape : s.sdfs) {
+        std::cout << "SDF: " << shape->steps_per_ray() << " steps per ray over " << shape->rays()
+                  << " rays, " << shape->relaxation_misses() << " relaxation fallbacks" << std::endl;
+    }
+}
+
+// Headless report of acceleration structure size and single-threaded traversal speed over
+// the current scene. Small scenes are checked against the plain object list, large ones
+// against the binary BVH.
+void benchmark_accelerators(const scene& s, rt::camera cam) {
+    const int width = 200;
+    const int height = 112;
+    cam.image_width = width;
+    cam.aspect_ratio = double(width) / height;
+    cam.initialize();
+
+    auto primitives = s.world.objects.size();
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto report_build = [&](const char* name, const rt::bvh& tree, double seconds) {
+        std::cout << name << " built in " << seconds << "s, SAH cost " << tree.sah_cost()
+                  << ", " << tree.reference_count() << " references" << std::endl;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    rt::bvh binary(s.world);
+    report_build("bvh", binary, seconds_since(start));
+
+    rt::bvh_options spatial;
+    spatial.spatial_splits = true;
+    start = std::chrono::steady_clock::now();
+    rt::bvh split(s.world, spatial);
+    report_build("sbvh", split, seconds_since(start));
+
+    auto report_grid = [&](const char* name, const rt::grid& g, double seconds) {
+        std::cout << name << " built in " << seconds << "s, " << g.cell_count() << " cells, "
+                  << g.sub_grid_count() << " sub-grids" << std::endl;
+    };
+
+    start = std::chrono::steady_clock::now();
+    rt::grid uniform(s.world);
+    report_grid("grid", uniform, seconds_since(start));
+
+    rt::grid_options nested;
+    nested.two_level = true;
+    start = std::chrono::steady_clock::now();
+    rt::grid two_level(s.world, nested);
+    report_grid("two-level grid", two_level, seconds_since(start));
+
+    start = std::chrono::steady_clock::now();
+    rt::kd_tree kd(s.world);
+    std::cout << "kd-tree built in " << seconds_since(start) << "s (" << kd.node_count()
+              << " nodes)" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    rt::compressed_bvh compressed(binary);
+    std::cout << "compressed bvh built in " << seconds_since(start) << "s ("
+              << compressed.node_count() << " nodes)" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    rt::bucketed_bvh bucketed(binary);
+    std::cout << "bucketed bvh built in " << seconds_since(start) << "s" << std::endl;
+
+    const rt::hittable& reference = (primitives <= 5000) ? (const rt::hittable&)s.world
+                                                         : (const rt::hittable&)binary;
+    rt::accelerator_bench bench(reference, cam, width, height, 100000);
+    std::cout << primitives << " primitives, " << bench.ray_count() << " rays" << std::endl;
+
+    bench.run("bvh", binary, binary.memory_bytes(), primitives);
+    bench.run("sbvh", split, split.memory_bytes(), primitives);
+    bench.run("compressed bvh (4-wide)", compressed, compressed.memory_bytes(), primitives);
+    bench.run("bucketed bvh", bucketed, bucketed.memory_bytes(), primitives);
+    bench.run("grid", uniform, uniform.memory_bytes(), primitives);
+    bench.run("two-level grid", two_level, two_level.memory_bytes(), primitives);
+    bench.run("kd-tree", kd, kd.memory_bytes(), primitives);
+}
+
+// Primary rays of a full frame traced against the whole scene BVH and against the per-tile
+// candidate BVHs, checking that both find the same hits.
+void benchmark_primary_culling(const scene& s, rt::camera cam) {
+    const int width = 800;
+    const int height = 450;
+    cam.image_width = width;
+    cam.aspect_ratio = double(width) / height;
+    cam.initialize();
+
+    rt::bvh world(s.world);
+    auto start = std::chrono::steady_clock::now();
+    rt::tile_culling tiles(world, cam, width, height);
+    std::chrono::duration<double> build = std::chrono::steady_clock::now() - start;
+    std::cout << "tile candidates built in " << build.count() << "s, "
+              << tiles.average_candidates() << " of " << s.world.objects.size()
+              << " objects per tile on average" << std::endl;
+
+    std::vector<rt::ray> rays;
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+            rays.push_back(cam.get_ray(i, j));
+
+    auto trace = [&](bool culled, int& hits, std::vector<double>& t) {
+        t.assign(rays.size(), rt::infinity);
+        hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                rt::hit_record rec;
+                const rt::hittable& target = culled ? tiles.candidates(i, j) : (const rt::hittable&)world;
+                if (target.hit(rays[j * width + i], rt::interval(0.001, rt::infinity), rec)) {
+                    t[j * width + i] = rec.t;
+                    hits++;
+                }
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return rays.size() / elapsed.count();
+    };
+
+    int hits_full, hits_culled;
+    std::vector<double> t_full, t_culled;
+    auto rate_full = trace(false, hits_full, t_full);
+    auto rate_culled = trace(true, hits_culled, t_culled);
+
+    int mismatches = 0;
+    for (size_t k = 0; k < rays.size(); k++)
+        if (t_full[k] != t_culled[k])
+            mismatches++;
+
+    std::cout << "primary rays, whole scene:     " << rate_full * 1e-6 << " Mrays/s" << std::endl;
+    std::cout << "primary rays, tile candidates: " << rate_culled * 1e-6 << " Mrays/s, "
+              << mismatches << " mismatches" << std::endl;
+}
+
+// Storage formats for radiance, judged against the noise they store: a frame is accumulated
+// one path sample per pixel at a time into each format and into doubles, and the rms error
+// of the stored mean is compared with the rms standard error of the mean itself. Each format
+// accumulates twice: a whole frame per sample, as the ReSTIR preview does, and one 32x32
+// tile at a time through all its samples, as a bucket renderer would. Memory is the peak
+// reached while accumulating, staging tiles included.
+void benchmark_framebuffer_formats(const scene& s, rt::camera cam) {
+    const int width = 400;   // 104 tiles, more than hdr_buffer stages at once.
+    const int height = 225;
+    const int frames = 32;
+    cam.image_width = width;
+    cam.aspect_ratio = double(width) / height;
+    cam.initialize();
+    rt::bvh world(s.world);
+
+    std::vector<rt::vec3> samples(size_t(frames) * width * height);
+    std::vector<rt::vec3> sum(width * height), sum_squares(width * height);
+    for (int f = 0; f < frames; f++) {
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                auto c = ray_color(cam.get_ray(i, j), world, 10);
+                samples[(size_t(f) * height + j) * width + i] = c;
+                sum[j * width + i] += c;
+                sum_squares[j * width + i] += c * c;
+            }
+        }
+    }
+    auto sample = [&](int f, int i, int j) {
+        return samples[(size_t(f) * height + j) * width + i];
+    };
+
+    double noise = 0;
+    for (int p = 0; p < width * height; p++) {
+        auto mean = sum[p] / frames;
+        auto variance = sum_squares[p] / frames - mean * mean;
+        noise += (variance.x() + variance.y() + variance.z()) / frames;
+    }
+    noise = std::sqrt(noise / (3.0 * width * height));
+
+    // Memory as the compact pixels, which grow with the image, plus the peak staging, which
+    // does not.
+    auto report = [&](const std::string& name, const rt::hdr_buffer& buffer,
+                      double bytes_per_pixel, double staging_bytes) {
+        double error = 0;
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                auto d = (buffer.get(i, j) - sum[j * width + i]) / frames;
+                error += d.length_squared();
+            }
+        }
+        error = std::sqrt(error / (3.0 * width * height));
+        std::printf("%-18s %2.0f bytes/pixel + %4.2f MB staging, %4.0f MB at 8K, "
+                    "error %.2e = %.3f of the noise\n",
+                    name.c_str(), bytes_per_pixel, staging_bytes / 1e6,
+                    (bytes_per_pixel * 7680 * 4320 + staging_bytes) / 1e6, error, error / noise);
+    };
+
+    std::cout << "framebuffer formats, " << frames << " samples per pixel accumulated:"
+              << std::endl;
+    std::printf("%-18s %2d bytes/pixel, %4.0f MB at 8K\n", "double (before)",
+                int(sizeof(rt::vec3)), sizeof(rt::vec3) * 7680.0 * 4320 / 1e6);
+
+    const int tile = rt::hdr_buffer::tile_size;
+    for (auto format : { rt::pixel_format::float32, rt::pixel_format::half,
+                         rt::pixel_format::rgb9e5 }) {
+        rt::hdr_buffer by_frame(width, height, format), by_tile(width, height, format);
+        for (int f = 0; f < frames; f++)
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                    by_frame.add(i, j, sample(f, i, j));
+        for (int j0 = 0; j0 < height; j0 += tile)
+            for (int i0 = 0; i0 < width; i0 += tile)
+                for (int f = 0; f < frames; f++)
+                    for (int j = j0; j < std::min(j0 + tile, height); j++)
+                        for (int i = i0; i < std::min(i0 + tile, width); i++)
+                            by_tile.add(i, j, sample(f, i, j));
+
+        for (auto* buffer : { &by_frame, &by_tile }) {
+            auto peak = double(buffer->peak_memory_bytes());
+            buffer->flush();
+            auto compact = double(buffer->memory_bytes());
+            report(std::string(rt::pixel_format_name(format))
+                       + (buffer == &by_frame ? ", by frame" : ", by tile"),
+                   *buffer, compact / (width * height), peak - compact);
+        }
+    }
+
+    // The half format rounding every addition straight in, to show what staging buys.
+    rt::hdr_buffer unstaged(width, height, rt::pixel_format::half);
+    for (int f = 0; f < frames; f++)
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+                unstaged.set(i, j, unstaged.get(i, j) + sample(f, i, j));
+    report("half, unstaged", unstaged, 6, 0);
+
+    // The interactive preview's running sum: a whole frame per addition, for as many frames as
+    // it is left open. The stored frames are replayed in turn, so the exact mean stays known,
+    // while the noise it is held against is that of the frames added so far.
+    std::cout << "progressive whole-frame sum, error relative to the noise at that many frames:"
+              << std::endl;
+    for (auto format : { rt::pixel_format::float32, rt::pixel_format::half,
+                         rt::pixel_format::rgb9e5 }) {
+        rt::hdr_buffer running(width, height, format);
+        std::printf("%-18s", rt::pixel_format_name(format));
+        for (int f = 1, checkpoint = 256; f <= 2048; f++) {
+            for (int j = 0; j < height; j++)
+                for (int i = 0; i < width; i++)
+                    running.add(i, j, sample((f - 1) % frames, i, j));
+            if (f != checkpoint)
+                continue;
+            double error = 0;
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto d = running.get(i, j) / f - sum[j * width + i] / frames;
+                    error += d.length_squared();
+                }
+            }
+            error = std::sqrt(error / (3.0 * width * height));
+            std::printf("  %4d frames %7.3f", f, error / (noise * std::sqrt(double(frames) / f)));
+            checkpoint *= 2;
+        }
+        std::printf("\n");
+    }
+}
+
+// Speed of the display pass over a 1080p HDR image, per tone curve, against mapping one
+// pixel at a time the way the render threads do, which must give the same bytes.
+void benchmark_tone_mapping() {
+    const int width = 1920;
+    const int height = 1080;
+    std::vector<rt::vec3> hdr(size_t(width) * height);
+    for (auto& v : hdr)
+        v = 4 * rt::random_double() * rt::random_double() * rt::vec3::random();
+    std::vector<Color> mapped(hdr.size()), single(hdr.size());
+
+    rt::tone_mapper mapper;
+    for (auto curve : { rt::tone_curve::clamp, rt::tone_curve::reinhard, rt::tone_curve::aces }) {
+        mapper.curve = curve;
+
+        auto start = std::chrono::steady_clock::now();
+        const int passes = 10;
+        for (int k = 0; k < passes; k++)
+            mapper.apply(hdr.data(), 1.0, &mapped[0].r, width, height);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+                mapper.map(hdr[size_t(j) * width + i], i, j, &single[size_t(j) * width + i].r);
+        std::chrono::duration<double> one_by_one = std::chrono::steady_clock::now() - start;
+
+        int mismatches = 0;
+        for (size_t p = 0; p < hdr.size(); p++)
+            if (std::memcmp(&mapped[p], &single[p], sizeof(Color)) != 0)
+                mismatches++;
+
+        std::cout << "tone mapping 1080p, " << rt::tone_curve_name(curve) << ": "
+                  << elapsed.count() / passes * 1e3 << " ms, per pixel "
+                  << one_by_one.count() * 1e3 << " ms, " << mismatches << " mismatches"
+                  << std::endl;
+    }
+}
+
+// Splatting to arbitrary pixels from every thread at once, as light tracing and BDPT do: into
+// a splat_buffer, reduced at the end, and with atomic float adds straight into one shared
+// image. Splats either land uniformly over the frame or in small clusters, the way light
+// paths focused by a caustic do. The two images are checked against each other.
+void benchmark_splatting() {
+    const int width = 800;
+    const int height = 450;
+    const int count = 4000000;
+
+    struct splat { float x, y, r, g, b; };
+    for (bool clustered : { false, true }) {
+        std::vector<splat> splats(count);
+        double cx = 0, cy = 0;
+        for (int k = 0; k < count; k++) {
+            if (k % 64 == 0) {
+                cx = rt::random_double(0, width);
+                cy = rt::random_double(0, height);
+            }
+            auto x = clustered ? cx + 4 * (rt::random_double() - 0.5) : rt::random_double(0, width);
+            auto y = clustered ? cy + 4 * (rt::random_double() - 0.5) : rt::random_double(0, height);
+            splats[k] = { float(x), float(y), float(rt::random_double()),
+                          float(rt::random_double()), float(rt::random_double()) };
+        }
+
+        rt::splat_buffer buffer(width, height, rt::thread_count());
+        std::vector<rt::vec3> tiled;
+        auto start = std::chrono::steady_clock::now();
+        buffer.clear();
+        rt::parallel_for(count, [&](int thread, int begin, int end) {
+            for (int k = begin; k < end; k++)
+                buffer.add(thread, splats[k].x, splats[k].y,
+                           rt::color(splats[k].r, splats[k].g, splats[k].b));
+        });
+        buffer.reduce(tiled);
+        std::chrono::duration<double> tiled_time = std::chrono::steady_clock::now() - start;
+
+        std::vector<std::atomic<float>> shared(3 * size_t(width) * height);
+        for (auto& value : shared)
+            value.store(0, std::memory_order_relaxed);
+        auto atomic_add = [](std::atomic<float>& target, float value) {
+            float old = target.load(std::memory_order_relaxed);
+            while (!target.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+        };
+        start = std::chrono::steady_clock::now();
+        rt::parallel_for(count, [&](int, int begin, int end) {
+            for (int k = begin; k < end; k++) {
+                if (splats[k].x < 0 || splats[k].x >= width || splats[k].y < 0
+                    || splats[k].y >= height)
+                    continue;
+                size_t p = size_t(int(splats[k].y)) * width + int(splats[k].x);
+                atomic_add(shared[3 * p], splats[k].r);
+                atomic_add(shared[3 * p + 1], splats[k].g);
+                atomic_add(shared[3 * p + 2], splats[k].b);
+            }
+        });
+        std::chrono::duration<double> atomic_time = std::chrono::steady_clock::now() - start;
+
+        double largest_error = 0;
+        for (size_t p = 0; p < tiled.size(); p++)
+            for (int c = 0; c < 3; c++)
+                largest_error = std::fmax(largest_error, std::fabs(tiled[p][c]
+                                                                   - shared[3 * p + c].load()));
+
+        std::cout << "splatting " << (clustered ? "clustered" : "uniform") << ", "
+                  << rt::thread_count() << " threads: tiles " << count / tiled_time.count() / 1e6
+                  << " M/s (" << buffer.memory_bytes() / 1e6 << " MB), atomics "
+                  << count / atomic_time.count() / 1e6 << " M/s, largest difference "
+                  << largest_error << std::endl;
+    }
+}
+
+// Time to the first frame of primary rays with the whole bvh built up front and with a
+// lazy_bvh that builds subtrees as rays reach them, traced on all threads.
+void benchmark_lazy_build(const scene& s, rt::camera cam) {
+    const int width = 800;
+    const int height = 450;
+    cam.image_width = width;
+    cam.aspect_ratio = double(width) / height;
+    cam.initialize();
+
+    std::vector<rt::ray> rays;
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+            rays.push_back(cam.get_ray(i, j));
+
+    auto frame = [&](const rt::hittable& world, std::vector<double>& t) {
+        t.assign(rays.size(), rt::infinity);
+        rt::parallel_for(height, [&](int, int begin, int end) {
+            for (size_t k = size_t(begin) * width; k < size_t(end) * width; k++) {
+                rt::hit_record rec;
+                if (world.hit(rays[k], rt::interval(0.001, rt::infinity), rec))
+                    t[k] = rec.t;
+            }
+        });
+    };
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    std::vector<double> t_full, t_lazy;
+    auto start = std::chrono::steady_clock::now();
+    rt::bvh full(s.world);
+    auto full_build = seconds_since(start);
+    frame(full, t_full);
+    auto full_first = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    rt::lazy_bvh lazy(s.world);
+    auto lazy_build = seconds_since(start);
+    frame(lazy, t_lazy);
+    auto lazy_first = seconds_since(start);
+    auto built = lazy.subtrees_built();
+
+    start = std::chrono::steady_clock::now();
+    frame(lazy, t_lazy);
+    auto lazy_again = seconds_since(start);
+
+    int mismatches = 0;
+    for (size_t k = 0; k < rays.size(); k++)
+        if (t_full[k] != t_lazy[k])
+            mismatches++;
+
+    std::cout << "first frame, full bvh: " << full_build << "s build, " << full_first
+              << "s to first frame" << std::endl;
+    std::cout << "first frame, lazy bvh: " << lazy_build << "s build, " << lazy_first
+              << "s to first frame, " << built << " of " << lazy.subtree_count()
+              << " subtrees built, " << lazy_again << "s next frame, " << mismatches
+              << " mismatches" << std::endl;
+}
+
+// Block traffic of out-of-core particles over the primary rays, traced one ray at a time in
+// scanline order and then in batches deferred by block, each from an empty cache.
+void benchmark_out_of_core(const scene& s, rt::camera cam) {
+    if (!s.paged_particles)
+        return;
+    auto& cloud = *s.paged_particles;
+
+    const int width = 800;
+    const int height = 450;
+    const size_t batch_size = 1 << 16;
+    cam.image_width = width;
+    cam.aspect_ratio = double(width) / height;
+    cam.initialize();
+
+    std::vector<rt::ray> rays;
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+            rays.push_back(cam.get_ray(i, j));
+
+    // Pixel order is as coherent as rays get; shuffled, they arrive the way bounced rays do.
+    auto compare = [&](const char* label, const std::vector<rt::ray>& order) {
+        std::vector<double> t_single(order.size(), rt::infinity);
+        std::vector<double> t_batched(order.size(), rt::infinity);
+
+        cloud.clear_cache();
+        cloud.reset_stats();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < order.size(); k++) {
+            rt::hit_record rec;
+            if (cloud.hit(order[k], rt::interval(0.001, rt::infinity), rec))
+                t_single[k] = rec.t;
+        }
+        std::chrono::duration<double> single = std::chrono::steady_clock::now() - start;
+        auto single_loads = cloud.block_loads();
+
+        cloud.clear_cache();
+        cloud.reset_stats();
+        start = std::chrono::steady_clock::now();
+        std::vector<rt::ray> batch;
+        std::vector<rt::hit_record> recs;
+        std::vector<char> found;
+        for (size_t first = 0; first < order.size(); first += batch_size) {
+            auto last = std::min(order.size(), first + batch_size);
+            batch.assign(order.begin() + first, order.begin() + last);
+            cloud.trace_batch(batch, rt::interval(0.001, rt::infinity), recs, found);
+            for (size_t k = 0; k < batch.size(); k++)
+                if (found[k])
+                    t_batched[first + k] = recs[k].t;
+        }
+        std::chrono::duration<double> batched = std::chrono::steady_clock::now() - start;
+
+        int mismatches = 0;
+        for (size_t k = 0; k < order.size(); k++)
+            if (t_single[k] != t_batched[k])
+                mismatches++;
+
+        std::cout << "  " << label << ":" << std::endl;
+        std::cout << "    ray at a time: " << single_loads << " block loads, "
+                  << order.size() / single.count() * 1e-6 << " Mrays/s" << std::endl;
+        std::cout << "    deferred:      " << cloud.block_loads() << " block loads, "
+                  << order.size() / batched.count() * 1e-6 << " Mrays/s, "
+                  << mismatches << " mismatches" << std::endl;
+    };
+
+    std::cout << "out of core, " << cloud.block_count() << " blocks:" << std::endl;
+    compare("pixel order", rays);
+    std::shuffle(rays.begin(), rays.end(), std::mt19937(1));
+    compare("shuffled", rays);
+}
+
+double rmse(const std::vector<rt::vec3>& image, const std::vector<rt::vec3>& reference) {
+    double sum = 0;
+    for (size_t p = 0; p < image.size(); p++)
+        sum += (image[p] - reference[p]).length_squared() / 3;
+    return std::sqrt(sum / image.size());
+}
+
+// Headless equal-time comparison: renders a converged path traced reference, then gives each
+// integrator the same wall-clock budget and reports its RMSE against the reference.
+void compare_integrators(const scene& s, rt::camera cam, int max_depth,
+                         double seconds, int reference_samples)
+{
+    const int width = 200;
+    const int height = 112;
+    cam.image_width = width;
+    cam.aspect_ratio = double(width) / height;
+    cam.initialize();
+
+    rt::bvh world(s.world);
+    rt::bdpt_integrator bdpt(world, s.lights, cam);
+    bdpt.max_depth = max_depth;
+
+    auto path_pass = [&](std::vector<rt::vec3>& sum, rt::splat_buffer&) {
+        rt::parallel_for(height, [&](int, int begin, int end) {
+            for (int j = begin; j < end; j++)
+                for (int i = 0; i < width; i++)
+                    sum[j * width + i] += ray_color(cam.get_ray(i, j), world, max_depth);
+        });
+    };
+
+    auto bdpt_pass = [&](std::vector<rt::vec3>& sum, rt::splat_buffer& splats) {
+        rt::parallel_for(height, [&](int thread, int begin, int end) {
+            for (int j = begin; j < end; j++)
+                for (int i = 0; i < width; i++)
+                    sum[j * width + i] += bdpt.sample(i, j, splats, thread);
+        });
+    };
+
+    // Runs passes until the time budget is used up (or for max_passes when budget <= 0) and
+    // returns the averaged image, light-image splats included.
+    auto render = [&](auto pass, double budget, int max_passes, int& passes) {
+        std::vector<rt::vec3> sum(width * height), light_image;
+        rt::splat_buffer splats(width, height, rt::thread_count());
+        auto start = std::chrono::steady_clock::now();
+        passes = 0;
+        while (true) {
+            pass(sum, splats);
+            passes++;
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (budget > 0 ? elapsed.count() >= budget : passes >= max_passes)
+                break;
+        }
+        splats.reduce(light_image, 1.0 / passes);
+        for (size_t p = 0; p < sum.size(); p++)
+            sum[p] = sum[p] / passes + light_image[p];
+        return sum;
+    };
+
+    int passes;
+    std::cout << "Rendering reference (" << reference_samples << " spp path traced)..." << std::endl;
+    auto reference = render(path_pass, 0, reference_samples, passes);
+
+    auto path_image = render(path_pass, seconds, 0, passes);
+    std::cout << "path: " << passes << " spp in " << seconds << "s, RMSE "
+              << rmse(path_image, reference) << std::endl;
+
+    auto bdpt_image = render(bdpt_pass, seconds, 0, passes);
+    std::cout << "bdpt: " << passes << " spp in " << seconds << "s, RMSE "
+              << rmse(bdpt_image, reference) << std::endl;
+}
+
+// Compares the reconstruction filters. First on a zone plate, cos(k r^2), whose frequency
+// grows with the distance from its center, sampled straight through each filter: how much
+// contrast survives well below the Nyquist limit, where the pattern should stay, and how much
+// remains well above it, where anything left is aliasing. Then on the scene: the RMSE of a
+// 16 spp render against a converged render with the same filter, which is the noise the
+// filter costs, and the time per sample.
+void compare_filters(const scene& s, rt::camera cam, int max_depth, int reference_samples) {
+    const rt::filter_type types[] = { rt::filter_type::box, rt::filter_type::gaussian,
+                                      rt::filter_type::mitchell, rt::filter_type::blackman_harris };
+
+    const int plate_size = 256, plate_samples = 256;
+    const double nyquist_radius = 90;   // Where the plate reaches half a cycle per pixel.
+    const double k = rt::pi / (2 * nyquist_radius);
+    for (auto type : types) {
+        const auto& f = rt::pixel_filter::get(type);
+        std::vector<double> plate(plate_size * plate_size);
+        rt::parallel_for(plate_size, [&](int, int begin, int end) {
+            for (int j = begin; j < end; j++) {
+                for (int i = 0; i < plate_size; i++) {
+                    double sum = 0;
+                    for (int n = 0; n < plate_samples; n++) {
+                        double weight;
+                        auto offset = f.sample(rt::random_double(), rt::random_double(), weight);
+                        auto x = i + offset.x() - plate_size / 2;
+                        auto y = j + offset.y() - plate_size / 2;
+                        sum += weight * std::cos(k * (x * x + y * y));
+                    }
+                    plate[j * plate_size + i] = sum / plate_samples;
+                }
+            }
+        });
+
+        // Root mean square of the pattern within a band of radii, relative to that of cos.
+        auto contrast = [&](double r0, double r1) {
+            double sum = 0;
+            int count = 0;
+            for (int j = 0; j < plate_size; j++) {
+                for (int i = 0; i < plate_size; i++) {
+                    auto r = std::hypot(i - plate_size / 2, j - plate_size / 2);
+                    if (r0 <= r && r < r1) {
+                        sum += plate[j * plate_size + i] * plate[j * plate_size + i];
+                        count++;
+                    }
+                }
+            }
+            return std::sqrt(2 * sum / count);
+        };
+        std::cout << "filter " << rt::filter_name(type) << ": contrast below Nyquist "
+                  << contrast(0, nyquist_radius / 2) << ", aliasing above Nyquist "
+                  << contrast(1.25 * nyquist_radius, plate_size / 2) << std::endl;
+    }
+
+    const int width = 200;
+    const int height = 112;
+    const int samples = 16;
+    cam.image_width = width;
+    cam.aspect_ratio = double(width) / height;
+    cam.initialize();
+    rt::bvh world(s.world);
+
+    auto render = [&](int spp, double& seconds) {
+        std::vector<rt::vec3> image(width * height);
+        auto start = std::chrono::steady_clock::now();
+        rt::parallel_for(height, [&](int, int begin, int end) {
+            for (int j = begin; j < end; j++) {
+                for (int i = 0; i < width; i++) {
+                    rt::vec3 sum(0, 0, 0);
+                    for (int n = 0; n < spp; n++) {
+                        double weight;
+                        auto r = cam.get_ray(i, j, weight);
+                        sum += weight * ray_color(r, world, max_depth);
+                    }
+                    image[j * width + i] = sum / spp;
+                }
+            }
+        });
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return image;
+    };
+
+    for (auto type : types) {
+        cam.filter = type;
+        double seconds;
+        auto reference = render(reference_samples, seconds);
+        auto image = render(samples, seconds);
+        std::cout << "filter " << rt::filter_name(type) << ": " << samples << " spp RMSE "
+                  << rmse(image, reference) << ", " << 1000 * seconds / samples
+                  << " ms per sample pass" << std::endl;
+    }
+}
+
+// Path traces region of the frame with no window and writes it to path as a cropped PPM,
+// logging progress about once a second.
+void render_headless(const scene& s, rt::camera cam, int width, int height, int samples,
+                     int max_depth, const rt::render_region& region, const char* path)
+{
+    cam.aspect_ratio = double(width) / height;
+    cam.image_width = width;
     cam.initialize();
 
+    rt::bvh world(s.world);
+    rt::bucketed_bvh bounce_world(world);
+    rt::tile_culling primary_tiles(world, cam, width, height);
+    rt::hdr_buffer radiance(width, height);
+    std::vector<Color> pixels(size_t(width) * height, BLACK);
+
+    progress.start((long long)region.width() * region.height() * samples,
+                   std::min(rt::thread_count(), region.height()));
+    std::thread render([&] {
+        rt::parallel_for(region.height(), [&](int thread, int begin, int end) {
+            render_block(thread, region.y0 + begin, region.y0 + end, width, region, samples,
+                         max_depth, cam, bounce_world, primary_tiles, false, radiance,
+                         pixels.data());
+        });
+    });
+
+    auto status = progress.update();
+    while (!status.finished()) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        status = progress.update();
+        std::cout << int(100 * status.fraction()) << "%, " << status.rays_per_second / 1e6
+                  << " Mrays/s, " << status.threads_active << "/" << status.threads
+                  << " threads active, ETA " << int(status.eta) << "s" << std::endl;
+    }
+    render.join();
+
+    if (!rt::write_region_ppm(path, &pixels[0].r, width, height, region)) {
+        std::cerr << "Could not write " << path << std::endl;
+        return;
+    }
+    std::cout << "Rendered " << region.width() << "x" << region.height() << " at ("
+              << region.x0 << ", " << region.y0 << ") of " << width << "x" << height << " in "
+              << status.elapsed << "s to " << path << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    const int image_width = 800;
+    const int image_height = 450;
+    const int samples_per_pixel = 50;
+    const int max_depth = 10;
+    const int caustic_iterations = 32;
+    const int edit_samples = 4;
+
+    const char* scene_name = "spheres";
+    bool compare = false;
+    bool bench = false;
+    int object_count = 0;
+    const char* voxel_file = nullptr;
+    const char* height_file = nullptr;
+    const char* particle_file = nullptr;
+    bool quantize = false;
+    size_t page_cache_mb = 0;
+    auto radiance_format = rt::pixel_format::float32;
+    auto pixel_filter = rt::filter_type::box;
+    rt::render_region crop;
+    const char* output_file = nullptr;
+    for (int a = 1; a < argc; a++) {
+        if (std::strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+            scene_name = argv[++a];
+        else if (std::strcmp(argv[a], "--compare") == 0)
+            compare = true;
+        else if (std::strcmp(argv[a], "--voxels") == 0 && a + 1 < argc)
+            voxel_file = argv[++a];
+        else if (std::strcmp(argv[a], "--heights") == 0 && a + 1 < argc)
+            height_file = argv[++a];
+        else if (std::strcmp(argv[a], "--particles") == 0 && a + 1 < argc)
+            particle_file = argv[++a];
+        else if (std::strcmp(argv[a], "--quantize") == 0)
+            quantize = true;
+        else if (std::strcmp(argv[a], "--out-of-core") == 0 && a + 1 < argc)
+            page_cache_mb = size_t(std::atoi(argv[++a]));
+        else if (std::strcmp(argv[a], "--framebuffer") == 0 && a + 1 < argc)
+            radiance_format = parse_pixel_format(argv[++a]);
+        else if (std::strcmp(argv[a], "--filter") == 0 && a + 1 < argc)
+            pixel_filter = parse_filter(argv[++a]);
+        else if (std::strcmp(argv[a], "--crop") == 0 && a + 1 < argc) {
+            if (!rt::render_region::parse(argv[++a], crop)) {
+                std::cerr << "--crop expects x0,y0,x1,y1, not \"" << argv[a] << "\"" << std::endl;
+                return 1;
+            }
+        }
+        else if (std::strcmp(argv[a], "--output") == 0 && a + 1 < argc)
+            output_file = argv[++a];
+        else if (std::strcmp(argv[a], "--bench") == 0)
+            bench = true;
+        else if ((std::strcmp(argv[a], "--spheres") == 0 || std::strcmp(argv[a], "--strands") == 0)
+                 && a + 1 < argc)
+            object_count = std::atoi(argv[++a]);
+    }
+
+    scene sc;
+    rt::camera cam;
+    if (std::strcmp(scene_name, "interior") == 0)
+        interior_scene(sc, cam);
+    else if (std::strcmp(scene_name, "overlap") == 0)
+        overlapping_spheres_scene(sc, cam, object_count > 0 ? object_count : 5000);
+    else if (std::strcmp(scene_name, "clusters") == 0)
+        clustered_spheres_scene(sc, cam, object_count > 0 ? object_count : 20000);
+    else if (std::strcmp(scene_name, "voxels") == 0 || voxel_file)
+        voxel_scene(sc, cam, voxel_file);
+    else if (std::strcmp(scene_name, "terrain") == 0 || height_file)
+        terrain_scene(sc, cam, height_file);
+    else if (std::strcmp(scene_name, "particles") == 0 || particle_file)
+        particle_scene(sc, cam, object_count > 0 ? object_count : 1000000, particle_file, quantize,
+                       page_cache_mb * 1024 * 1024);
+    else if (std::strcmp(scene_name, "sdf") == 0)
+        sdf_scene(sc, cam);
+    else if (std::strcmp(scene_name, "hair") == 0)
+        hair_scene(sc, cam, object_count > 0 ? object_count : 100000);
+    else if (object_count > 0)
+        sphere_cloud_scene(sc, cam, object_count);
+    else
+        random_spheres_scene(sc, cam);
+    cam.filter = pixel_filter;
+
+    if (compare) {
+        compare_integrators(sc, cam, max_depth, 10.0, 1024);
+        compare_filters(sc, cam, max_depth, 256);
+        return 0;
+    }
+
+    if (bench) {
+        benchmark_accelerators(sc, cam);
+        benchmark_primary_culling(sc, cam);
+        benchmark_lazy_build(sc, cam);
+        benchmark_tone_mapping();
+        benchmark_splatting();
+        benchmark_framebuffer_formats(sc, cam);
+        benchmark_out_of_core(sc, cam);
+        return 0;
+    }
+
+    if (output_file) {
+        render_headless(sc, cam, image_width, image_height, samples_per_pixel, max_depth,
+                        crop.within(image_width, image_height), output_file);
+        return 0;
+    }
+    
+    const int num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0) {
+        std::cout << "Could not detect number of threads, using 4" << std::endl;
+    }
+    const int actual_threads = (num_threads == 0) ? 4 : num_threads;
+    
+    std::cout << "Using " << actual_threads << " threads for rendering" << std::endl;
+
+    SetConfigFlags(FLAG_VSYNC_HINT);
+    
+    InitWindow(image_width, image_height, "Multithreaded RayTracing - Raylib");
+    SetTargetFPS(60);
+
+    Color* pixels = (Color*)MemAlloc(image_width * image_height * sizeof(Color));
+    
+    for (int i = 0; i < image_width * image_height; i++) {
+        pixels[i] = BLACK;
+    }
+
+    rt::hdr_buffer radiance(image_width, image_height, radiance_format);
+
+    Image img = GenImageColor(image_width, image_height, BLACK);
+    Texture2D texture = LoadTextureFromImage(img);
+
+    rt::bvh world(sc.world);
+    // The path tracer's bounces skip the per-primitive virtual calls of the plain bvh.
+    rt::bucketed_bvh bounce_world(world);
+
+    cam.aspect_ratio = double(image_width) / image_height;
+    cam.image_width = image_width;
+    cam.samples_per_pixel = samples_per_pixel;
+    cam.max_depth = max_depth;
+    cam.initialize();
+
+    // The camera never moves, so the primary ray candidates are gathered once.
+    rt::tile_culling primary_tiles(world, cam, image_width, image_height);
+
+    rt::bdpt_integrator bdpt(world, sc.lights, cam);
+    bdpt.max_depth = max_depth;
+    rt::splat_buffer splats(image_width, image_height, actual_threads);
+
+    rt::restir_direct direct(world, sc.lights, cam, image_width, image_height);
+    direct.max_depth = max_depth;
+    if (!sc.open_sky)
+        direct.sky_fraction = 0;
+    std::vector<rt::vec3> direct_frame;
+    // The preview adds a whole frame at a time for thousands of frames, which no compact
+    // format survives: its rounding error passes the noise within a few hundred frames (see
+    // benchmark_framebuffer_formats), so the running sum is always float32.
+    rt::hdr_buffer direct_sum(image_width, image_height);
+    std::cout << "Framebuffer: " << rt::pixel_format_name(radiance_format) << ", "
+              << radiance.memory_bytes() / 1e6 << " MB; preview accumulation: float32, "
+              << direct_sum.memory_bytes() / 1e6 << " MB" << std::endl;
+
+    // Nothing edits geometry interactively yet; anything that does must bump this so the
+    // primary hit cache is rebuilt.
+    int geometry_version = 0;
+    rt::primary_hit_cache edit_cache(edit_samples);
+    const rt::vec3 edit_palette[] = {
+        rt::vec3(0.4, 0.2, 0.1), rt::vec3(0.1, 0.2, 0.5), rt::vec3(0.1, 0.45, 0.15),
+        rt::vec3(0.6, 0.08, 0.08), rt::vec3(0.75, 0.75, 0.75), rt::vec3(0.05, 0.05, 0.05),
+    };
+    const int palette_size = int(sizeof(edit_palette) / sizeof(edit_palette[0]));
+    int palette_index = -1;   // The scene's own albedo until the first change.
+
+    rt::pssmlt_renderer metropolis(
+        [&](int i, int j) {
+            double weight;
+            auto r = cam.get_ray(i, j, weight);
+            return weight * ray_color(r, world, max_depth);
+        },
+        image_width, image_height);
+    metropolis.mutations_per_pixel = samples_per_pixel;
+
+    // Each chain is reported as a tile of the whole frame as it finishes: its mutations spread
+    // over the image, so its cost prices the rest. The timers start once the bootstrap pass is
+    // over, and the chains run on fresh threads, whose ray counts start from zero.
+    std::vector<std::unique_ptr<rt::tile_timer>> chain_timers(rt::thread_count());
+    metropolis.chains_starting = [&] {
+        for (int t = 0; t < int(chain_timers.size()); t++)
+            chain_timers[t] = std::make_unique<rt::tile_timer>(progress, t, 0);
+    };
+    metropolis.chain_done = [&](int thread, int64_t mutations) {
+        chain_timers[thread]->finish(rt::render_region::full_frame(image_width, image_height),
+                                     mutations, rays_traced, true);
+    };
+    metropolis.thread_done = [&](int) { progress.thread_done(); };
+
+    const auto full_frame = rt::render_region::full_frame(image_width, image_height);
+    auto region = crop.within(image_width, image_height);
+    rt::render_region drag;
+    bool dragging = false;
+
     bool rendering = false;
     bool rendered = false;
+    bool caustics = false;
+    integrator mode = integrator::path;
+    bool direct_preview = false;
+    bool material_edit = false;
+    bool edit_dirty = false;
+    double edit_milliseconds = 0;
+    bool gathering_caustics = false;
     std::vector<std::thread> threads;
+    std::thread photon_thread;
+    std::atomic<int> photon_iterations(0);
+    std::unique_ptr<rt::photon_mapper> caustic_map;
     
     while (!WindowShouldClose()) {
         BeginDrawing();
         ClearBackground(RAYWHITE);
 
+        if (!rendering && !rendered && IsKeyPressed(KEY_C)) {
+            caustics = !caustics;
+        }
+
+        if (!rendering && !rendered && IsKeyPressed(KEY_B)) {
+            mode = (mode == integrator::path) ? integrator::bdpt
+                 : (mode == integrator::bdpt) ? integrator::metropolis : integrator::path;
+            // Metropolis chains wander the whole frame, so it has no region to render.
+            if (mode == integrator::metropolis
+                && (region.width() != image_width || region.height() != image_height)) {
+                region = full_frame;
+                std::cout << "Metropolis renders the whole frame; region cleared" << std::endl;
+            }
+        }
+
+        if (!rendering && !rendered && !gathering_caustics && IsKeyPressed(KEY_L)) {
+            direct_preview = !direct_preview;
+            material_edit = false;
+            direct.reset();
+            direct_sum.clear();
+            if (direct_preview && cam.filter != rt::filter_type::box)
+                std::cout << "The ReSTIR preview only has a box filter; "
+                          << rt::filter_name(cam.filter) << " is not applied" << std::endl;
+        }
+
+        if (!rendering && !rendered && !gathering_caustics && IsKeyPressed(KEY_M)
+            && (sc.edit_diffuse || sc.edit_metal)) {
+            material_edit = !material_edit;
+            direct_preview = false;
+            edit_dirty = material_edit;
+        }
+
+        if (material_edit && !rendering && !rendered) {
+            if (sc.edit_metal && (IsKeyPressed(KEY_UP) || IsKeyPressed(KEY_DOWN))) {
+                auto step = IsKeyPressed(KEY_UP) ? 0.05 : -0.05;
+                sc.edit_metal->set_fuzz(std::clamp(sc.edit_metal->fuzziness() + step, 0.0, 1.0));
+                edit_dirty = true;
+            }
+            if (sc.edit_diffuse && (IsKeyPressed(KEY_LEFT) || IsKeyPressed(KEY_RIGHT))) {
+                palette_index += IsKeyPressed(KEY_RIGHT) ? 1 : palette_size - 1;
+                palette_index %= palette_size;
+                sc.edit_diffuse->set_albedo(edit_palette[palette_index]);
+                edit_dirty = true;
+            }
+
+            // Materials only change here, between previews, so the cached primary hits stay
+            // valid and each preview traces nothing but the bounces after them.
+            if (edit_dirty) {
+                auto start = std::chrono::steady_clock::now();
+                if (!edit_cache.matches(cam, geometry_version))
+                    edit_cache.build(primary_tiles, cam, image_width, image_height, geometry_version);
+                render_cached(edit_cache, bounce_world, primary_tiles, image_width, image_height,
+                              max_depth, radiance, pixels);
+                std::chrono::duration<double, std::milli> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                edit_milliseconds = elapsed.count();
+                UpdateTexture(texture, pixels);
+                edit_dirty = false;
+            }
+        }
+
+        // Display settings only rerun the tone mapping over the radiance already traced; the
+        // direct lighting preview picks them up on its next frame by itself.
+        if (!rendering && !gathering_caustics) {
+            bool changed = true;
+            if (IsKeyPressed(KEY_EQUAL) || IsKeyPressed(KEY_KP_ADD))
+                display.exposure += 0.5;
+            else if (IsKeyPressed(KEY_MINUS) || IsKeyPressed(KEY_KP_SUBTRACT))
+                display.exposure -= 0.5;
+            else if (IsKeyPressed(KEY_T))
+                display.curve = (display.curve == rt::tone_curve::clamp) ? rt::tone_curve::reinhard
+                              : (display.curve == rt::tone_curve::reinhard) ? rt::tone_curve::aces
+                              : rt::tone_curve::clamp;
+            else if (IsKeyPressed(KEY_D))
+                display.dither = !display.dither;
+            else
+                changed = false;
+
+            if (changed && !direct_preview) {
+                show(radiance, 1.0, pixels);
+                UpdateTexture(texture, pixels);
+            }
+        }
+
+        if (direct_preview && !rendering && !rendered) {
+            // Progressive direct lighting: one resampled sample per pixel per frame, with
+            // reservoirs carried over between frames while the camera stays put.
+            direct.render_frame(direct_frame);
+            for (int j = 0; j < image_height; j++)
+                for (int i = 0; i < image_width; i++)
+                    direct_sum.add(i, j, direct_frame[j * image_width + i]);
+            show(direct_sum, 1.0 / direct.frames(), pixels);
+            UpdateTexture(texture, pixels);
+        }
+
         if (!rendering && !rendered && IsKeyPressed(KEY_SPACE)) {
+            direct_preview = false;
+            material_edit = false;
             rendering = true;
-            completed_rows.store(0);
-            
-            int rows_per_thread = image_height / actual_threads;
-            int remaining_rows = image_height % actual_threads;
+            if (mode == integrator::bdpt && cam.filter != rt::filter_type::box)
+                std::cout << "BDPT only has a box filter; " << rt::filter_name(cam.filter)
+                          << " is not applied" << std::endl;
+            for (auto& shape : sc.sdfs)
+                shape->reset_stats();
+            // A region shorter than the thread count gets one row per thread.
+            int render_threads = std::min(actual_threads, region.height());
+            if (mode == integrator::metropolis)
+                progress.start((long long)image_width * image_height * samples_per_pixel,
+                               metropolis.chain_threads());
+            else
+                progress.start((long long)region.width() * region.height() * samples_per_pixel,
+                               render_threads);
+
+            int rows_per_thread = region.height() / render_threads;
+            int remaining_rows = region.height() % render_threads;
             
             threads.clear();
             threads.reserve(actual_threads);
+            splats.clear();
+
+            if (mode == integrator::metropolis) {
+                // The chains are spread over every core inside render(); this thread only
+                // keeps the UI responsive while they run.
+                threads.emplace_back([&] {
+                    std::vector<rt::vec3> image;
+                    metropolis.render(image);
+                    for (int j = 0; j < image_height; j++)
+                        for (int i = 0; i < image_width; i++)
+                            radiance.set(i, j, image[j * image_width + i]);
+                });
+            }
             
-            for (int t = 0; t < actual_threads; t++) {
-                int start_row = t * rows_per_thread;
+            for (int t = 0; t < render_threads && mode != integrator::metropolis; t++) {
+                int start_row = region.y0 + t * rows_per_thread;
                 int end_row = start_row + rows_per_thread;
                 
-                if (t == actual_threads - 1) {
+                if (t == render_threads - 1) {
                     end_row += remaining_rows;
                 }
                 
-                threads.emplace_back(render_block, start_row, end_row, image_width, 
-                                   image_height, samples_per_pixel, max_depth, 
-                                   std::ref(cam), std::cref(world), pixels);
+                if (mode == integrator::bdpt) {
+                    threads.emplace_back(render_block_bdpt, t, start_row, end_row, image_width,
+                                       std::cref(region), samples_per_pixel, std::cref(bdpt),
+                                       std::ref(splats), std::ref(radiance), pixels);
+                    continue;
+                }
+
+                threads.emplace_back(render_block, t, start_row, end_row, image_width,
+                                   std::cref(region), samples_per_pixel, max_depth,
+                                   std::ref(cam), std::cref(bounce_world), std::cref(primary_tiles),
+                                   caustics, std::ref(radiance), pixels);
             }
             
-            std::cout << "Started rendering with " << actual_threads << " threads..." << std::endl;
+            std::cout << "Started rendering with " << render_threads << " threads..." << std::endl;
         }
         
         if (rendering && !rendered) {
-            int current_completed = completed_rows.load();
-            
-            bool all_finished = true;
-            for (auto& thread : threads) {
-                if (thread.joinable()) {
-                    all_finished = false;
-                    break;
-                }
-            }
-            
-            if (current_completed >= image_height || all_finished) {
+            bool new_tiles = false;
+            auto status = progress.update([&](const rt::tile_event&) { new_tiles = true; });
+
+            if (status.finished()) {
                 for (auto& thread : threads) {
                     if (thread.joinable()) {
                         thread.join();
                     }
                 }
                 
+                if (mode == integrator::bdpt) {
+                    // Light subpaths only start from the region's pixels, fewer than a full
+                    // frame would start, so their splats are scaled up to match.
+                    auto light_paths = double(region.width()) * region.height() * samples_per_pixel;
+                    splats.add_to(radiance, double(image_width) * image_height / light_paths,
+                                  region);
+                    show(radiance, 1.0, pixels);
+                } else if (mode == integrator::metropolis) {
+                    show(radiance, 1.0, pixels);
+                }
+
                 UpdateTexture(texture, pixels);
                 rendering = false;
-                rendered = true;
-                std::cout << "\nRendering completed!" << std::endl;
+
+                if (caustics && mode == integrator::path) {
+                    // The photon passes run off the UI thread; the path traced image stays
+                    // on screen until they are composited on top of it.
+                    gathering_caustics = true;
+                    photon_iterations.store(0);
+                    caustic_map = std::make_unique<rt::photon_mapper>(
+                        world, sc.caustic_casters, cam, image_width, image_height);
+                    caustic_map->max_depth = max_depth;
+
+                    photon_thread = std::thread([&] {
+                        for (int k = 0; k < caustic_iterations; k++) {
+                            caustic_map->iterate();
+                            photon_iterations.fetch_add(1);
+                        }
+                    });
+                    std::cout << "Path tracing done, gathering caustics..." << std::endl;
+                } else {
+                    rendered = true;
+                    std::cout << "\nRendering completed in " << status.elapsed << "s, "
+                              << status.samples_per_second / 1e6 << " Msamples/s, "
+                              << status.rays_per_second / 1e6 << " Mrays/s" << std::endl;
+                    report_sdf_steps(sc);
+                }
             } else {
-                static int last_update = 0;
-                if (current_completed - last_update >= 10) { 
+                // Finished rows and preview levels are on screen as soon as they are reported.
+                if (new_tiles)
                     UpdateTexture(texture, pixels);
-                    last_update = current_completed;
-                }
-                
-                float progress = (float)current_completed / image_height;
-                DrawText(TextFormat("Rendering: %.1f%% (%d/%d threads active)", 
-                        progress * 100, actual_threads, actual_threads), 10, 10, 20, BLACK);
-                DrawRectangle(10, 40, (int)(400 * progress), 20, GREEN);
+
+                float fraction = (float)status.fraction();
+                DrawText(TextFormat("Rendering: %.1f%% (%d/%d threads active)", fraction * 100,
+                                    status.threads_active, status.threads), 10, 10, 20, BLACK);
+                DrawRectangle(10, 40, (int)(400 * fraction), 20, GREEN);
+                DrawRectangleLines(10, 40, 400, 20, BLACK);
+                DrawText(status.eta < 0
+                             ? TextFormat("%.2f Mrays/s", status.rays_per_second / 1e6)
+                             : TextFormat("%.2f Mrays/s, %.2f Msamples/s, ETA %.0fs",
+                                          status.rays_per_second / 1e6,
+                                          status.samples_per_second / 1e6, status.eta),
+                         10, 65, 16, DARKGRAY);
+            }
+        }
+
+        if (gathering_caustics) {
+            int done = photon_iterations.load();
+
+            if (done >= caustic_iterations) {
+                photon_thread.join();
+
+                // Composited into the radiance itself, so later display changes keep them.
+                for (int j = region.y0; j < region.y1; j++)
+                    for (int i = region.x0; i < region.x1; i++)
+                        radiance.set(i, j, radiance.get(i, j) + caustic_map->radiance(i, j));
+                show(radiance, 1.0, pixels);
+
+                UpdateTexture(texture, pixels);
+                gathering_caustics = false;
+                rendered = true;
+                std::cout << "\nRendering completed! (" << caustic_map->photons_stored()
+                          << " caustic photons in the last pass)" << std::endl;
+                report_sdf_steps(sc);
+            } else {
+                float progress = (float)done / caustic_iterations;
+                DrawText(TextFormat("Caustics: photon pass %d/%d", done, caustic_iterations),
+                         10, 10, 20, BLACK);
+                DrawRectangle(10, 40, (int)(400 * progress), 20, YELLOW);
                 DrawRectangleLines(10, 40, 400, 20, BLACK);
             }
         }
 
         DrawTexture(texture, 0, 0, WHITE);
         
-        if (!rendering && !rendered) {
+        if (!rendering && !rendered && !gathering_caustics) {
             DrawText("Press SPACE to start multithreaded rendering", 10, 10, 20, BLACK);
             DrawText(TextFormat("Will use %d threads", actual_threads), 10, 35, 16, DARKGRAY);
+            DrawText(TextFormat("C: photon mapped caustics [%s]", caustics ? "on" : "off"),
+                     10, 55, 16, DARKGRAY);
+            DrawText(TextFormat("B: integrator [%s]", integrator_name(mode)),
+                     10, 75, 16, DARKGRAY);
+            DrawText(direct_preview
+                         ? TextFormat("L: direct lighting preview (ReSTIR), %d spp", direct.frames())
+                         : "L: direct lighting preview (ReSTIR)",
+                     10, 95, 16, DARKGRAY);
+            DrawText(material_edit
+                         ? TextFormat("M: material editor, %d spp from cached hits in %.0f ms",
+                                      edit_cache.samples_per_pixel(), edit_milliseconds)
+                         : "M: material editor",
+                     10, 115, 16, DARKGRAY);
+            if (material_edit) {
+                DrawText("UP/DOWN: metal fuzz   LEFT/RIGHT: diffuse albedo", 10, 135, 16, DARKGRAY);
+            }
+            draw_display_settings(material_edit ? 155 : 135);
         } else if (rendered) {
             DrawText("Rendering complete! Press R to render again, ESC to exit", 10, 10, 20, BLACK);
             DrawText(TextFormat("Rendered with %d threads", actual_threads), 10, 35, 16, DARKGREEN);
-            
-            if (IsKeyPressed(KEY_R)) {
+            draw_display_settings(55);
+            DrawText(mode == integrator::metropolis
+                         ? "S: save to render.ppm (Metropolis renders the whole frame)"
+                         : "Drag: render region   S: save region to render.ppm",
+                     10, 75, 16, DARKGRAY);
+
+            // The finished frame stays, so a render of just a region lands on top of it.
+            if (IsKeyPressed(KEY_R))
                 rendered = false;
-                for (int i = 0; i < image_width * image_height; i++) {
-                    pixels[i] = BLACK;
+
+            if (IsKeyPressed(KEY_S)) {
+                if (rt::write_region_ppm("render.ppm", &pixels[0].r, image_width, image_height,
+                                         region))
+                    std::cout << "Saved " << region.width() << "x" << region.height()
+                              << " at (" << region.x0 << ", " << region.y0 << ") to render.ppm"
+                              << std::endl;
+            }
+        }
+
+        // Dragging a rectangle picks the region the next render covers; a right click, or a
+        // drag too small to mean anything, goes back to the whole frame. Not for Metropolis.
+        if (!rendering && !gathering_caustics && mode != integrator::metropolis) {
+            auto mouse = GetMousePosition();
+            if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
+                drag = { int(mouse.x), int(mouse.y), int(mouse.x), int(mouse.y) };
+                dragging = true;
+            }
+            if (dragging) {
+                drag.x1 = int(mouse.x);
+                drag.y1 = int(mouse.y);
+                if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
+                    dragging = false;
+                    auto picked = drag.within(image_width, image_height);
+                    region = (picked.width() < 4 || picked.height() < 4) ? full_frame : picked;
                 }
-                UpdateTexture(texture, pixels);
             }
+            if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))
+                region = full_frame;
         }
 
+        auto outline = dragging ? drag.within(image_width, image_height) : region;
+        if (outline.width() != image_width || outline.height() != image_height)
+            DrawRectangleLines(outline.x0, outline.y0, outline.width(), outline.height(), RED);
+
         EndDrawing();
     }
 
@@ -243,6 +1924,10 @@ int main() {
         }
     }
 
+    if (photon_thread.joinable()) {
+        photon_thread.join();
+    }
+
     UnloadTexture(texture);
     
     MemFree(pixels);